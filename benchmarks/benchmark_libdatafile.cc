@@ -0,0 +1,484 @@
+/*! \file benchmark_libdatafile.cc
+ *
+ * Benchmark suite for libdatafile. Synthetic MCS and HiDens recordings of
+ * a configurable length are generated, and the throughput and latency of
+ * the common read and write paths are measured on them. Each measurement
+ * is reported as one JSON object per line, so that results from different
+ * releases can be collected and compared by scripts.
+ *
+ * Usage:
+ * 	$ ./benchmark_libdatafile [--seconds S] [--repeats N] [--read-size N]
+ * 		[--write-size N] [--snippets N] [--mcs-only | --hidens-only]
+ * 		[--prefix PATH] [--output FILE] [--seed N] [--keep]
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "../include/datafile.h"
+#include "../include/hidensfile.h"
+#include "../include/snipfile.h"
+#include "../include/hidenssnipfile.h"
+#include "../include/synthetic.h"
+
+#include <sys/stat.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+/* Options controlling the size of the generated recordings and
+ * the number of timed calls for each benchmark.
+ */
+struct Options {
+	double seconds = 60.;					// Length of each synthetic recording
+	int repeats = 200;						// Timed calls for random-access benchmarks
+	int readSize = 2000;					// Samples per random read
+	int writeSize = datafile::BlockSize;	// Samples per setData() call
+	int nsnippets = 2000;					// Snippets per channel
+	bool mcs = true;						// Benchmark MCS recordings
+	bool hidens = true;						// Benchmark HiDens recordings
+	bool keep = false;						// Keep generated files
+	std::string prefix = "benchmark";		// Prefix for generated file names
+	std::string output;						// Output file, stdout if empty
+	unsigned int seed = 0;					// Seed for synthetic data and offsets
+	bool help = false;						// Print usage and exit
+};
+
+/* Collects the duration of each timed call of a single benchmark. */
+class Timings {
+	public:
+		template<class F>
+		void time(F&& f)
+		{
+			auto start = std::chrono::steady_clock::now();
+			f();
+			auto end = std::chrono::steady_clock::now();
+			m_durations.push_back(std::chrono::duration<double>(end - start).count());
+		}
+
+		size_t count() const { return m_durations.size(); }
+
+		double total() const
+		{
+			double t = 0.;
+			for (auto& d : m_durations)
+				t += d;
+			return t;
+		}
+
+		/* Return the q-th quantile (q in [0, 1]) of the durations, in seconds,
+		 * using the nearest-rank method.
+		 */
+		double percentile(double q) const
+		{
+			if (m_durations.empty())
+				return 0.;
+			auto sorted = m_durations;
+			std::sort(sorted.begin(), sorted.end());
+			auto rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+			return sorted[std::min(std::max(rank, static_cast<size_t>(1)), sorted.size()) - 1];
+		}
+
+	private:
+		std::vector<double> m_durations;
+};
+
+/* Write a single benchmark result as a line of JSON. The size of a file
+ * on disk, if given, is reported in its own field.
+ */
+void report(std::ostream& out, const std::string& recording,
+		const std::string& benchmark, const Timings& t, double bytes,
+		double fileBytes = -1.)
+{
+	auto total = t.total();
+	char line[1024];
+	std::snprintf(line, sizeof(line),
+			"{\"recording\": \"%s\", \"benchmark\": \"%s\", \"calls\": %zu, "
+			"\"bytes\": %.0f, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+			"\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+			"\"p999_us\": %.3f, \"max_us\": %.3f",
+			recording.c_str(), benchmark.c_str(), t.count(), bytes, total,
+			(total > 0.) ? (bytes / (1024. * 1024.)) / total : 0.,
+			t.percentile(0.5) * 1e6, t.percentile(0.9) * 1e6,
+			t.percentile(0.99) * 1e6, t.percentile(0.999) * 1e6,
+			t.percentile(1.0) * 1e6);
+	out << line;
+	if (fileBytes >= 0.)
+		out << ", \"file_bytes\": " << static_cast<uint64_t>(fileBytes);
+	out << "}" << std::endl;
+}
+
+bool fileExists(const std::string& name)
+{
+	struct stat buf;
+	return (stat(name.c_str(), &buf) == 0);
+}
+
+/* Create a recording file of the requested kind. */
+std::unique_ptr<datafile::DataFile> createRecording(const std::string& kind,
+		const std::string& filename)
+{
+	if (kind == "hidens") {
+		std::unique_ptr<hidensfile::HidensFile> hf(new hidensfile::HidensFile(filename));
+		Configuration config;
+		for (int i = 0; i < hf->nchannels(); i++) {
+			uint32_t index = static_cast<uint32_t>(i);
+			uint16_t x = static_cast<uint16_t>(i % 16), y = static_cast<uint16_t>(i / 16);
+			config.push_back(Electrode{ index, x * 18u, x, y * 18u, y, 0 });
+		}
+		hf->setConfiguration(config);
+		return std::move(hf);
+	}
+	return std::unique_ptr<datafile::DataFile>(new datafile::DataFile(filename));
+}
+
+/* Generate and benchmark a single synthetic recording.
+ * T is the in-memory sample type used by clients of this kind of
+ * recording, e.g., int16_t for MCS data and uint8_t for HiDens data.
+ */
+template<class T>
+void benchmarkRecording(const std::string& kind, const Options& opts, std::ostream& out)
+{
+	const std::string filename = opts.prefix + "-" + kind + datafile::FileExtension;
+	const std::string snipname = opts.prefix + "-" + kind + snipfile::FILE_EXTENSION;
+	if (fileExists(filename))
+		std::remove(filename.c_str());
+	if (fileExists(snipname))
+		std::remove(snipname.c_str());
+
+	std::mt19937 rng(opts.seed);
+
+	/* Generate the recording, timing each call to setData(). The number of
+	 * samples is rounded to a multiple of the write size, so that each
+	 * call writes the same amount of data.
+	 */
+	int nchannels = 0, nsamples = 0;
+	size_t sampleSize = 0;
+	{
+		auto df = createRecording(kind, filename);
+		nchannels = df->nchannels();
+		sampleSize = df->dtype().getSize();
+		int nwrites = std::max(1, static_cast<int>(
+					opts.seconds * df->sampleRate() / opts.writeSize));
+		nsamples = nwrites * opts.writeSize;
+
+		/* Each call writes the same block of realistic synthetic data */
+		auto params = (kind == "hidens") ? synthetic::Parameters::hidens() :
+				synthetic::Parameters();
+		params.seed = opts.seed;
+		auto truth = synthetic::spikeTimes(params, nchannels,
+				df->sampleRate(), opts.writeSize);
+		arma::Mat<T> block = arma::conv_to<arma::Mat<T> >::from(
+				synthetic::generateBlock(params, nchannels, df->sampleRate(),
+				0, opts.writeSize, truth));
+
+		Timings writes;
+		for (int start = 0; start < nsamples; start += opts.writeSize) {
+			writes.time([&]() { df->setData(start, start + opts.writeSize, block); });
+		}
+		report(out, kind, "write", writes,
+				static_cast<double>(nsamples) * nchannels * sampleSize);
+
+		df->setGain(1.0);
+		df->setOffset(0.0);
+		df->setDate("2016-01-01T00:00:00");
+		Timings close;
+		close.time([&]() { df.reset(nullptr); });
+		report(out, kind, "close-after-write", close, 0.);
+	}
+
+	/* Time opening (and closing) the existing file. */
+	{
+		Timings open;
+		for (int i = 0; i < opts.repeats; i++) {
+			open.time([&]() { datafile::DataFile df(filename); });
+		}
+		report(out, kind, "open", open, 0.);
+	}
+
+	datafile::DataFile df(filename);
+	int readSize = std::min(opts.readSize, nsamples);
+
+	/* Sequential reads of all channels, in file-sized blocks */
+	{
+		Timings reads;
+		arma::Mat<T> mat;
+		for (int start = 0; start < nsamples; start += datafile::BlockSize) {
+			int end = std::min(start + datafile::BlockSize, nsamples);
+			reads.time([&]() { df.data(start, end, mat); });
+		}
+		report(out, kind, "sequential-read", reads,
+				static_cast<double>(nsamples) * nchannels * sampleSize);
+	}
+
+	/* Random reads of all channels */
+	{
+		std::uniform_int_distribution<int> offsets(0, nsamples - readSize);
+		Timings reads;
+		arma::Mat<T> mat;
+		for (int i = 0; i < opts.repeats; i++) {
+			int start = offsets(rng);
+			reads.time([&]() { df.data(start, start + readSize, mat); });
+		}
+		report(out, kind, "random-read", reads,
+				static_cast<double>(opts.repeats) * readSize * nchannels * sampleSize);
+	}
+
+	/* Random reads of single channels, converted to voltages */
+	{
+		std::uniform_int_distribution<int> offsets(0, nsamples - readSize);
+		std::uniform_int_distribution<int> channels(0, nchannels - 1);
+		Timings reads;
+		arma::vec v;
+		for (int i = 0; i < opts.repeats; i++) {
+			int start = offsets(rng), channel = channels(rng);
+			reads.time([&]() { v = df.data(channel, start, start + readSize); });
+		}
+		report(out, kind, "single-channel-read", reads,
+				static_cast<double>(opts.repeats) * readSize * sampleSize);
+	}
+
+	/* Windows of all channels around many events, read one event at a
+	 * time and gathered in a single call to readWindows().
+	 */
+	{
+		const int nbefore = synthetic::WaveformSamplesBefore;
+		const int nafter = synthetic::WaveformSamplesAfter;
+		const int windowSize = nbefore + nafter + 1;
+		std::uniform_int_distribution<int> events(nbefore, nsamples - nafter - 1);
+		arma::uvec samples(opts.nsnippets);
+		for (auto& s : samples)
+			s = events(rng);
+		arma::uvec channels(nchannels);
+		for (int c = 0; c < nchannels; c++)
+			channels(c) = c;
+		const double bytes = static_cast<double>(opts.nsnippets) *
+				windowSize * nchannels * sampleSize;
+
+		Timings single, gather;
+		arma::Mat<T> mat;
+		for (auto s : samples) {
+			single.time([&]() { df.data(s - nbefore, s + nafter + 1, mat); });
+		}
+		report(out, kind, "window-read-single", single, bytes);
+
+		arma::Cube<T> windows;
+		for (int i = 0; i < opts.repeats; i++) {
+			gather.time([&]() { df.readWindows(samples, nbefore, nafter, channels, windows); });
+		}
+		report(out, kind, "window-read-gather", gather, bytes * opts.repeats);
+	}
+
+	/* Snippet writes. Snippets are stored as (snippet_size, nsnippets). */
+	const size_t nbefore = (kind == "hidens") ?
+			hidenssnipfile::NUM_SAMPLES_BEFORE : snipfile::NUM_SAMPLES_BEFORE;
+	const size_t nafter = (kind == "hidens") ?
+			hidenssnipfile::NUM_SAMPLES_AFTER : snipfile::NUM_SAMPLES_AFTER;
+	const size_t snipSize = nbefore + nafter + 1;
+	const double snipBytes = static_cast<double>(nchannels) * opts.nsnippets *
+			(snipSize * sizeof(short) + sizeof(arma::uword));
+	std::vector<arma::uvec> snipIdx(nchannels);
+	std::vector<arma::Mat<short> > snipData(nchannels);
+	arma::uvec snipChannels(nchannels);
+	{
+		std::uniform_int_distribution<int> samples(0, nsamples - 1);
+		std::uniform_int_distribution<int> values(-512, 511);
+		for (int c = 0; c < nchannels; c++) {
+			snipIdx[c].set_size(opts.nsnippets);
+			for (auto& i : snipIdx[c])
+				i = samples(rng);
+			snipIdx[c] = arma::sort(snipIdx[c]);
+			snipData[c].set_size(snipSize, opts.nsnippets);
+			for (auto& v : snipData[c])
+				v = static_cast<short>(values(rng));
+			snipChannels(c) = c;
+		}
+	}
+	{
+		auto& idx = snipIdx;
+		auto& snips = snipData;
+		auto& channels = snipChannels;
+		Timings writes, close;
+		std::unique_ptr<snipfile::SnipFile> sf(new snipfile::SnipFile(snipname, df, nbefore, nafter));
+		sf->setChannels(channels);
+		sf->setThresholds(arma::vec(nchannels, arma::fill::ones));
+		writes.time([&]() { sf->writeSpikeSnips(idx, snips); });
+		writes.time([&]() { sf->writeNoiseSnips(idx, snips); });
+		close.time([&]() { sf.reset(nullptr); });
+		report(out, kind, "snippet-write", writes, 2 * snipBytes);
+		report(out, kind, "snippet-close-after-write", close, 0.);
+	}
+
+	/* Snippet file open time and reads */
+	{
+		Timings open;
+		for (int i = 0; i < opts.repeats; i++) {
+			open.time([&]() { snipfile::SnipFile sf(snipname); });
+		}
+		report(out, kind, "snippet-open", open, 0.);
+
+		snipfile::SnipFile sf(snipname);
+		std::vector<arma::uvec> idx;
+		std::vector<arma::Mat<short> > snips;
+		Timings all;
+		all.time([&]() { sf.spikeSnips(idx, snips); });
+		report(out, kind, "snippet-read-all", all, snipBytes);
+
+		std::uniform_int_distribution<int> channels(0, nchannels - 1);
+		Timings single;
+		arma::uvec cidx;
+		arma::Mat<short> csnips;
+		for (int i = 0; i < opts.repeats; i++) {
+			arma::uword channel = channels(rng);
+			single.time([&]() { sf.spikeSnips(channel, cidx, csnips); });
+		}
+		report(out, kind, "snippet-read-channel", single,
+				static_cast<double>(opts.repeats) * snipBytes / nchannels);
+	}
+
+	/* Speed of writing and reading the snippet file with each kind of
+	 * compression, and the size of the file on disk.
+	 */
+	{
+		const std::string compressedName = opts.prefix + "-" + kind +
+				"-compressed" + snipfile::FILE_EXTENSION;
+		const std::vector<std::pair<std::string, snipfile::Compression> > compressions = {
+			{ "none", snipfile::NO_COMPRESSION },
+			{ "deflate", snipfile::DEFLATE },
+			{ "nbit", snipfile::NBIT },
+			{ "scale-offset", snipfile::SCALE_OFFSET }
+		};
+		for (auto& c : compressions) {
+			if (fileExists(compressedName))
+				std::remove(compressedName.c_str());
+			snipfile::StorageOptions options;
+			options.chunkSnippets = snipfile::DEFAULT_CHUNK_SNIPPETS;
+			options.compression = c.second;
+			options.nbits = 11;
+			options.deltaIndices = true;
+			Timings writes;
+			{
+				snipfile::SnipFile sf(compressedName, df, nbefore, nafter, options);
+				sf.setChannels(snipChannels);
+				sf.setThresholds(arma::vec(nchannels, arma::fill::ones));
+				writes.time([&]() { sf.writeSpikeSnips(snipIdx, snipData); });
+			}
+			struct stat buf;
+			if (stat(compressedName.c_str(), &buf) == 0) {
+				report(out, kind, "snippet-size-" + c.first, writes, snipBytes,
+						static_cast<double>(buf.st_size));
+			} else {
+				std::cerr << "Could not find the size of " << compressedName
+					<< ", skipping snippet-size-" << c.first << std::endl;
+			}
+
+			snipfile::SnipFile sf(compressedName);
+			std::vector<arma::uvec> idx;
+			std::vector<arma::Mat<short> > snips;
+			Timings reads;
+			for (int i = 0; i < opts.repeats; i++)
+				reads.time([&]() { sf.spikeSnips(idx, snips); });
+			report(out, kind, "snippet-read-all-" + c.first, reads,
+					static_cast<double>(opts.repeats) * snipBytes);
+		}
+		std::remove(compressedName.c_str());
+	}
+
+	if (!opts.keep) {
+		std::remove(filename.c_str());
+		std::remove(snipname.c_str());
+	}
+}
+
+void usage(const char* name)
+{
+	std::cerr << "Usage: " << name << " [--seconds S] [--repeats N] [--read-size N]"
+		<< " [--write-size N] [--snippets N] [--mcs-only | --hidens-only]"
+		<< " [--prefix PATH] [--output FILE] [--seed N] [--keep] [--help]" << std::endl;
+}
+
+bool parseOptions(int argc, char* argv[], Options& opts)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		bool hasValue = (i + 1 < argc);
+		if (arg == "--seconds" && hasValue) {
+			opts.seconds = std::atof(argv[++i]);
+		} else if (arg == "--repeats" && hasValue) {
+			opts.repeats = std::atoi(argv[++i]);
+		} else if (arg == "--read-size" && hasValue) {
+			opts.readSize = std::atoi(argv[++i]);
+		} else if (arg == "--write-size" && hasValue) {
+			opts.writeSize = std::atoi(argv[++i]);
+		} else if (arg == "--snippets" && hasValue) {
+			opts.nsnippets = std::atoi(argv[++i]);
+		} else if (arg == "--prefix" && hasValue) {
+			opts.prefix = argv[++i];
+		} else if (arg == "--output" && hasValue) {
+			opts.output = argv[++i];
+		} else if (arg == "--seed" && hasValue) {
+			opts.seed = static_cast<unsigned int>(std::atoi(argv[++i]));
+		} else if (arg == "--mcs-only") {
+			opts.hidens = false;
+		} else if (arg == "--hidens-only") {
+			opts.mcs = false;
+		} else if (arg == "--keep") {
+			opts.keep = true;
+		} else if ( (arg == "--help") || (arg == "-h") ) {
+			opts.help = true;
+		} else {
+			return false;
+		}
+	}
+	return (opts.seconds > 0) && (opts.repeats > 0) && (opts.readSize > 0) &&
+		(opts.writeSize > 0) && (opts.nsnippets > 0);
+}
+
+} // end anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+	if (!parseOptions(argc, argv, opts)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	std::ofstream file;
+	if (!opts.output.empty()) {
+		file.open(opts.output);
+		if (!file) {
+			std::cerr << "Could not open output file: " << opts.output << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out = opts.output.empty() ? std::cout : file;
+
+	try {
+		if (opts.mcs)
+			benchmarkRecording<int16_t>("mcs", opts, out);
+		if (opts.hidens)
+			benchmarkRecording<uint8_t>("hidens", opts, out);
+	} catch (std::exception& e) {
+		std::cerr << "Benchmark failed: " << e.what() << std::endl;
+		return 1;
+	} catch (H5::Exception& e) {
+		std::cerr << "Benchmark failed: " << e.getDetailMsg() << std::endl;
+		return 1;
+	}
+	return 0;
+}
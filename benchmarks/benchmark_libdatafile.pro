@@ -0,0 +1,24 @@
+######################################################################
+# Benchmark suite for libdatafile read/write paths.
+######################################################################
+
+TEMPLATE = app
+TARGET = benchmark_libdatafile
+INCLUDEPATH += . \
+	/usr/local/include \
+	/usr/include \
+	../include \
+	../../libdata-source/include \
+	/usr/include/hdf5/serial
+
+LIBS += -L/usr/local/lib -L../lib/ \
+	-L/usr/lib/x86_64-linux-gnu/hdf5/serial \
+	-ldatafile -larmadillo -lhdf5_cpp -lhdf5
+
+CONFIG += console release c++11 thread
+CONFIG -= app_bundle qt
+
+QMAKE_RPATHDIR += ../lib/
+
+# Input
+SOURCES += benchmark_libdatafile.cc
@@ -0,0 +1,90 @@
+/*! \file alignment.h
+ *
+ * Sub-sample alignment of spike snippets, by upsampling them with an
+ * interpolating kernel and locating the peak of each upsampled snippet.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _ALIGNMENT_H_
+#define _ALIGNMENT_H_
+
+#include <cstddef>
+
+#include <armadillo>
+
+/*! The alignment namespace contains functions for estimating the time of
+ * the peak of each spike snippet more finely than the sample period.
+ *
+ * Snippets are upsampled by multiplying them with an interpolation matrix,
+ * whose rows hold the kernel weights of each upsampled point. A batch of
+ * snippets, stored as the columns of a matrix, is thus upsampled by a single
+ * matrix product, which Armadillo hands to an optimized BLAS.
+ */
+namespace alignment {
+
+/*! Kernels used to interpolate snippets between samples.
+ * 	- WindowedSinc - A sinc function with a Lanczos window, extending
+ * 	  SincHalfWidth samples on each side.
+ * 	- Cubic - A cubic convolution (Catmull-Rom) kernel, extending two
+ * 	  samples on each side. This is cheaper and rings less than the sinc.
+ */
+enum Kernel {
+	WindowedSinc,
+	Cubic
+};
+
+/*! Number of samples on each side of a point used by the windowed sinc */
+const int SincHalfWidth = 4;
+
+/*! Options controlling how snippets are aligned. */
+struct Options {
+	Kernel kernel = WindowedSinc;	// Interpolation kernel
+	int factor = 8;					// Number of upsampled points per sample
+	int searchRadius = 2;			// Samples around the nominal peak searched for the extremum
+	bool negative = true;			// Align on the minimum, as for extracellular spikes
+	bool storeSnippets = false;		// Also store snippets resampled about the refined peak
+	size_t batchSnippets = 4096;	// Snippets read and aligned at once
+};
+
+/*! Return the value of the kernel at the given distance, in samples. */
+double kernel(Kernel k, double x);
+
+/*! Return the interpolation matrix for snippets of the given size.
+ * The matrix has shape ((snipSize - 1) * factor + 1, snipSize), and row
+ * `i` holds the weights of each sample in the value at time `i / factor`.
+ * Rows are normalized to sum to one, so that the kernel is not truncated
+ * near the ends of the snippet.
+ */
+arma::mat interpolationMatrix(size_t snipSize, Kernel k, int factor);
+
+/*! Upsample a batch of snippets, stored as the columns of a matrix with
+ * shape (snippet_size, nsnippets), using an interpolation matrix.
+ */
+arma::mat upsample(const arma::mat& interp, const arma::Mat<short>& snips);
+
+/*! Return the offset of the peak of each upsampled snippet from the nominal
+ * peak sample, in samples.
+ * \param upsampled Snippets upsampled by upsample().
+ * \param options The alignment options used to upsample them.
+ * \param peak The sample of the nominal peak within each snippet.
+ *
+ * The extremum is searched within options.searchRadius samples of the
+ * nominal peak, and refined by fitting a parabola through the upsampled
+ * points around it.
+ */
+arma::vec peakOffsets(const arma::mat& upsampled, const Options& options, int peak);
+
+/*! Resample a batch of snippets so that the refined peak of each falls
+ * on the nominal peak sample, returning the aligned snippets with shape
+ * (snippet_size, nsnippets). Offsets are rounded to the nearest upsampled
+ * point, points beyond the ends of the snippet repeat the end value, and
+ * values beyond the range of `short` are clamped to it.
+ */
+arma::Mat<short> alignSnippets(const arma::mat& upsampled, const arma::vec& offsets,
+		int factor, size_t snipSize);
+
+}; // end alignment namespace
+
+#endif
+
@@ -0,0 +1,204 @@
+/*! \file bufferpool.h
+ *
+ * A pool of reusable, aligned buffers for reading and writing data
+ * without allocating memory on every call.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <armadillo>
+
+namespace datafile {
+
+/*! Alignment of all pooled buffers, in bytes */
+const size_t BufferAlignment = 64;
+
+/*! Size of a huge page. Pooled buffers at least this large are aligned
+ * to huge pages, and the kernel is asked to back them with huge pages.
+ */
+const size_t HugePageSize = 2 * 1024 * 1024;
+
+/*! Size of the smallest pooled buffer, in bytes */
+const size_t MinBufferSize = 256;
+
+/*! The BufferPool class keeps buffers released by readers, and hands them
+ * out again to later requests of a similar size.
+ *
+ * Buffers are grouped into size classes, each a power of two bytes, so
+ * that a long-running loop which repeatedly reads blocks of the same shape
+ * allocates memory only on its first iteration. All methods may be called
+ * concurrently from multiple threads.
+ *
+ * Buffers are usually acquired through the PooledBuffer and PooledMatrix
+ * handles, which return them to the pool when destroyed. Every buffer
+ * must be returned before the pool itself is destroyed.
+ */
+class BufferPool {
+	public:
+		/*! Construct a pool.
+		 * \param maxCachedBytes The maximum number of bytes kept for reuse.
+		 * 	Buffers released while the pool holds this many bytes are freed.
+		 * 	Zero means there is no limit.
+		 */
+		explicit BufferPool(size_t maxCachedBytes = 0);
+		BufferPool(const BufferPool&) = delete;
+		BufferPool& operator=(const BufferPool&) = delete;
+
+		/*! Free all buffers held by the pool */
+		~BufferPool();
+
+		/*! Return a buffer of at least the given number of bytes.
+		 * \param bytes The requested size.
+		 * \param capacity Set to the actual size of the buffer, which must
+		 * 	be passed back to release().
+		 *
+		 * Exceptions:
+		 * Throws std::bad_alloc if memory could not be allocated.
+		 */
+		void* acquire(size_t bytes, size_t& capacity);
+
+		/*! Return a buffer acquired from this pool. */
+		void release(void* buffer, size_t capacity);
+
+		/*! Free all buffers currently held for reuse. */
+		void clear();
+
+		/*! Return the number of buffers allocated from the system. */
+		uint64_t allocations() const;
+
+		/*! Return the number of requests served by reusing a buffer. */
+		uint64_t reuses() const;
+
+		/*! Return the number of bytes currently held for reuse. */
+		size_t cachedBytes() const;
+
+	private:
+		/* Number of size classes, enough for any 64-bit size */
+		static const int NumSizeClasses = 64;
+
+		/* Return the size class and capacity of a request */
+		static int sizeClass(size_t bytes, size_t& capacity);
+
+		static void* allocate(size_t capacity);
+
+		mutable std::mutex m_mutex;
+		std::vector<void*> m_free[NumSizeClasses];	// Buffers held for reuse
+		size_t m_maxCachedBytes;
+		size_t m_cachedBytes;
+		uint64_t m_allocations;
+		uint64_t m_reuses;
+};
+
+/*! A buffer acquired from a BufferPool, which is returned to the pool
+ * when the handle is destroyed. Handles may be moved but not copied.
+ */
+class PooledBuffer {
+	public:
+		/*! Construct an empty handle. */
+		PooledBuffer();
+
+		/*! Acquire a buffer of at least the given size from the pool. */
+		PooledBuffer(BufferPool& pool, size_t bytes);
+
+		PooledBuffer(PooledBuffer&& other);
+		PooledBuffer& operator=(PooledBuffer&& other);
+		PooledBuffer(const PooledBuffer&) = delete;
+		PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+		/*! Return the buffer to its pool. */
+		~PooledBuffer();
+
+		/*! Return the buffer to its pool, leaving the handle empty. */
+		void reset();
+
+		void* data() const { return m_data; }
+		size_t capacity() const { return m_capacity; }
+
+	private:
+		BufferPool* m_pool;
+		void* m_data;
+		size_t m_capacity;
+};
+
+/*! An Armadillo matrix whose memory is a buffer acquired from a BufferPool.
+ *
+ * The matrix is bound to the buffer, so it may be read and written in
+ * place but not resized. The buffer is returned to the pool when the
+ * handle is destroyed.
+ */
+template<class T>
+class PooledMatrix {
+	public:
+		/*! Construct an empty matrix. */
+		PooledMatrix() { }
+
+		/*! Construct a matrix of the given shape, whose elements are
+		 * not initialized.
+		 */
+		PooledMatrix(BufferPool& pool, arma::uword nrows, arma::uword ncols)
+			: m_buffer(pool, nrows * ncols * sizeof(T))
+		{
+			bind(nrows, ncols);
+		}
+
+		PooledMatrix(PooledMatrix&& other)
+			: m_buffer(std::move(other.m_buffer))
+		{
+			bind(other.m_mat.n_rows, other.m_mat.n_cols);
+			other.bind(0, 0);
+		}
+
+		PooledMatrix& operator=(PooledMatrix&& other)
+		{
+			if (this != &other) {
+				m_buffer = std::move(other.m_buffer);
+				bind(other.m_mat.n_rows, other.m_mat.n_cols);
+				other.bind(0, 0);
+			}
+			return *this;
+		}
+
+		PooledMatrix(const PooledMatrix&) = delete;
+		PooledMatrix& operator=(const PooledMatrix&) = delete;
+
+		arma::Mat<T>& mat() { return m_mat; }
+		const arma::Mat<T>& mat() const { return m_mat; }
+		arma::Mat<T>& operator*() { return m_mat; }
+		const arma::Mat<T>& operator*() const { return m_mat; }
+		arma::Mat<T>* operator->() { return &m_mat; }
+		const arma::Mat<T>* operator->() const { return &m_mat; }
+
+	private:
+		/* Rebind the matrix to the current buffer. Armadillo matrices
+		 * cannot change their memory after construction, so the matrix
+		 * is destroyed and constructed again in place.
+		 */
+		void bind(arma::uword nrows, arma::uword ncols)
+		{
+			using matrix_type = arma::Mat<T>;
+			m_mat.~matrix_type();
+			if (m_buffer.data()) {
+				new (&m_mat) arma::Mat<T>(static_cast<T*>(m_buffer.data()),
+						nrows, ncols, false, true);
+			} else {
+				new (&m_mat) arma::Mat<T>();
+			}
+		}
+
+		PooledBuffer m_buffer;
+		arma::Mat<T> m_mat;
+};
+
+}; // end datafile namespace
+
+#endif
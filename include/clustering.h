@@ -0,0 +1,95 @@
+/*! \file clustering.h
+ *
+ * Mini-batch k-means clustering of spike snippets, for clustering more
+ * snippets than can be held in memory at once.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _CLUSTERING_H_
+#define _CLUSTERING_H_
+
+#include <cstddef>
+#include <random>
+
+#include <armadillo>
+
+/*! The clustering namespace contains a mini-batch k-means engine.
+ *
+ * Rather than assigning every point to its nearest center on each
+ * iteration, mini-batch k-means moves the centers toward small random
+ * batches of points, with a step size which shrinks as each center
+ * absorbs more points. Only one batch is in memory at a time, and a fit
+ * typically converges after visiting a small fraction of the points.
+ *
+ * Points are stored as the columns of a matrix, as are the centers.
+ */
+namespace clustering {
+
+/*! Options controlling a mini-batch k-means fit. */
+struct Options {
+	size_t nclusters = 8;		// Number of clusters
+	size_t batchSize = 4096;	// Points in each mini-batch
+	size_t iterations = 100;	// Mini-batches used to fit the centers
+	unsigned int nthreads = 0;	// Threads used to assign points, 0 for all cores
+	unsigned int seed = 0;		// Seed for choosing batches and initial centers
+};
+
+/*! The MiniBatchKMeans class fits cluster centers to a stream of
+ * mini-batches, and assigns points to their nearest center.
+ *
+ * Squared distances between points and centers are computed as
+ * |x|^2 - 2 c'x + |c|^2, so that the bulk of the work is a single matrix
+ * product per batch, which Armadillo hands to an optimized BLAS. The
+ * columns of a batch are split among threads, each of which computes
+ * its own product.
+ */
+class MiniBatchKMeans {
+	public:
+		/*! Construct an engine with no centers. */
+		explicit MiniBatchKMeans(const Options& options = Options());
+
+		/*! Choose initial centers from a batch of points, using k-means++
+		 * seeding.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the batch has fewer points than
+		 * the number of clusters.
+		 */
+		void initialize(const arma::mat& batch);
+
+		/*! Move the centers toward a batch of points, initializing them
+		 * from the batch if they have not been initialized.
+		 */
+		void update(const arma::mat& batch);
+
+		/*! Return the index of the nearest center to each point.
+		 * \param batch The points, stored as columns.
+		 * \param distances If not null, set to the squared distance from
+		 * 	each point to its nearest center.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the centers have not been initialized.
+		 */
+		arma::uvec assign(const arma::mat& batch, arma::vec* distances = nullptr) const;
+
+		/*! Return the centers, with shape (ndims, nclusters). */
+		const arma::mat& centers() const { return m_centers; }
+
+		/*! Return the number of points absorbed by each center. */
+		const arma::vec& counts() const { return m_counts; }
+
+		/*! Return true if the centers have been initialized. */
+		bool initialized() const { return m_centers.n_cols > 0; }
+
+	private:
+		Options m_options;
+		arma::mat m_centers;
+		arma::vec m_counts;
+		std::mt19937_64 m_rng;
+};
+
+}; // end clustering namespace
+
+#endif
+
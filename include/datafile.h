@@ -12,7 +12,19 @@
 #include "H5Cpp.h"
 #include <armadillo>
 
+#include "bufferpool.h"
+#include "iostats.h"
+#include "latencyhistogram.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 /*! The datafile namespace contains classes and constants related
@@ -64,6 +76,145 @@ const char DateFormat[] = "%Y-%m-%dT%H:%M:%S";
 /*! Default array to use when creating a new recording */
 const std::string DefaultArray = "mcs";
 
+/*! Layout of the samples in the dataset on disk.
+ *
+ * ChannelMajor files store the dataset with shape (nchannels, nsamples), so
+ * that the samples of each channel are contiguous. This is the default, and
+ * suits reading long stretches of data from a few channels.
+ *
+ * SampleMajor files store the dataset with shape (nsamples, nchannels), so
+ * that all channels of each sample are contiguous. This suits readers which
+ * always read all channels over short windows of time, such as real-time
+ * displays.
+ *
+ * The layout only affects how data is stored. Data is read and written
+ * with the same shapes regardless of the layout of the file.
+ */
+enum Layout {
+	ChannelMajor,
+	SampleMajor
+};
+
+/*! Maximum number of bytes of data read by DataFile::readWindows() before
+ * the windows are copied into the output.
+ */
+const size_t WindowBatchBytes = 64 * 1024 * 1024;
+
+/*! Maximum number of bytes of temporary buffers each DataFile keeps for
+ * reuse, enough for a few blocks of data. Larger buffers, such as those
+ * holding a batch of windows, are freed once the read is finished.
+ */
+const size_t PoolCachedBytes = 32 * 1024 * 1024;
+
+/*! Size of the square tiles used to transpose data between layouts */
+const arma::uword TransposeTileSize = 32;
+
+/*! Transpose the column-major matrix of shape (nrows, ncols) at src
+ * into dst, which then has shape (ncols, nrows). This is done in square
+ * tiles, so that the reads and writes of each tile stay in cache.
+ *
+ * The leading dimensions of the source and destination default to the
+ * number of rows of each, and may be larger to transpose a submatrix.
+ */
+template<class T>
+void blockedTranspose(const T* src, T* dst, arma::uword nrows, arma::uword ncols,
+		arma::uword srcStride = 0, arma::uword dstStride = 0)
+{
+	if (srcStride == 0)
+		srcStride = nrows;
+	if (dstStride == 0)
+		dstStride = ncols;
+	for (arma::uword c0 = 0; c0 < ncols; c0 += TransposeTileSize) {
+		auto c1 = std::min(c0 + TransposeTileSize, ncols);
+		for (arma::uword r0 = 0; r0 < nrows; r0 += TransposeTileSize) {
+			auto r1 = std::min(r0 + TransposeTileSize, nrows);
+			for (auto c = c0; c < c1; c++) {
+				for (auto r = r0; r < r1; r++)
+					dst[r * dstStride + c] = src[c * srcStride + r];
+			}
+		}
+	}
+}
+
+/*! Type of sample indices and counts of samples. This is 64 bits wide,
+ * so that a single file may hold a multi-day recording.
+ */
+using sample_index = int64_t;
+
+/*! Group of the file holding datasets derived from the raw data */
+const std::string DerivedGroup = "derived";
+
+/*! Name of the derived dataset holding the local field potential */
+const std::string LfpDataset = "lfp";
+
+/*! Name of the derived dataset holding the power in the spike band */
+const std::string SpikePowerDataset = "spike-power";
+
+/*! Name of the derived dataset holding the power spectral density */
+const std::string PsdDataset = "psd";
+
+/*! Number of samples in each chunk of a derived dataset. Derived datasets
+ * are computed one chunk at a time, so that every write but the last
+ * fills whole chunks.
+ */
+const hsize_t DerivedChunkSize = 1024;
+
+/*! Options controlling how the local field potential is computed. */
+struct LfpOptions {
+	float sampleRate = 1000.;	// Sample rate of the LFP, rounded to an integer decimation of the raw rate
+	float cutoff = 0.;			// Cutoff of the low-pass filter in Hz, 0 for 0.4 times the LFP sample rate
+	size_t taps = 0;			// Length of the filter, which is made odd, 0 for 20 times the decimation plus one
+	unsigned int nthreads = 0;	// Threads used to filter the data, 0 for all cores
+};
+
+/*! Options controlling how the power in the spike band is computed. */
+struct SpikePowerOptions {
+	float low = 300.;			// Low edge of the band-pass filter, in Hz
+	float high = 3000.;			// High edge of the band-pass filter, in Hz
+	size_t binSize = 200;		// Raw samples averaged in each bin
+	size_t taps = 0;			// Length of the filter, which is made odd, 0 for 8 periods of the low edge
+	size_t fftSize = 32768;		// Samples in each block filtered by FFT, including the overlap
+	unsigned int nthreads = 0;	// Threads used to filter the data, 0 for all cores
+};
+
+/*! Options controlling how the power spectral density is estimated. */
+struct PsdOptions {
+	size_t segmentSize = 4096;	// Samples in each windowed segment
+	size_t overlap = 2048;		// Samples shared by consecutive segments
+	unsigned int nthreads = 0;	// Threads used to transform segments, 0 for all cores
+};
+
+/*! Options controlling the scan for bad channels. */
+struct ChannelScanOptions {
+	double seconds = 0.;			// Seconds scanned from the start of the recording, 0 for all of it
+	double minRms = 0.2;			// Channels with an RMS below this fraction of the median are dead
+	double maxRms = 5.;				// Channels with an RMS above this multiple of the median are noisy
+	double maxSaturation = 1e-3;	// Largest fraction of samples at the limits of the ADC
+	double maxFlatSeconds = 0.05;	// Longest run of identical samples, in seconds
+	double maxCorrelation = 0.98;	// Largest correlation with a neighbor, above which both are shorted
+	arma::umat neighbors;			// Neighbors of each channel, shape (k, nchannels), empty for adjacent channels
+	unsigned int nthreads = 0;		// Threads used to scan blocks, 0 for all cores
+};
+
+/*! The statistics of each channel found by a scan, and whether it is good. */
+struct ChannelQuality {
+	arma::vec rms;			// Root-mean-square about the mean, in ADC units
+	arma::vec saturation;	// Fraction of samples at the limits of the ADC
+	arma::uvec flatRun;		// Longest run of identical samples
+	arma::vec correlation;	// Largest correlation with any neighbor
+	arma::uvec good;		// 1 for good channels, 0 for bad
+};
+
+/*! Return the coefficients of a linear-phase FIR filter passing the band
+ * [low, high] Hz, designed by windowing an ideal filter with a Blackman
+ * window. A low edge of zero gives a low-pass filter.
+ * \param low The low edge of the band, in Hz.
+ * \param high The high edge of the band, in Hz.
+ * \param sampleRate The sample rate of the data to be filtered.
+ * \param taps The length of the filter, which should be odd.
+ */
+arma::vec firFilter(double low, double high, double sampleRate, size_t taps);
+
 /*! Type aliases for data from arrays */
 using samples = arma::mat; 				// true voltage units
 using ssamples = arma::Mat<int16_t>;	// data from MCS arrays
@@ -140,10 +291,16 @@ class DataFile {
 		 * \param filename The name of the file to create or open.
 		 * \param array The type of array the written data will come from.
 		 * \param nchannels The number of channels to be written to the dataset.
+		 * \param dtype The HDF5 datatype in which samples are stored, if the
+		 * file is created. This is ignored when opening an existing file.
+		 * \param layout The layout of samples on disk, if the file is created.
+		 * This is ignored when opening an existing file.
 		 */
 		DataFile(const std::string& filename, 
 				const std::string& array = DefaultArray,
-				const hsize_t nchannels = NumChannels);
+				const hsize_t nchannels = NumChannels,
+				const H5::DataType& dtype = H5::PredType::STD_I16LE,
+				Layout layout = ChannelMajor);
 
 		/*! Destroy a DataFile, flushing and closing the underlying file */
 		virtual ~DataFile();
@@ -158,11 +315,14 @@ class DataFile {
 		double length() const;
 
 		/*! Return the total number of samples in the recording */
-		int nsamples() const;
+		sample_index nsamples() const;
 
 		/*! Return the number of channels in the data file */
 		int nchannels() const;
 
+		/*! Return the layout of samples in the dataset on disk */
+		Layout layout() const;
+
 		/*! Return the sample rate of the data */
 		float sampleRate() const;
 
@@ -188,7 +348,7 @@ class DataFile {
 		std::string room() const;
 
 		/*! Return the size of any analog output used in this recording. */
-		int analogOutputSize() const;
+		sample_index analogOutputSize() const;
 
 		/*! Return the analog output used in this recording.
 		 * If there was no analog output, the returned vector will be empty.
@@ -213,7 +373,7 @@ class DataFile {
 		 * files do not currently support analog output, but that
 		 * may change in the future.
 		 */
-		virtual void setAnalogOutputSize(int sz);
+		virtual void setAnalogOutputSize(sample_index sz);
 
 		/*! Return data from all channels over the given sample rate.
 		 * Data is return in true voltage units, as double-precision IEEE floats.
@@ -229,7 +389,7 @@ class DataFile {
 		 * This will throw a std::logic_error if either the requested channels
 		 * or samples are outside of the range for the file.
 		 */
-		samples data(int start, int end) const;
+		samples data(sample_index start, sample_index end) const;
 
 		/*! Return data from the given channel.
 		 * Data is returned in true voltage units of the ADC.
@@ -242,7 +402,7 @@ class DataFile {
 		 * This will throw a std::logic_error if either the requested channels
 		 * or samples are outside of the range for the file.
 		 */
-		arma::vec data(int channel, int start, int end) const;
+		arma::vec data(int channel, sample_index start, sample_index end) const;
 
 		/* Read data from a contiguous set of channels into the given matrix.
 		 * \param startChan The first channel to read
@@ -262,12 +422,12 @@ class DataFile {
 		 */
 		template<class T>
 		void data(int startChan, int endChan, 
-				int startSample, int endSample, arma::Mat<T>& mat) const
+				sample_index startSample, sample_index endSample, arma::Mat<T>& mat) const
 		{
 			verifyReadRequest(startChan, endChan, startSample, endSample);
-			auto memspace = setupRead(startChan, endChan, startSample, endSample);
 			mat.set_size(endSample - startSample, endChan - startChan);
-			m_dataset.read(mat.memptr(), dtypeForMat(mat), memspace, m_dataspace);
+			readSamples(startChan, endChan, startSample, endSample,
+					mat.memptr(), dtypeForMat(mat));
 		}
 
 		/* Read data from a contiguous set of channels into the given matrix.
@@ -285,12 +445,176 @@ class DataFile {
 		 * or samples are outside of the range for the file.
 		 */
 		template<class T>
-		void data(int startSample, int endSample, arma::Mat<T>& mat) const
+		void data(sample_index startSample, sample_index endSample, arma::Mat<T>& mat) const
 		{
 			verifyReadRequest(0, nchannels(), startSample, endSample);
-			auto memspace = setupRead(0, nchannels(), startSample, endSample);
 			mat.set_size(endSample - startSample, nchannels());
-			m_dataset.read(mat.memptr(), dtypeForMat(mat), memspace, m_dataspace);
+			readSamples(0, nchannels(), startSample, endSample,
+					mat.memptr(), dtypeForMat(mat));
+		}
+
+		/*! Read data from a contiguous set of channels into a matrix
+		 * whose memory is acquired from the given pool.
+		 * \param startChan The first channel to read.
+		 * \param endChan One past the last channel to read.
+		 * \param startSample The first sample to read.
+		 * \param endSample One past the last sample to read.
+		 * \param pool The pool from which to acquire the matrix.
+		 *
+		 * The element type must be given explicitly, e.g.,
+		 * `df.data<int16_t>(0, 10, 0, 1000, pool)`. The returned matrix
+		 * has shape (nsamples, nchannels), and its memory is returned to
+		 * the pool when it is destroyed, so that steady-state loops of
+		 * reads do not allocate memory. Voltages may be computed in place
+		 * by scaling a floating-point matrix by gain().
+		 *
+		 * Exceptions:
+		 * This will throw a std::logic_error if either the requested channels
+		 * or samples are outside of the range for the file.
+		 */
+		template<class T>
+		PooledMatrix<T> data(int startChan, int endChan,
+				sample_index startSample, sample_index endSample,
+				BufferPool& pool) const
+		{
+			verifyReadRequest(startChan, endChan, startSample, endSample);
+			PooledMatrix<T> mat(pool, endSample - startSample, endChan - startChan);
+			readSamples(startChan, endChan, startSample, endSample,
+					mat->memptr(), dtypeForMat(*mat));
+			return mat;
+		}
+
+		/*! Read data from all channels into a matrix whose memory is
+		 * acquired from the given pool. See the overload above.
+		 */
+		template<class T>
+		PooledMatrix<T> data(sample_index startSample, sample_index endSample,
+				BufferPool& pool) const
+		{
+			return data<T>(0, nchannels(), startSample, endSample, pool);
+		}
+
+		/*! Read windows of data around many events.
+		 * \param samples The sample of each event, in any order.
+		 * \param before The number of samples before each event to read.
+		 * \param after The number of samples after each event to read.
+		 * \param channels The channels to read, in any order.
+		 * \param out The cube to fill, with shape (before + after + 1,
+		 * 	channels.n_elem, samples.n_elem). Slice i holds the window around
+		 * 	event i, with one column per requested channel. Data is converted
+		 * 	to the type of the cube, as for data().
+		 * \param nthreads The number of threads used to copy windows into
+		 * 	the output, or 0 to use all cores.
+		 *
+		 * Events are sorted and grouped by the dataset chunk in which their
+		 * windows start, and the span of samples covering each group's windows
+		 * is read with a single call to the HDF5 library. Reading many windows
+		 * this way costs about one read per chunk, rather than one per event.
+		 * Reads are performed by the calling thread, and windows are copied
+		 * into the output by the worker threads after each batch of reads.
+		 *
+		 * Exceptions:
+		 * This will throw a std::logic_error if any channel is out of range,
+		 * or if any window extends beyond the start or end of the recording.
+		 */
+		template<class T>
+		void readWindows(const arma::uvec& samples, arma::uword before,
+				arma::uword after, const arma::uvec& channels,
+				arma::Cube<T>& out, unsigned int nthreads = 0) const
+		{
+			const arma::uword windowSize = before + after + 1;
+			const arma::uword nevents = samples.n_elem, nchan = channels.n_elem;
+			out.set_size(windowSize, nchan, nevents);
+			if ( (nevents == 0) || (nchan == 0) )
+				return;
+
+			/* Validate the request, and find the span of channels to read */
+			arma::uword minChan = channels(0), maxChan = channels(0);
+			for (auto c : channels) {
+				if (c >= static_cast<arma::uword>(nchannels())) {
+					throw std::logic_error("Requested channel out of range: " +
+							std::to_string(c) + " is not in range [0, " +
+							std::to_string(nchannels()) + ")");
+				}
+				minChan = std::min(minChan, c);
+				maxChan = std::max(maxChan, c);
+			}
+			for (auto s : samples) {
+				if ( (s < before) || (s + after >= static_cast<arma::uword>(nsamples())) ) {
+					throw std::logic_error("Window around sample " + std::to_string(s) +
+							" is not in range [0, " + std::to_string(nsamples()) + ")");
+				}
+			}
+			std::vector<arma::uword> order(nevents);
+			std::iota(order.begin(), order.end(), 0);
+			std::stable_sort(order.begin(), order.end(),
+					[&samples](arma::uword a, arma::uword b) { return samples(a) < samples(b); });
+
+			if (nthreads == 0)
+				nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+			/* A span of samples read from the file, and the range of sorted
+			 * events whose windows it covers.
+			 */
+			struct Span {
+				sample_index start;
+				arma::uword first, last;
+				PooledMatrix<T> data;
+			};
+			std::vector<Span> batch;
+			size_t batchBytes = 0;
+
+			/* Copy the windows of all events in the batch into the output.
+			 * Threads claim spans in turn, and each writes only the slices
+			 * of its own events.
+			 */
+			auto scatter = [&]() {
+				std::atomic<size_t> next(0);
+				auto worker = [&]() {
+					for (size_t i = next++; i < batch.size(); i = next++) {
+						const Span& span = batch[i];
+						for (arma::uword k = span.first; k < span.last; k++) {
+							const arma::uword event = order[k];
+							const arma::uword offset = samples(event) - before - span.start;
+							T* dst = out.memptr() + event * windowSize * nchan;
+							for (arma::uword c = 0; c < nchan; c++) {
+								const T* src = span.data->colptr(channels(c) - minChan) + offset;
+								std::copy(src, src + windowSize, dst + c * windowSize);
+							}
+						}
+					}
+				};
+				unsigned int n = std::min(nthreads, static_cast<unsigned int>(batch.size()));
+				std::vector<std::thread> threads;
+				for (unsigned int t = 1; t < n; t++)
+					threads.emplace_back(worker);
+				worker();
+				for (auto& t : threads)
+					t.join();
+				batch.clear();
+				batchBytes = 0;
+			};
+
+			const sample_index chunkSize = stageCapacity();
+			arma::uword i = 0;
+			while (i < nevents) {
+				sample_index start = samples(order[i]) - before;
+				sample_index chunkEnd = (start / chunkSize + 1) * chunkSize;
+				sample_index end = start;
+				arma::uword j = i;
+				while ( (j < nevents) &&
+						(static_cast<sample_index>(samples(order[j]) - before) < chunkEnd) ) {
+					end = std::max(end, static_cast<sample_index>(samples(order[j]) + after + 1));
+					j++;
+				}
+				batch.push_back(Span{ start, i, j,
+						data<T>(minChan, maxChan + 1, start, end, m_pool) });
+				batchBytes += (end - start) * (maxChan - minChan + 1) * sizeof(T);
+				if (batchBytes >= WindowBatchBytes)
+					scatter();
+				i = j;
+			}
+			scatter();
 		}
 
 		/* Write data to the file.
@@ -303,17 +627,26 @@ class DataFile {
 		 * Because Armadillo uses column-order majoring, this corresponds to the
 		 * HDF5 dataset with size (nchannels, nsamples).
 		 *
+		 * If write-combining is enabled, writes smaller than a dataset chunk
+		 * are staged in memory and written once a whole chunk has been
+		 * received. See setWriteCombining().
+		 *
 		 * Exceptions:
 		 * This will throw a std::logic_error endSample <= startSample. If endSample
 		 * is beyond the current end of the dataset, *it will be extended* to the next
 		 * largest multiple of the BLOCK_SIZE required to accommodate the data.
 		 */
 		template<class T>
-		void setData(int startSample, int endSample, 
+		void setData(sample_index startSample, sample_index endSample, 
 				const arma::Mat<T>& mat, bool flush = false) { 
+			LatencyTimer latency(m_latency.get(), LatencySetData);
 			verifyWriteRequest(startSample, endSample);
-			auto memspace = setupWrite(startSample, endSample);
-			m_dataset.write(mat.memptr(), dtypeForMat(mat), memspace, m_dataspace);
+			if (m_writeCombining && (endSample - startSample < stageCapacity())) {
+				stageSamples(startSample, endSample, mat.memptr(), dtypeForMat(mat));
+			} else {
+				flushStaged();
+				writeSamples(startSample, endSample, mat.memptr(), dtypeForMat(mat));
+			}
 			if (flush)
 				this->flush();
 		}
@@ -352,11 +685,306 @@ class DataFile {
 		 */
 		arma::vec means() const;
 
+		/*! Scan the recording for bad channels, and store the resulting
+		 * channel mask in the file.
+		 * \param options The thresholds for each statistic.
+		 *
+		 * A channel is bad if it is dead or noisy, with an RMS far from the
+		 * median of all channels, if it is saturated too often, if it is
+		 * flat for too long, or if it is shorted to a neighbor, so that their
+		 * correlation is nearly one. The statistics of every channel are
+		 * computed in one pass over the data: blocks are read by the calling
+		 * thread, scanned in parallel, and combined in order.
+		 *
+		 * Returns the statistics of each channel and the mask.
+		 */
+		ChannelQuality scanChannels(const ChannelScanOptions& options = ChannelScanOptions());
+
+		/*! Store a mask of the good channels, 1 for good and 0 for bad.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the mask does not have one element
+		 * for each channel.
+		 */
+		void setChannelMask(const arma::uvec& good);
+
+		/*! Return the mask of good channels. Every channel is good if no
+		 * mask has been stored.
+		 */
+		arma::uvec channelMask() const;
+
+		/*! Return the indices of the good channels, in increasing order. */
+		arma::uvec goodChannels() const;
+
+		/*! Read data from any set of channels, e.g., from goodChannels().
+		 * \param channels The channels to read, in any order.
+		 * \param startSample The first sample to read.
+		 * \param endSample One past the last sample to read.
+		 * \param mat The matrix to fill, with shape (nsamples, channels.n_elem).
+		 *
+		 * Each run of consecutive channels is read with one call to
+		 * the HDF5 library.
+		 *
+		 * Exceptions:
+		 * This will throw a std::logic_error if any channel or the
+		 * requested samples are out of range.
+		 */
+		template<class T>
+		void data(const arma::uvec& channels, sample_index startSample,
+				sample_index endSample, arma::Mat<T>& mat) const
+		{
+			mat.set_size(endSample - startSample, channels.n_elem);
+			arma::uword i = 0;
+			while (i < channels.n_elem) {
+				arma::uword j = i + 1;
+				while ( (j < channels.n_elem) && (channels(j) == channels(j - 1) + 1) )
+					j++;
+				auto run = data<T>(channels(i), channels(j - 1) + 1,
+						startSample, endSample, m_pool);
+				std::copy(run->memptr(), run->memptr() + run->n_elem, mat.colptr(i));
+				i = j;
+			}
+		}
+
+		/*! Return a snapshot of the I/O counters of this file.
+		 * The counters record the number of read, write, extend, attribute,
+		 * conversion and flush operations, the time spent in each and the
+		 * number of bytes transferred, along with the number of dataset chunks
+		 * touched and the hit rate of the HDF5 metadata cache.
+		 */
+		IoStats stats() const;
+
+		/*! Reset all I/O counters, e.g., at the start of a new phase of a job. */
+		void resetStats();
+
+		/*! Return the number of bytes of temporary buffers held for reuse
+		 * by this file, which is at most PoolCachedBytes.
+		 */
+		size_t cachedBufferBytes() const { return m_pool.cachedBytes(); }
+
+		/*! Start recording the latency of calls to setData(), flushes of the
+		 * file and extensions of the dataset, discarding any latencies
+		 * recorded previously.
+		 *
+		 * \param deadline Deadline for each operation, in nanoseconds. If
+		 * 	non-zero, the callback is invoked with the type and duration of
+		 * 	any operation which takes longer than this.
+		 * \param callback Function called when the deadline is exceeded.
+		 *
+		 * Recording should be enabled or disabled before writing begins, not
+		 * concurrently with writes.
+		 */
+		void enableLatencyRecording(uint64_t deadline = 0,
+				DeadlineCallback callback = nullptr);
+
+		/*! Stop recording latencies and discard the recorded values. */
+		void disableLatencyRecording();
+
+		/*! Return the median, 99th and 99.9th percentile and maximum latency
+		 * of the given type of operation, in nanoseconds. If latency recording
+		 * is not enabled, all values are zero.
+		 */
+		LatencySummary latency(LatencyOp op) const;
+
+		/*! Discard all recorded latencies, leaving recording enabled. */
+		void resetLatency();
+
+		/*! Enable or disable write-combining, which is enabled by default.
+		 *
+		 * Each call to setData() which writes only part of a dataset chunk
+		 * forces the HDF5 library to read, modify and write back the whole
+		 * chunk if it has been evicted from the chunk cache. With
+		 * write-combining enabled, such small writes of consecutive samples
+		 * are instead copied into a chunk-sized buffer in memory, and the
+		 * dataset is written once per chunk, independent of the size of each
+		 * call. The buffer is written when it fills, when a write is not
+		 * contiguous with it, when data overlapping it is read, and when the
+		 * file is flushed or destroyed.
+		 *
+		 * Disabling write-combining writes any staged data.
+		 */
+		void setWriteCombining(bool enabled);
+
+		/*! Return true if write-combining is enabled. */
+		bool writeCombining() const;
+
+		/*! Write any staged data to the dataset, and flush the file to disk. */
+		void flush();
+
+		/*! Return true if the file holds the derived dataset with the given name. */
+		bool hasDerived(const std::string& name) const;
+
+		/*! Return the sample rate of a derived dataset.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the dataset does not exist.
+		 */
+		float derivedSampleRate(const std::string& name) const;
+
+		/*! Return the number of samples of a derived dataset.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the dataset does not exist.
+		 */
+		sample_index derivedSamples(const std::string& name) const;
+
+		/*! Read samples from a contiguous set of channels of a derived dataset.
+		 * \param name The name of the derived dataset.
+		 * \param startChan The first channel to read.
+		 * \param endChan One past the last channel to read.
+		 * \param startSample The first sample to read, at the derived dataset's rate.
+		 * \param endSample One past the last sample to read.
+		 * \param mat The matrix to fill, with shape (nsamples, nchannels). Data
+		 * 	is converted to the type of the matrix, as for data().
+		 *
+		 * Derived datasets are stored with shape (nchannels, nsamples), in the
+		 * same units as the raw data, so that voltages are found by scaling
+		 * them by gain().
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the dataset does not exist, or if
+		 * the requested channels or samples are out of range.
+		 */
+		template<class T>
+		void derived(const std::string& name, int startChan, int endChan,
+				sample_index startSample, sample_index endSample, arma::Mat<T>& mat) const
+		{
+			mat.set_size(endSample - startSample, endChan - startChan);
+			readDerived(name, startChan, endChan, startSample, endSample,
+					mat.memptr(), dtypeForMat(mat));
+		}
+
+		/*! Compute the local field potential of every channel, and store it
+		 * as the derived dataset LfpDataset, replacing any computed before.
+		 * \param options The sample rate and filter of the LFP.
+		 *
+		 * The raw data is low-pass filtered and decimated in a single pass.
+		 * The filter is only evaluated at the retained samples, and is
+		 * centered on them, so that LFP sample `i` corresponds to raw sample
+		 * `i * decimation` without delay. Samples beyond the ends of the
+		 * recording are taken to repeat the first and last samples. Blocks
+		 * are read by the calling thread, and their channels are filtered
+		 * in parallel.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the LFP sample rate is not positive
+		 * or exceeds the raw sample rate.
+		 */
+		void computeLfp(const LfpOptions& options = LfpOptions());
+
+		/*! Return true if the local field potential has been computed. */
+		bool hasLfp() const { return hasDerived(LfpDataset); }
+
+		/*! Return the sample rate of the local field potential. */
+		float lfpSampleRate() const { return derivedSampleRate(LfpDataset); }
+
+		/*! Return the number of samples of the local field potential. */
+		sample_index lfpSamples() const { return derivedSamples(LfpDataset); }
+
+		/*! Return the local field potential of all channels over the given
+		 * LFP samples in true voltage units, with shape (nsamples, nchannels).
+		 */
+		samples lfp(sample_index startSample, sample_index endSample) const;
+
+		/*! Read the local field potential of a contiguous set of channels in
+		 * the units of the raw data. See derived().
+		 */
+		template<class T>
+		void lfp(int startChan, int endChan, sample_index startSample,
+				sample_index endSample, arma::Mat<T>& mat) const
+		{
+			derived(LfpDataset, startChan, endChan, startSample, endSample, mat);
+		}
+
+		/*! Compute the root-mean-square of the band-passed data of every
+		 * channel in bins, and store it as the derived dataset SpikePowerDataset.
+		 * \param options The band of the filter and the size of the bins.
+		 *
+		 * Only the bins not yet stored are computed, so that this may be
+		 * called repeatedly while a recording is being written, and each
+		 * call processes only the samples written since the last. If the
+		 * stored bins were computed with a different filter or bin size,
+		 * they are all recomputed.
+		 *
+		 * Bin `i` covers raw samples [i * binSize, (i + 1) * binSize), and
+		 * the filter is centered on each sample. While a file is being
+		 * written, a bin is computed once the samples of the filter around
+		 * it have been written. Once the recording is done, i.e. in files
+		 * which were opened rather than created, every complete bin is
+		 * computed, taking samples beyond the end to repeat the last.
+		 * Samples before the start always repeat the first.
+		 *
+		 * The data is filtered by FFT in blocks, which are read by the
+		 * calling thread, and whose channels are filtered in parallel.
+		 *
+		 * Returns the number of bins computed.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the band is not valid at the
+		 * sample rate of the file, or if the filter and one bin do not
+		 * fit in the FFT size.
+		 */
+		sample_index computeSpikePower(const SpikePowerOptions& options = SpikePowerOptions());
+
+		/*! Return true if the spike-band power has been computed. */
+		bool hasSpikePower() const { return hasDerived(SpikePowerDataset); }
+
+		/*! Return the number of bins of the spike-band power. */
+		sample_index spikePowerBins() const { return derivedSamples(SpikePowerDataset); }
+
+		/*! Return the root-mean-square spike-band voltage of all channels over
+		 * the given bins, with shape (nbins, nchannels).
+		 */
+		samples spikePower(sample_index startBin, sample_index endBin) const;
+
+		/*! Estimate the power spectral density of every channel by Welch's
+		 * method, and store it as the derived dataset PsdDataset.
+		 * \param options The size and overlap of the segments.
+		 *
+		 * Each segment has its mean removed and is tapered by a Hann
+		 * window, and the one-sided spectra of all complete segments are
+		 * averaged. Only segments not yet included in the stored estimate
+		 * are transformed, and the average is updated with them, so that
+		 * this may be called repeatedly as a recording grows. If the stored
+		 * estimate used a different segment size or overlap, it is recomputed.
+		 *
+		 * Segments are read in blocks by the calling thread. Blocks of
+		 * segments are divided among threads, and the channels of each
+		 * segment are transformed together.
+		 *
+		 * Returns the number of segments added to the estimate.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the segment size is less than 2,
+		 * or the overlap is not less than the segment size.
+		 */
+		sample_index computePsd(const PsdOptions& options = PsdOptions());
+
+		/*! Return true if the power spectral density has been estimated. */
+		bool hasPsd() const { return hasDerived(PsdDataset); }
+
+		/*! Return the number of segments averaged in the stored estimate. */
+		sample_index psdSegments() const;
+
+		/*! Return the frequency of each bin of the power spectral density, in Hz. */
+		arma::vec psdFrequencies() const;
+
+		/*! Return the power spectral density of every channel, in V^2 / Hz,
+		 * with shape (nfrequencies, nchannels).
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if it has not been estimated.
+		 */
+		samples psd() const;
+
 	protected:
-		void flush();			// Flush the file to disk
+
+		/* Return the number of dataset chunks touched by the given selection */
+		uint64_t chunksInSelection(int startChannel, int endChannel,
+				sample_index startSample, sample_index endSample) const;
 
 		/* Read the available size of the dataset, in samples */
-		int datasetSize() const;
+		sample_index datasetSize() const;
 
 		/* Read or write underlying dataset or file HDF5 attributes */
 		void writeDataAttr(const std::string& name, const H5::DataType &type, void *buf);
@@ -376,7 +1004,56 @@ class DataFile {
 		void readRoom();
 		void readNumSamples();
 		void readAnalogOutputSize();
-		void setNumSamples(int nsamples);
+		void readLayout();
+		void setNumSamples(sample_index nsamples);
+
+		/* Return the number of samples which may be staged, which is the
+		 * number of samples in each dataset chunk.
+		 */
+		sample_index stageCapacity() const
+		{
+			return static_cast<sample_index>(m_chunkDims[sampleDim()]);
+		}
+
+		/* Write any samples staged by write-combining to the dataset. */
+		void flushStaged() const;
+
+		/* Open a derived dataset, throwing a std::logic_error if it does not exist */
+		H5::DataSet openDerived(const std::string& name) const;
+
+		/* Create a derived dataset of floats with shape (nchannels, 0) and
+		 * the given sample rate, replacing any existing dataset of that name.
+		 */
+		H5::DataSet createDerived(const std::string& name, float sampleRate);
+
+		/* Write samples with shape (nsamples, nchannels) to a derived dataset
+		 * from the given sample on, extending the dataset as needed.
+		 */
+		void writeDerived(H5::DataSet& dataset, sample_index startSample,
+				const arma::fmat& data);
+
+		/* Read a range of a derived dataset into out, with shape (nsamples, nchannels) */
+		void readDerived(const std::string& name, int startChan, int endChan,
+				sample_index startSample, sample_index endSample,
+				void* out, const H5::DataType& memType) const;
+
+		/* Read the raw samples of every channel in nblocks blocks, in batches
+		 * of nthreads blocks, and pass each batch to process with the index
+		 * of its first block. range returns the samples [first, last) of a
+		 * block. Blocks are read on the calling thread, in order.
+		 */
+		void readBatches(sample_index nblocks, unsigned int nthreads,
+				const std::function<std::pair<sample_index, sample_index>(sample_index)>& range,
+				const std::function<void(sample_index, std::vector<PooledMatrix<float> >&)>& process);
+
+		/* Index of the channel and sample dimensions of the dataset */
+		int channelDim() const { return (m_layout == SampleMajor) ? 1 : 0; }
+		int sampleDim() const { return (m_layout == SampleMajor) ? 0 : 1; }
+
+		/* Reorder dimensions given as (channels, samples) into the order
+		 * of the dataset on disk.
+		 */
+		void toFileOrder(hsize_t dims[DatasetRank]) const;
 
 		H5::H5File m_file;				// The actual HDF5 file
 		H5::DataSpace m_dataspace;		// Data space for actual data
@@ -395,30 +1072,141 @@ class DataFile {
 		uint64_t m_nsamples;		// Total number of samples written
 		uint64_t m_nchannels;		// Total number of channels in the file
 		uint64_t m_aoutSize;		// Size of any analog output used in the recording
+		Layout m_layout;			// Layout of samples in the dataset
+		bool m_writeCombining;		// Stage small writes into whole chunks
+
+		/* Samples staged by write-combining. These are stored in the order
+		 * of the dataset on disk, with room for one chunk of samples, and
+		 * always lie within a single chunk. They are mutable so that reads
+		 * may write them to the dataset first.
+		 */
+		mutable std::vector<char> m_stage;
+		mutable H5::DataType m_stageType;	// Memory type of the staged samples
+		mutable size_t m_stageElemSize;		// Size of each staged sample, in bytes
+		mutable sample_index m_stageStart;	// First staged sample
+		mutable sample_index m_stageCount;	// Number of staged samples
+		hsize_t m_chunkDims[DatasetRank];	// Chunk dimensions of the dataset
+		mutable IoCounters m_stats;	// Counters for I/O performed on the file
+		std::unique_ptr<LatencyRecorder> m_latency;	// Latency histograms, if enabled
+		mutable BufferPool m_pool;	// Temporary buffers for reads and writes
 
 		bool readOnly() const { return m_readOnly; }
 
 		/* Throw a std::logic_error if the requested write parameters are invalid.
 		 * This resizes the file's dataset if needed.
 		 */
-		void verifyWriteRequest(int startSample, int endSample);
+		void verifyWriteRequest(sample_index startSample, sample_index endSample);
 
 		/* Create a memory (source) dataspace and set up the file (dest)
 		 * dataspace for a write of data. This takes care of a lot of 
 		 * H5 library boilerplate that is shared across the different
 		 * setData() overloads.
 		 */
-		H5::DataSpace setupWrite(int startSample, int endSample);
+		H5::DataSpace setupWrite(sample_index startSample, sample_index endSample) const;
 
 		/* Throw a std::logic_error if the requested read parameters are invalid. */
 		void verifyReadRequest(int startChannel, int endChannel, 
-				int startSample, int endSample) const;
+				sample_index startSample, sample_index endSample) const;
 
 		/* Create a memory (destination) dataspace and setup the file (source)
 		 * dataspace for a read of data.
 		 */
 		H5::DataSpace setupRead(int startChannel, int endChannel, 
-				int startSample, int endSample) const;
+				sample_index startSample, sample_index endSample) const;
+
+		/* Read a validated selection of samples into out, which has shape
+		 * (nsamples, nchannels). Sample-major data is read into a temporary
+		 * buffer and transposed into place.
+		 */
+		template<class T>
+		void readSamples(int startChannel, int endChannel,
+				sample_index startSample, sample_index endSample,
+				T* out, const H5::DataType& memType) const
+		{
+			if ( (m_stageCount > 0) && (startSample < m_stageStart + m_stageCount) &&
+					(endSample > m_stageStart) ) {
+				flushStaged();
+			}
+			auto memspace = setupRead(startChannel, endChannel, startSample, endSample);
+			arma::uword nchan = endChannel - startChannel;
+			arma::uword nsamp = endSample - startSample;
+			DATAFILE_TRACE_SCOPE("DataFile::read", "datafile");
+			IoTimer timer(m_stats, IoRead, nchan * nsamp * sizeof(T));
+			if (m_layout == ChannelMajor) {
+				m_dataset.read(out, memType, memspace, m_dataspace);
+			} else {
+				PooledBuffer buffer(m_pool, nchan * nsamp * sizeof(T));
+				T* tmp = static_cast<T*>(buffer.data());
+				m_dataset.read(tmp, memType, memspace, m_dataspace);
+				blockedTranspose(tmp, out, nchan, nsamp);
+			}
+		}
+
+		/* Write a validated range of samples from in, which has shape
+		 * (nsamples, nchannels). Data is transposed into a temporary
+		 * buffer before writing to a sample-major file.
+		 */
+		template<class T>
+		void writeSamples(sample_index startSample, sample_index endSample,
+				const T* in, const H5::DataType& memType)
+		{
+			auto memspace = setupWrite(startSample, endSample);
+			arma::uword nchan = nchannels();
+			arma::uword nsamp = endSample - startSample;
+			DATAFILE_TRACE_SCOPE("DataFile::write", "datafile");
+			IoTimer timer(m_stats, IoWrite, nchan * nsamp * sizeof(T));
+			if (m_layout == ChannelMajor) {
+				m_dataset.write(in, memType, memspace, m_dataspace);
+			} else {
+				PooledBuffer buffer(m_pool, nchan * nsamp * sizeof(T));
+				T* tmp = static_cast<T*>(buffer.data());
+				blockedTranspose(in, tmp, nsamp, nchan);
+				m_dataset.write(tmp, memType, memspace, m_dataspace);
+			}
+		}
+
+		/* Copy a validated range of samples from in, which has shape
+		 * (nsamples, nchannels), into the staging buffer. The buffer is
+		 * written to the dataset whenever it reaches the end of a chunk.
+		 */
+		template<class T>
+		void stageSamples(sample_index startSample, sample_index endSample,
+				const T* in, const H5::DataType& memType)
+		{
+			if ( (m_stageCount > 0) && ((startSample != m_stageStart + m_stageCount) ||
+						!(m_stageType == memType)) ) {
+				flushStaged();
+			}
+			const sample_index capacity = stageCapacity();
+			const arma::uword nchan = nchannels();
+			const arma::uword nsamp = endSample - startSample;
+			sample_index pos = startSample;
+			while (pos < endSample) {
+				if (m_stageCount == 0) {
+					m_stageStart = pos;
+					m_stageType = memType;
+					m_stageElemSize = sizeof(T);
+					m_stage.resize(capacity * nchan * sizeof(T));
+				}
+				sample_index chunkEnd = (m_stageStart / capacity + 1) * capacity;
+				arma::uword n = std::min(endSample, chunkEnd) - pos;
+				arma::uword offset = pos - startSample;
+				T* stage = reinterpret_cast<T*>(m_stage.data());
+				if (m_layout == ChannelMajor) {
+					for (arma::uword c = 0; c < nchan; c++) {
+						std::copy(in + c * nsamp + offset, in + c * nsamp + offset + n,
+								stage + c * capacity + m_stageCount);
+					}
+				} else {
+					blockedTranspose(in + offset, stage + m_stageCount * nchan,
+							n, nchan, nsamp, nchan);
+				}
+				m_stageCount += n;
+				pos += n;
+				if (m_stageStart + m_stageCount == chunkEnd)
+					flushStaged();
+			}
+		}
 
 
 
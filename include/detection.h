@@ -0,0 +1,103 @@
+/*! \file detection.h
+ *
+ * Detection of spikes in raw recordings by matching a bank of
+ * multi-channel templates.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _DETECTION_H_
+#define _DETECTION_H_
+
+#include <vector>
+
+#include <armadillo>
+
+#include "datafile.h"
+#include "snipfile.h"
+
+/*! The detection namespace contains a matched-filter spike detector.
+ *
+ * Each template is a waveform spanning one or more channels. The score of
+ * a template at each sample is the projection of the data starting at that
+ * sample onto the template, after removing the mean of each channel of the
+ * template and scaling it to unit norm. The score is thus in the units of the
+ * data, and its noise is estimated in each block from the median absolute
+ * score. Spikes are detected at local maxima of the score which exceed a
+ * multiple of the noise.
+ *
+ * The recording is scanned in blocks which overlap by the length of the
+ * longest template. Each block of each channel is transformed once by an
+ * FFT, and the scores of every template are computed by one inverse FFT of
+ * the sum of its channels' products. Blocks are read by the calling thread,
+ * while transforms and scores are computed in parallel over blocks and over
+ * templates.
+ */
+namespace detection {
+
+/*! A template waveform, in ADC units. */
+struct Template {
+	arma::mat waveform;		// Shape (length, channels.n_elem)
+	arma::uvec channels;	// Channels of the recording spanned by the template. The first is its primary channel
+	arma::uword peak = 0;	// Sample of the waveform reported as the time of a detection
+};
+
+/*! Options controlling detection. */
+struct Options {
+	double threshold = 5.;		// Minimum score, in multiples of the noise of the score
+	arma::uword deadTime = 0;	// Minimum samples between detections of one template, 0 for its length
+	arma::uword fftSize = 16384;	// Samples in each transformed block, including the overlap
+	unsigned int nthreads = 0;	// Threads used to compute scores, 0 for all cores
+	bool skipBadChannels = true;	// Ignore channels marked bad in the recording's channel mask
+};
+
+/*! A spike detected by a template. */
+struct Detection {
+	arma::uword sample;		// Sample of the template's peak
+	arma::uword templ;		// Index of the template
+	double score;			// Score, in multiples of the noise
+};
+
+/*! Detect spikes in a recording by matching templates.
+ * \param file The recording to scan.
+ * \param templates The bank of templates.
+ * \param options Options controlling detection.
+ *
+ * Returns the detections of all templates, sorted by sample.
+ *
+ * Unless disabled in the options, channels marked bad in the recording's
+ * channel mask (see datafile::DataFile::scanChannels()) are ignored: they
+ * are left out of the scores of templates spanning them, and templates
+ * whose primary channel is bad detect nothing.
+ *
+ * Exceptions:
+ * Throws a std::logic_error if any template is empty, spans a channel
+ * not in the recording, or is longer than the FFT size.
+ */
+std::vector<Detection> detect(const datafile::DataFile& file,
+		const std::vector<Template>& templates, const Options& options = Options());
+
+/*! Detect spikes in a recording by matching templates, and write them
+ * to a new snippet file.
+ * \param file The recording to scan.
+ * \param templates The bank of templates.
+ * \param snipFile A newly created snippet file, to which the detections
+ * 	are written.
+ * \param options Options controlling detection.
+ *
+ * Each detection is stored on the primary channel of its template, with
+ * the snippet around it read from the recording, and labeled with the
+ * index of its template. Detections whose snippets would extend beyond
+ * the recording, or whose channel the snippet file skips as bad (see
+ * snipfile::StorageOptions::skipBadChannels), are discarded.
+ *
+ * Returns the detections which were written.
+ */
+std::vector<Detection> detect(const datafile::DataFile& file,
+		const std::vector<Template>& templates, snipfile::SnipFile& snipFile,
+		const Options& options = Options());
+
+}; // end detection namespace
+
+#endif
+
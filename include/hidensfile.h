@@ -29,10 +29,13 @@ const std::string DefaultArray = "hidens";
 class HidensFile : public datafile::DataFile {
 	public:
 
-		/*! Construct a HiDens recording file. */
+		/*! Construct a HiDens recording file.
+		 * \param layout The layout of samples on disk, if the file is created.
+		 */
 		HidensFile(std::string filename, 
 				std::string array = DefaultArray,
-				int nchannels = NumChannels);
+				int nchannels = NumChannels,
+				datafile::Layout layout = datafile::ChannelMajor);
 
 		/*! Return the configuration saved in this file */
 		Configuration configuration() const;
@@ -62,7 +65,7 @@ class HidensFile : public datafile::DataFile {
 		 * that setting analog output is not supported for this
 		 * class.
 		 */
-		virtual void setAnalogOutputSize(int sz) override;
+		virtual void setAnalogOutputSize(datafile::sample_index sz) override;
 
 	protected:
 		void readConfiguration();
@@ -23,6 +23,11 @@ const size_t NUM_SAMPLES_BEFORE = 12;
 /*! The number of samples after a local maximum to take for each snippet */
 const size_t NUM_SAMPLES_AFTER = 40;
 
+/*! The number of samples of raw data read at once when extracting
+ * neighborhood snippets
+ */
+const size_t EXTRACT_BLOCK_SIZE = 5 * datafile::BlockSize;
+
 /*! The HidensSnipFile class subclasses SnipFile, extending it with
  * functionality specific to data recorded on the HiDens array.
  *
@@ -36,13 +41,15 @@ class HidensSnipFile : public snipfile::SnipFile {
 		/*! Construct a new snippet file.
 		 * \param name The name of the newly constructed file
 		 * \param source The raw data file from which snippets will be extracted.
+		 * \param options How snippet datasets are chunked and compressed.
 		 */
 		HidensSnipFile(const std::string& name, const hidensfile::HidensFile& source,
 				const size_t nbefore = hidenssnipfile::NUM_SAMPLES_BEFORE,
-				const size_t nafter = hidenssnipfile::NUM_SAMPLES_AFTER);
+				const size_t nafter = hidenssnipfile::NUM_SAMPLES_AFTER,
+				const snipfile::StorageOptions& options = snipfile::StorageOptions());
 
-		/*! Open an existing snippet file */
-		HidensSnipFile(const std::string& name); // existing file
+		/*! Open an existing snippet file, for writing labels if writable is true */
+		HidensSnipFile(const std::string& name, bool writable = false); // existing file
 		HidensSnipFile(const HidensSnipFile& other) = delete;
 
 		/*! Destroy a snippet file */
@@ -68,6 +75,62 @@ class HidensSnipFile : public snipfile::SnipFile {
 		 */
 		arma::Col<uint32_t> indices() const;
 
+		/*! Return the neighborhood of each extracted channel.
+		 * \param k The number of channels in each neighborhood.
+		 *
+		 * Column `i` contains the `k` channels whose electrodes are nearest
+		 * that of the channel `channels()(i)`, in order of increasing distance,
+		 * starting with the channel itself. Ties are broken by channel number.
+		 * If the file skips bad channels, those marked bad in the source are
+		 * left out of every neighborhood.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if there are fewer than `k` electrodes.
+		 */
+		arma::umat neighborhoods(size_t k) const;
+
+		/*! Extract and write multi-channel snippets around spikes.
+		 * \param source The raw data file from which snippets are extracted.
+		 * \param idx The sorted samples of the peaks of the spikes on each
+		 * extracted channel, e.g., the indices passed to writeSpikeSnips().
+		 * \param k The number of channels in each neighborhood.
+		 *
+		 * Each spike's snippet is a block of shape (snippet_size, k), taken
+		 * from the channels of the spike's neighborhood. Blocks are stored
+		 * contiguously, one per spike, in the dataset 'neighborhood-snippets'
+		 * of each channel's group, with shape (nspikes, k, snippet_size). The
+		 * spikes and the channels of the neighborhood are stored in the
+		 * datasets 'neighborhood-idx' and 'neighborhood-channels'.
+		 *
+		 * The raw data is streamed from the source in blocks of about
+		 * EXTRACT_BLOCK_SIZE samples, each extended to cover the last
+		 * snippet starting within it, and snippets are written after each
+		 * block. Samples within a block are read once however many spikes
+		 * overlap them; only snippets crossing the end of a block cause up
+		 * to one snippet's worth of samples to be read again by the next.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if `k` is zero, if no channels were
+		 * extracted, if the spikes of any channel are not sorted, or if any
+		 * snippet would extend outside the source data.
+		 */
+		void writeNeighborhoodSnips(const hidensfile::HidensFile& source,
+				const std::vector<arma::uvec>& idx, size_t k);
+
+		/*! Return the neighborhood snippets from the given channel.
+		 * \param channel The channel number to return snippets from.
+		 * \param idx Vector filled with the samples of each spike.
+		 * \param snips Filled with the snippets, with shape
+		 * (snippet_size, k, nspikes), so that each slice is one spike.
+		 */
+		void neighborhoodSnips(arma::uword channel, arma::uvec& idx,
+				arma::Cube<short>& snips);
+
+		/*! Return the channels of the neighborhood of the given channel,
+		 * for which neighborhood snippets were written.
+		 */
+		arma::uvec neighborhoodChannels(arma::uword channel);
+
 	private:
 		arma::Col<uint32_t> xpos_, ypos_;
 		arma::Col<uint16_t> x_, y_;
@@ -104,7 +167,7 @@ void hidenssnipfile::HidensSnipFile::readConfigDataset(const H5::DataSet& dset,
 		dtype = H5::PredType::STD_U32LE;
 	else if (typeid(T).hash_code() == typeid(arma::Col<uint16_t>).hash_code())
 		dtype = H5::PredType::STD_U16LE;
-	else if (typeid(T).hash_code() == typeid(arma::Col<char>).hash_code()) {
+	else if (typeid(T).hash_code() == typeid(arma::Col<uint8_t>).hash_code()) {
 		auto strtype = H5::StrType(H5::PredType::C_S1, 1);
 		strtype.setStrpad(H5T_STR_NULLPAD);
 		dtype = strtype;
@@ -0,0 +1,150 @@
+/*! \file iostats.h
+ *
+ * Cheap counters and timers for the I/O performed by data and snippet files.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _IOSTATS_H_
+#define _IOSTATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "H5Cpp.h"
+
+namespace datafile {
+
+/*! Categories of operations that are counted and timed. */
+enum IoOp {
+	IoRead = 0,		// Reads of raw data or snippets
+	IoWrite,		// Writes of raw data or snippets
+	IoExtend,		// Extensions of a dataset
+	IoAttribute,	// Reads or writes of attributes
+	IoConvert,		// Conversion of data after reading, e.g., scaling by the gain
+	IoFlush,		// Flushes of the file to disk
+	NumIoOps
+};
+
+/*! A snapshot of the I/O counters of a file.
+ *
+ * The counts, elapsed times and bytes transferred are indexed by the
+ * IoOp enumeration, e.g., `stats.count[IoRead]`.
+ */
+struct IoStats {
+	std::array<uint64_t, NumIoOps> count;		// Number of operations
+	std::array<uint64_t, NumIoOps> nanoseconds;	// Time spent in operations
+	std::array<uint64_t, NumIoOps> bytes;		// Bytes transferred by operations
+	uint64_t chunksAccessed;	// Dataset chunks touched by raw data reads and writes
+	double metadataCacheHitRate;	// HDF5 metadata cache hit rate, or -1 if unavailable
+
+	/*! Return the total time spent in the given operation, in seconds. */
+	double seconds(IoOp op) const { return nanoseconds[op] * 1e-9; }
+
+	/*! Return the total number of bytes read. */
+	uint64_t bytesRead() const { return bytes[IoRead]; }
+
+	/*! Return the total number of bytes written. */
+	uint64_t bytesWritten() const { return bytes[IoWrite]; }
+};
+
+/*! The IoCounters class holds atomic counters for each category of
+ * operation. The counters may be read with snapshot() from any thread
+ * while the file is in use, and reset between phases of a job.
+ */
+class IoCounters {
+	public:
+		IoCounters() { reset(); }
+		IoCounters(const IoCounters&) = delete;
+
+		/*! Record a single operation of the given type. */
+		void add(IoOp op, uint64_t nanoseconds, uint64_t bytes = 0)
+		{
+			m_count[op].fetch_add(1, std::memory_order_relaxed);
+			m_nanoseconds[op].fetch_add(nanoseconds, std::memory_order_relaxed);
+			if (bytes)
+				m_bytes[op].fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		/*! Record the number of dataset chunks touched by an operation. */
+		void addChunks(uint64_t n)
+		{
+			m_chunks.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		/*! Return a copy of the current value of all counters. The
+		 * metadata cache hit rate is not known here, and is set to -1.
+		 */
+		IoStats snapshot() const
+		{
+			IoStats s;
+			for (int i = 0; i < NumIoOps; i++) {
+				s.count[i] = m_count[i].load(std::memory_order_relaxed);
+				s.nanoseconds[i] = m_nanoseconds[i].load(std::memory_order_relaxed);
+				s.bytes[i] = m_bytes[i].load(std::memory_order_relaxed);
+			}
+			s.chunksAccessed = m_chunks.load(std::memory_order_relaxed);
+			s.metadataCacheHitRate = -1.;
+			return s;
+		}
+
+		/*! Set all counters to zero. */
+		void reset()
+		{
+			for (int i = 0; i < NumIoOps; i++) {
+				m_count[i].store(0, std::memory_order_relaxed);
+				m_nanoseconds[i].store(0, std::memory_order_relaxed);
+				m_bytes[i].store(0, std::memory_order_relaxed);
+			}
+			m_chunks.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint64_t> m_count[NumIoOps];
+		std::atomic<uint64_t> m_nanoseconds[NumIoOps];
+		std::atomic<uint64_t> m_bytes[NumIoOps];
+		std::atomic<uint64_t> m_chunks;
+};
+
+/*! Times a scope, adding the elapsed time to a set of counters when
+ * the scope exits, including by an exception.
+ */
+class IoTimer {
+	public:
+		IoTimer(IoCounters& counters, IoOp op, uint64_t bytes = 0)
+			: m_counters(counters),
+			  m_op(op),
+			  m_bytes(bytes),
+			  m_start(std::chrono::steady_clock::now())
+		{
+		}
+		IoTimer(const IoTimer&) = delete;
+
+		~IoTimer()
+		{
+			auto elapsed = std::chrono::steady_clock::now() - m_start;
+			m_counters.add(m_op, static_cast<uint64_t>(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+					m_bytes);
+		}
+
+	private:
+		IoCounters& m_counters;
+		IoOp m_op;
+		uint64_t m_bytes;
+		std::chrono::steady_clock::time_point m_start;
+};
+
+/*! Return the hit rate of the metadata cache of the given HDF5 file,
+ * or -1 if it could not be queried.
+ */
+double metadataCacheHitRate(hid_t file);
+
+/*! Reset the hit rate statistics of the metadata cache of the given HDF5 file. */
+void resetMetadataCacheStats(hid_t file);
+
+}; // end datafile namespace
+
+#endif
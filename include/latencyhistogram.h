@@ -0,0 +1,194 @@
+/*! \file latencyhistogram.h
+ *
+ * Lock-free, log-bucketed histograms for recording the latency of
+ * operations on data files, e.g., writes during real-time acquisition.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _LATENCYHISTOGRAM_H_
+#define _LATENCYHISTOGRAM_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace datafile {
+
+/*! Operations whose latency may be recorded by a DataFile */
+enum LatencyOp {
+	LatencySetData = 0,	// Complete calls to DataFile::setData()
+	LatencyFlush,		// Flushes of the file to disk
+	LatencyExtend,		// Extensions of the dataset
+	NumLatencyOps
+};
+
+/*! Summary statistics of the latency of one type of operation,
+ * in nanoseconds. Percentiles are accurate to within the width
+ * of a histogram bucket, about 6% of the value.
+ */
+struct LatencySummary {
+	uint64_t count;		// Number of recorded operations
+	uint64_t p50;		// Median latency
+	uint64_t p99;		// 99th percentile latency
+	uint64_t p999;		// 99.9th percentile latency
+	uint64_t max;		// Largest recorded latency
+	double mean;		// Mean latency
+};
+
+/*! The LatencyHistogram class records durations into buckets whose width
+ * grows with the value, in the style of an HDR histogram. Each power of
+ * two is split into 16 sub-buckets, so that the relative error of any
+ * reported value is bounded, while the whole range of a 64-bit value fits
+ * in a fixed number of buckets.
+ *
+ * Recording a value is lock-free and may be done from any thread.
+ */
+class LatencyHistogram {
+	public:
+		/*! Number of sub-buckets for each power of two, as a power of two */
+		static const int SubBucketBits = 4;
+
+		/*! Number of sub-buckets for each power of two */
+		static const int SubBucketCount = 1 << SubBucketBits;
+
+		/*! Total number of buckets */
+		static const int BucketCount = 64 * SubBucketCount;
+
+		LatencyHistogram() { reset(); }
+		LatencyHistogram(const LatencyHistogram&) = delete;
+
+		/*! Record a single duration, in nanoseconds. */
+		void record(uint64_t value)
+		{
+			m_counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_sum.fetch_add(value, std::memory_order_relaxed);
+			auto max = m_max.load(std::memory_order_relaxed);
+			while ((value > max) && !m_max.compare_exchange_weak(max, value,
+						std::memory_order_relaxed)) {
+			}
+		}
+
+		/*! Return the number of recorded values. */
+		uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+		/*! Return the largest recorded value. */
+		uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+		/*! Return the q-th quantile, with q in [0, 1], of the recorded values.
+		 * This is the upper bound of the bucket containing the quantile,
+		 * and is never larger than the largest recorded value.
+		 */
+		uint64_t percentile(double q) const;
+
+		/*! Return the median, 99th and 99.9th percentile, maximum and mean
+		 * of the recorded values.
+		 */
+		LatencySummary summary() const;
+
+		/*! Remove all recorded values. */
+		void reset();
+
+		/*! Return the index of the bucket containing the given value. */
+		static int bucketIndex(uint64_t value)
+		{
+			if (value < static_cast<uint64_t>(SubBucketCount))
+				return static_cast<int>(value);
+			int msb = 63 - __builtin_clzll(value);
+			int shift = msb - SubBucketBits;
+			int sub = static_cast<int>((value >> shift) & (SubBucketCount - 1));
+			return (shift + 1) * SubBucketCount + sub;
+		}
+
+		/*! Return the largest value falling in the given bucket. */
+		static uint64_t bucketUpperBound(int index);
+
+	private:
+		std::atomic<uint64_t> m_counts[BucketCount];
+		std::atomic<uint64_t> m_count;
+		std::atomic<uint64_t> m_sum;
+		std::atomic<uint64_t> m_max;
+};
+
+/*! Function called when an operation takes longer than a deadline.
+ * It is passed the type of the operation and its duration in nanoseconds,
+ * and is called on the thread performing the operation, so it should
+ * return quickly and must not throw.
+ */
+using DeadlineCallback = std::function<void(LatencyOp op, uint64_t nanoseconds)>;
+
+/*! The LatencyRecorder class holds one histogram for each type of operation,
+ * along with an optional deadline and a callback invoked when it is exceeded.
+ */
+class LatencyRecorder {
+	public:
+		/*! Construct a recorder.
+		 * \param deadline Deadline in nanoseconds. If 0, no deadline is enforced.
+		 * \param callback Function called when an operation exceeds the deadline.
+		 */
+		LatencyRecorder(uint64_t deadline = 0, DeadlineCallback callback = nullptr)
+			: m_deadline(deadline),
+			  m_callback(callback)
+		{
+		}
+
+		/*! Record the duration of an operation, calling the deadline callback
+		 * if the duration exceeds the deadline.
+		 */
+		void record(LatencyOp op, uint64_t nanoseconds)
+		{
+			m_histograms[op].record(nanoseconds);
+			if (m_deadline && (nanoseconds > m_deadline) && m_callback)
+				m_callback(op, nanoseconds);
+		}
+
+		/*! Return the histogram for the given operation. */
+		const LatencyHistogram& histogram(LatencyOp op) const { return m_histograms[op]; }
+
+		/*! Remove all recorded values from each histogram. */
+		void reset()
+		{
+			for (auto& h : m_histograms)
+				h.reset();
+		}
+
+	private:
+		LatencyHistogram m_histograms[NumLatencyOps];
+		uint64_t m_deadline;
+		DeadlineCallback m_callback;
+};
+
+/*! Times a scope and records its duration in a LatencyRecorder. If the
+ * recorder is null, nothing is timed or recorded.
+ */
+class LatencyTimer {
+	public:
+		LatencyTimer(LatencyRecorder* recorder, LatencyOp op)
+			: m_recorder(recorder),
+			  m_op(op)
+		{
+			if (m_recorder)
+				m_start = std::chrono::steady_clock::now();
+		}
+		LatencyTimer(const LatencyTimer&) = delete;
+
+		~LatencyTimer()
+		{
+			if (m_recorder) {
+				auto elapsed = std::chrono::steady_clock::now() - m_start;
+				m_recorder->record(m_op, static_cast<uint64_t>(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+			}
+		}
+
+	private:
+		LatencyRecorder* m_recorder;
+		LatencyOp m_op;
+		std::chrono::steady_clock::time_point m_start;
+};
+
+}; // end datafile namespace
+
+#endif
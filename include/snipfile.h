@@ -9,12 +9,15 @@
 #ifndef EXTRACT_SNIPFILE_H_
 #define EXTRACT_SNIPFILE_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
 #include <armadillo>
 #include "H5Cpp.h"
 
+#include "alignment.h"
+#include "clustering.h"
 #include "datafile.h"
 
 /*! Namespace for files that are the output of extract. */
@@ -37,6 +40,60 @@ const size_t DEFAULT_NUM_SNIPPETS = 1000;
 const size_t SNIP_DATASET_RANK = 2;
 const size_t IDX_DATASET_RANK = 1;
 
+/*! The number of snippets per chunk of compressed datasets, if not given */
+const hsize_t DEFAULT_CHUNK_SNIPPETS = 1024;
+
+/*! Filters which may be applied to snippet datasets when they are created.
+ * 	- NO_COMPRESSION - Snippets are stored without filters.
+ * 	- DEFLATE - Snippets are compressed with gzip, optionally after
+ * 	  shuffling the bytes of each sample.
+ * 	- NBIT - Only the low StorageOptions::nbits bits of each sample
+ * 	  are stored. This is lossless only if every sample fits in that
+ * 	  many bits, as for HiDens data stored in 16-bit files.
+ * 	- SCALE_OFFSET - Each chunk is stored relative to its minimum, using
+ * 	  the fewest bits needed for its range. This is lossless for integers.
+ */
+enum Compression {
+	NO_COMPRESSION,
+	DEFLATE,
+	NBIT,
+	SCALE_OFFSET
+};
+
+/*! Options controlling how snippet and index datasets are stored when
+ * a snippet file is created.
+ *
+ * Filters can only be applied to chunked datasets, so datasets are chunked
+ * with DEFAULT_CHUNK_SNIPPETS snippets per chunk if any compression is
+ * requested without a chunk size. The index datasets are chunked and
+ * compressed in the same way as the snippets, except that NBIT applies
+ * only to snippets. Files written with any of these options are read
+ * exactly as other snippet files.
+ *
+ * Delta-encoded spike indices store the first index of every chunk, or of
+ * every DEFAULT_CHUNK_SNIPPETS rows of a contiguous dataset, as a checkpoint
+ * and the others as differences from the previous one. Reading selected
+ * rows then reads and decodes only from the checkpoint before each run.
+ *
+ * Files created with skipBadChannels leave out the channels marked bad in
+ * the source's channel mask (see datafile::DataFile::scanChannels()), so
+ * that no snippets are extracted or stored for them.
+ */
+struct StorageOptions {
+	hsize_t chunkSnippets = 0;		// Snippets per chunk, 0 for contiguous datasets
+	Compression compression = NO_COMPRESSION;	// Filter applied to the datasets
+	bool shuffle = true;			// Shuffle bytes before deflating
+	int deflateLevel = 4;			// Level of gzip compression, from 0 to 9
+	size_t nbits = 0;				// Bits kept by NBIT, 0 for the source precision
+	bool deltaIndices = false;		// Store spike indices as differences, see below
+	bool skipBadChannels = false;	// Leave out channels marked bad in the source, see below
+
+	/*! Return options which compress snippets with shuffle and deflate,
+	 * and delta-encode spike indices, a good default for archival.
+	 */
+	static StorageOptions compressed();
+};
+
 /*! A class representing the output of extract.
  *
  * The SnipFile class represents the output of extract. It is an HDF5 file
@@ -47,6 +104,16 @@ const size_t IDX_DATASET_RANK = 1;
  * 	- 'noise-snippets' - The actual random snippets for this channel.
  * 	- 'spike-idx' - The indices of each extract spike snippet.
  * 	- 'spike-snippets' - The actual extracted candidate spikes.
+ *
+ * Spike snippets are accompanied by their features and an index of them
+ * sorted by amplitude: 'spike-amplitudes' holds the amplitudes in
+ * increasing order, and 'spike-amplitude-order' the row of each.
+ *
+ * Once spikes are sorted, each group may also hold the cluster label of
+ * each spike snippet, in 'spike-labels', and the rows of each labeled
+ * unit, in the 'units' subgroup. The rows of a unit are stored in a
+ * dataset named by its label, as the differences between successive rows,
+ * so that relabeling replaces only the datasets of the units it changes.
  */
 class SnipFile {
 
@@ -55,22 +122,31 @@ class SnipFile {
 		 * \param filename The name of the newly created file.
 		 * \param source The original DataFile object from which raw data
 		 * will be extracted. This is used to copy file metadata.
+		 * \param options How snippet datasets are chunked and compressed.
 		 */
 		SnipFile(std::string filename, const datafile::DataFile& source,
 				const size_t nbefore = snipfile::NUM_SAMPLES_BEFORE, 
-				const size_t nafter = snipfile::NUM_SAMPLES_AFTER);
+				const size_t nafter = snipfile::NUM_SAMPLES_AFTER,
+				const StorageOptions& options = StorageOptions());
 
 		/*! Open an existing snippet file.
 		 * \param filename The name of the snippet file to load.
+		 * \param writable If true, the file is opened for writing, so that
+		 * cluster labels may be stored in it. Otherwise it is read-only.
 		 */
-		SnipFile(std::string filename);	// Existing file
+		SnipFile(std::string filename, bool writable = false);	// Existing file
 
 		SnipFile(const SnipFile& other) = delete;
 
 		/*! Destroy a snippet file object */
 		virtual ~SnipFile();
 
-		/*! Set the array of channels from which data has been extracted */
+		/*! Set the array of channels from which data has been extracted.
+		 *
+		 * If the file was created with StorageOptions::skipBadChannels,
+		 * channels marked bad in the source are dropped, and snippets and
+		 * thresholds are then given for the channels returned by channels().
+		 */
 		void setChannels(const arma::uvec& channels);
 
 		/*! Set the thresholds for each channel */
@@ -162,6 +238,165 @@ class SnipFile {
 		void noiseSnips(std::vector<arma::uvec>& idx,
 				std::vector<arma::mat>& snips);
 
+		/*! Return the extracted spike snippets from the given channel in
+		 * matrices whose memory is acquired from the given pool.
+		 * \param channel The channel number to return snippets from.
+		 * \param idx Matrix of shape (nsnippets, 1) filled with the indices
+		 * of the snippets.
+		 * \param snips The snippets themselves, with shape (snippet_size, nsnippets).
+		 * \param pool The pool from which to acquire the matrices.
+		 *
+		 * Any matrices previously held by idx and snips are returned to
+		 * their pool. Snippets read as doubles are converted into voltages
+		 * using the stored gain.
+		 */
+		void spikeSnips(arma::uword channel, datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<short>& snips, datafile::BufferPool& pool);
+		void spikeSnips(arma::uword channel, datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<double>& snips, datafile::BufferPool& pool);
+
+		/*! Return the extracted noise snippets from the given channel in
+		 * matrices whose memory is acquired from the given pool. See
+		 * spikeSnips() for details.
+		 */
+		void noiseSnips(arma::uword channel, datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<short>& snips, datafile::BufferPool& pool);
+		void noiseSnips(arma::uword channel, datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<double>& snips, datafile::BufferPool& pool);
+
+		/*! Return the features of each spike snippet from the given channel.
+		 * \param channel The channel number to return features from.
+		 * \param peak Filled with the largest value of each snippet.
+		 * \param trough Filled with the smallest value of each snippet.
+		 * \param width Filled with the number of samples from the trough of
+		 * each snippet to the largest value following it.
+		 *
+		 * Features are in the raw units stored in the file, and are in the
+		 * same order as the snippets. They are computed and stored when spike
+		 * snippets are written, and computed from the snippets for files
+		 * written without them.
+		 */
+		void spikeFeatures(arma::uword channel, arma::Col<short>& peak,
+				arma::Col<short>& trough, arma::Col<uint16_t>& width);
+
+		/*! Return the spike snippets from the given channel whose amplitude
+		 * is at least the given value.
+		 * \param channel The channel number to return snippets from.
+		 * \param minAmplitude The smallest amplitude of returned snippets,
+		 * in raw units. The amplitude of a snippet is the larger of the
+		 * magnitudes of its peak and trough.
+		 * \param idx Vector filled with the indices of the selected snippets.
+		 * \param snips The selected snippets, in the order they are stored.
+		 *
+		 * The snippets are selected by a binary search over the chunks of the
+		 * amplitude index stored with the spike snippets, so that each chunk
+		 * visited is read once, and only the rows of the selected snippets
+		 * and the snippets themselves are read.
+		 */
+		void spikeSnipsAbove(arma::uword channel, double minAmplitude,
+				arma::uvec& idx, arma::Mat<short>& snips);
+
+		/*! Store the cluster label of each spike snippet on the given channel,
+		 * replacing any existing labels.
+		 * \param channel The channel number whose snippets were sorted.
+		 * \param labels The label of each snippet, in the order they are stored.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the file is read-only, or if the number
+		 * of labels differs from the number of spike snippets on the channel.
+		 */
+		void setLabels(arma::uword channel, const arma::ivec& labels);
+
+		/*! Give every snippet of one unit the label of another, as when
+		 * merging two units. Only the rows of the merged unit are written.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the file is read-only or the channel
+		 * has no labels.
+		 */
+		void relabel(arma::uword channel, arma::sword from, arma::sword to);
+
+		/*! Give the snippets in the given rows a new label, as when splitting
+		 * a unit. Only the given rows are written.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the file is read-only, the channel has
+		 * no labels, or any row is out of range.
+		 */
+		void relabel(arma::uword channel, const arma::uvec& rows, arma::sword label);
+
+		/*! Return the label of each spike snippet on the given channel, or
+		 * an empty vector if the channel has no labels.
+		 */
+		arma::ivec labels(arma::uword channel);
+
+		/*! Return the labels of the units on the given channel, in increasing order */
+		arma::ivec units(arma::uword channel);
+
+		/*! Return the sorted rows of the snippets of one unit on the given channel */
+		arma::uvec unitRows(arma::uword channel, arma::sword unit);
+
+		/*! Return the spike snippets of one unit on the given channel.
+		 * Only the rows of the unit are read from the file.
+		 */
+		void unitSnips(arma::uword channel, arma::sword unit,
+				arma::uvec& idx, arma::Mat<short>& snips);
+
+		/*! Return the indices of the spikes on the given channel, without
+		 * reading their snippets.
+		 */
+		arma::uvec spikeIdx(arma::uword channel);
+
+		/*! Return the indices of the spikes of one unit on the given channel */
+		arma::uvec unitIdx(arma::uword channel, arma::sword unit);
+
+		/*! Estimate the time of the peak of every spike snippet more finely
+		 * than the sample period, and store the refined times.
+		 * \param options Options controlling how snippets are upsampled and
+		 * how their peaks are found.
+		 *
+		 * The refined time of each spike, in fractional samples, is stored
+		 * in the dataset 'spike-times' of its channel's group. If requested,
+		 * snippets resampled so that their refined peaks fall on the nominal
+		 * peak sample are stored in 'aligned-snippets'. Snippets are read,
+		 * upsampled and aligned in batches of options.batchSnippets, so that
+		 * memory use does not depend on the number of spikes.
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the file is read-only.
+		 */
+		void alignSpikes(const alignment::Options& options = alignment::Options());
+
+		/*! Return the refined time of each spike on the given channel, in
+		 * fractional samples, or an empty vector if spikes were not aligned.
+		 */
+		arma::vec spikeTimes(arma::uword channel);
+
+		/*! Return the aligned spike snippets from the given channel, stored
+		 * by alignSpikes(), with their indices.
+		 */
+		void alignedSnips(arma::uword channel, arma::uvec& idx, arma::Mat<short>& snips);
+
+		/*! Cluster the spike snippets from the given channel, and store the
+		 * cluster of each as its label.
+		 * \param channel The channel whose snippets are clustered.
+		 * \param options Options controlling the fit.
+		 *
+		 * Centers are fit by mini-batch k-means to random batches of
+		 * options.batchSize snippets, and then every snippet is assigned
+		 * to its nearest center in contiguous batches, so that memory use
+		 * does not depend on the number of spikes. Labels are the indices
+		 * of the centers, and replace any labels already stored.
+		 *
+		 * Returns the cluster centers, with shape (snippet_size, nclusters).
+		 *
+		 * Exceptions:
+		 * Throws a std::logic_error if the file is read-only, the channel
+		 * has no spike snippets, or it has fewer snippets than clusters.
+		 */
+		arma::mat clusterSpikes(arma::uword channel,
+				const clustering::Options& options = clustering::Options());
+
 		/*! Return the type of the raw data stored in the array */
 		H5::DataType dtype();
 
@@ -208,6 +443,12 @@ class SnipFile {
 		/*! Return the thresholds used when extracting from each channel */
 		arma::vec thresholds();
 
+		/*! Return a snapshot of the I/O counters of this file. */
+		datafile::IoStats stats() const;
+
+		/*! Reset all I/O counters of this file. */
+		void resetStats();
+
 	protected:
 
 		std::string filename_;
@@ -223,6 +464,9 @@ class SnipFile {
 		size_t samplesAfter_;
 		arma::uvec channels_;
 		arma::vec thresholds_;
+		arma::uvec channelMask_;	// Good channels of the source, empty unless bad channels are skipped
+		StorageOptions storage_;
+		bool writable_;
 
 		/* HDF components */
 		H5::H5File file;
@@ -232,6 +476,43 @@ class SnipFile {
 		std::vector<H5::DataSet> spikeIdxDatasets;
 		std::vector<H5::DataSet> noiseIdxDatasets;
 		H5::DataType dstType;
+		mutable datafile::IoCounters stats_;
+		datafile::BufferPool pool_;	// Temporary buffers for converting reads
+
+		/* Handles to the index and snippet datasets of one type of snippet
+		 * in a channel's group, with their extents.
+		 */
+		struct SnipDatasets {
+			bool opened = false;
+			H5::DataSet idx;
+			H5::DataSet snips;
+			hsize_t nsnips = 0;
+			hsize_t snipSize = 0;
+			bool deltaIndices = false;	// Indices are stored as differences
+			hsize_t checkpointInterval = 0;	// Rows between absolute indices, 0 for only the first
+		};
+
+		/* Cluster labels of a channel's spike snippets, and the sorted
+		 * rows of each unit, kept in memory once read.
+		 */
+		struct ChannelLabels {
+			bool loaded = false;
+			arma::ivec labels;
+			std::map<arma::sword, arma::uvec> units;
+		};
+
+		/* Handles for one channel's group. These are opened on first use
+		 * and kept for the life of the file, so that repeated reads from a
+		 * channel do not open the group and datasets again.
+		 */
+		struct ChannelHandles {
+			bool exists = false;
+			H5::Group group;
+			SnipDatasets spike;
+			SnipDatasets noise;
+			ChannelLabels labels;
+		};
+		std::map<arma::uword, ChannelHandles> channelHandles_;
 
 		void getSourceInfo(const datafile::DataFile& source);
 		void writeSnips(const std::string& type, 
@@ -239,6 +520,16 @@ class SnipFile {
 				const std::vector<arma::Mat<short> >& snips);
 		void writeAttributes();
 		void readAttributes();
+
+		/* Return the creation properties of a snippet or index dataset
+		 * with the given number of snippets, following storage_. Snippets
+		 * spanning several channels have shape (nsnips, nchannels, snipSize).
+		 */
+		H5::DSetCreatPropList datasetProperties(hsize_t nsnips,
+				hsize_t snipSize, bool snippets, hsize_t nchannels = 0) const;
+
+		/* Return the type in which snippets are stored in the file */
+		H5::DataType snippetType() const;
 		void writeFileStringAttr(const std::string& name, const std::string& value);
 		void writeFileAttr(const std::string& name, const H5::DataType& type,
 				const void* buf);
@@ -252,6 +543,56 @@ class SnipFile {
 				std::vector<arma::Mat<short> >& snips);
 		void snips(const std::string& type, arma::uword channel, arma::uvec& idx,
 				arma::Mat<short>& snips);
+		void snips(const std::string& type, arma::uword channel,
+				datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<short>& snips, datafile::BufferPool& pool);
+		void snips(const std::string& type, arma::uword channel,
+				datafile::PooledMatrix<arma::uword>& idx,
+				datafile::PooledMatrix<double>& snips, datafile::BufferPool& pool);
+		void voltageSnips(const std::string& type, arma::uword channel,
+				arma::uvec& idx, arma::mat& snips, float offset);
+
+		/* Return the cached handles for a channel's group, opening the
+		 * group on first use. Returns nullptr if the channel has no group.
+		 */
+		ChannelHandles* channelHandles(arma::uword channel);
+
+		/* Return the cached index and snippet datasets of the given type
+		 * for a channel, opening them on first use. Returns nullptr if the
+		 * channel has no group in the file.
+		 */
+		const SnipDatasets* openSnips(const std::string& type, arma::uword channel);
+
+		/* Read all indices and snippets from the given datasets. If snips
+		 * is null, only the indices are read.
+		 */
+		void readSnips(const SnipDatasets& datasets, arma::uword* idx, short* snips);
+
+		/* Read the given rows of the index and snippet datasets. The rows
+		 * must be sorted, and runs of consecutive rows are read together.
+		 * If idx or snips is null, only the other is read.
+		 */
+		void readSnipRows(const SnipDatasets& datasets, const arma::uvec& rows,
+				arma::uword* idx, short* snips);
+
+		/* Compute the features of each spike snippet, and write them to the
+		 * channel's group with the amplitude index.
+		 */
+		void writeFeatures(H5::Group& grp, const arma::Mat<short>& snips);
+
+		/* Return the labels of a channel, reading them on first use, or
+		 * nullptr if the channel has no spike snippets. Throws a
+		 * std::logic_error if writing and the file is read-only.
+		 */
+		ChannelLabels* channelLabels(arma::uword channel, bool write = false);
+
+		/* Write the labels of the given rows, or of all rows if rows is null */
+		void writeLabels(arma::uword channel, const arma::uvec* rows);
+
+		/* Write the rows of the given units of a channel, removing those
+		 * which no longer have any rows, or of every unit if units is null.
+		 */
+		void writeUnits(arma::uword channel, const std::vector<arma::sword>* units);
 };
 };
 
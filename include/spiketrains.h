@@ -0,0 +1,119 @@
+/*! \file spiketrains.h
+ *
+ * Statistics of spike trains, computed directly from sorted spike indices,
+ * and histograms of spikes around trigger times.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _SPIKETRAINS_H_
+#define _SPIKETRAINS_H_
+
+#include <vector>
+
+#include <armadillo>
+
+/*! The spiketrains namespace contains functions computing statistics of
+ * spike trains, such as the spike indices of a channel or of a unit.
+ *
+ * Every spike train must be sorted in increasing order. The functions work
+ * by merging trains, so that their cost grows with the number of spikes and
+ * the number of pairs of spikes within the lags of interest, rather than
+ * with the product of the lengths of the trains.
+ */
+namespace spiketrains {
+
+/*! Options controlling the lags and bins of correlograms, in samples. */
+struct CorrelogramOptions {
+	arma::uword maxLag = 500;	// Lag of the center of the outermost bins
+	arma::uword binSize = 10;	// Width of each bin
+	unsigned int nthreads = 0;	// Threads used to compute correlograms, 0 for all cores
+};
+
+/*! Return the number of bins of each correlogram. Bin `k` is centered on
+ * a lag of (k - maxLag / binSize) * binSize samples.
+ */
+arma::uword correlogramBins(const CorrelogramOptions& options);
+
+/*! Return the cross-correlogram of two trains, the histogram of the lags
+ * b[j] - a[i] of all pairs of spikes.
+ *
+ * Exceptions:
+ * Throws a std::logic_error if either train is not sorted.
+ */
+arma::uvec crossCorrelogram(const arma::uvec& a, const arma::uvec& b,
+		const CorrelogramOptions& options = CorrelogramOptions());
+
+/*! Return the autocorrelogram of a train. This is the cross-correlogram
+ * of the train with itself, excluding the pairing of each spike with itself.
+ */
+arma::uvec autoCorrelogram(const arma::uvec& train,
+		const CorrelogramOptions& options = CorrelogramOptions());
+
+/*! Return the correlograms of all pairs of trains, with shape
+ * (nbins, ntrains, ntrains). Tube (i, j) holds the cross-correlogram of
+ * trains i and j, and tubes (i, i) hold the autocorrelograms. Pairs are
+ * divided among threads.
+ */
+arma::ucube correlograms(const std::vector<arma::uvec>& trains,
+		const CorrelogramOptions& options = CorrelogramOptions());
+
+/*! Violations of the refractory period by a spike train. */
+struct IsiViolations {
+	arma::uword nspikes = 0;		// Number of spikes in the train
+	arma::uword violations = 0;		// Intervals shorter than the refractory period
+	double rate = 0.;				// Fraction of intervals which are violations
+};
+
+/*! Count the inter-spike intervals of a train shorter than the given
+ * refractory period, in samples.
+ *
+ * Exceptions:
+ * Throws a std::logic_error if the train is not sorted.
+ */
+IsiViolations isiViolations(const arma::uvec& train, arma::uword refractory);
+
+/*! Options controlling the window and bins of event-locked histograms,
+ * in samples. The window of a trigger at sample t is [t - before, t + after).
+ */
+struct PsthOptions {
+	arma::uword before = 0;		// Samples of the window before each trigger
+	arma::uword after = 10000;	// Samples of the window from each trigger on
+	arma::uword binSize = 100;	// Width of each bin
+	unsigned int nthreads = 0;	// Threads used to bin trains, 0 for all cores
+};
+
+/*! Return the number of bins in the window of each trigger. The last bin
+ * is narrower if the window is not a multiple of the bin size.
+ */
+arma::uword psthBins(const PsthOptions& options);
+
+/*! Return the number of spikes of each train in each bin around each trigger,
+ * with shape (nbins, ntriggers, ntrains). This is a binned raster: column
+ * (k, j) holds the counts of train j around trigger k.
+ * \param trains The spike trains, each sorted.
+ * \param triggers The sample of each trigger, in any order.
+ * \param options The window and bins.
+ *
+ * The spikes of each trial are found by a binary search for the start of its
+ * window, so the cost grows with the number of trials and of spikes within
+ * their windows, not with the length of the trains. Trains are divided among
+ * threads, and each fills only its own slice.
+ *
+ * Exceptions:
+ * Throws a std::logic_error if any train is not sorted.
+ */
+arma::ucube binnedTrials(const std::vector<arma::uvec>& trains,
+		const arma::uvec& triggers, const PsthOptions& options = PsthOptions());
+
+/*! Return the peri-stimulus time histogram of each train, the number of its
+ * spikes in each bin summed over all triggers, with shape (nbins, ntrains).
+ * See binnedTrials() for details.
+ */
+arma::umat psth(const std::vector<arma::uvec>& trains,
+		const arma::uvec& triggers, const PsthOptions& options = PsthOptions());
+
+}; // end spiketrains namespace
+
+#endif
+
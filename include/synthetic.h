@@ -0,0 +1,123 @@
+/*! \file synthetic.h
+ *
+ * Generation of synthetic MEA recordings with known ground truth,
+ * for benchmarks and for testing at the scale of real recordings.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _SYNTHETIC_H_
+#define _SYNTHETIC_H_
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <armadillo>
+
+#include "datafile.h"
+
+/*! The synthetic namespace contains functions for generating synthetic
+ * recordings. A recording consists of colored (first-order autoregressive)
+ * Gaussian noise on every channel, to which spike waveforms of a number of
+ * units are added at known times. Each unit has a primary channel, and its
+ * waveform is also added, attenuated, to the neighboring channels.
+ *
+ * Every block of data is generated from a random stream seeded by the
+ * global seed and the block's first sample, so recordings are reproducible
+ * regardless of the number of threads used to generate them.
+ */
+namespace synthetic {
+
+/*! Parameters of a synthetic recording. */
+struct Parameters {
+	double seconds = 10.;			// Length of the recording
+	double noiseStd = 10.;			// Standard deviation of the noise, in ADC units
+	double noiseCorrelation = 0.9;	// Correlation of successive noise samples
+	int nunits = 32;				// Number of units
+	double firingRate = 5.;			// Mean firing rate of each unit, in Hz
+	double refractoryPeriod = 0.002;	// Minimum time between spikes of a unit, in seconds
+	double amplitude = 150.;		// Mean peak amplitude of spikes, in ADC units
+	double amplitudeJitter = 0.1;	// Relative standard deviation of spike amplitudes
+	double neighborScale = 0.3;		// Scale of waveforms on neighboring channels
+	double baseline = 0.;			// Value added to every sample
+	double minValue = std::numeric_limits<int16_t>::min();	// Smallest allowed sample value
+	double maxValue = std::numeric_limits<int16_t>::max();	// Largest allowed sample value
+	uint64_t blockSize = 10 * datafile::BlockSize;	// Samples generated per block
+	unsigned int nthreads = 0;		// Threads used to generate data, 0 for all cores
+	unsigned int seed = 0;			// Seed for all random streams
+
+	/*! Return parameters suited to HiDens recordings, whose samples
+	 * are unsigned 8-bit values centered on 128.
+	 */
+	static Parameters hidens();
+};
+
+/*! A spike added to a synthetic recording. */
+struct Spike {
+	uint64_t sample;	// Sample of the spike's (negative) peak
+	int channel;		// Primary channel of the spike's unit
+	int unit;			// Index of the unit
+	double amplitude;	// Peak amplitude of the spike, in ADC units
+};
+
+/*! The ground truth of a synthetic recording, sorted by sample. */
+using GroundTruth = std::vector<Spike>;
+
+/*! Number of samples before the peak of a spike waveform */
+const int WaveformSamplesBefore = 10;
+
+/*! Number of samples after the peak of a spike waveform */
+const int WaveformSamplesAfter = 30;
+
+/*! Return the primary channel of the given unit. Units are spread
+ * evenly across the channels.
+ */
+int unitChannel(const Parameters& params, int unit, int nchannels);
+
+/*! Return the waveform of a unit-amplitude spike at the given sample rate,
+ * with its negative peak at index WaveformSamplesBefore.
+ */
+arma::vec spikeWaveform(float sampleRate);
+
+/*! Draw the spike times of every unit.
+ * \param params Parameters of the recording.
+ * \param nchannels Number of channels in the recording.
+ * \param sampleRate Sample rate of the recording.
+ * \param nsamples Number of samples in the recording.
+ */
+GroundTruth spikeTimes(const Parameters& params, int nchannels,
+		float sampleRate, uint64_t nsamples);
+
+/*! Generate a block of a synthetic recording.
+ * \param params Parameters of the recording.
+ * \param nchannels Number of channels in the recording.
+ * \param sampleRate Sample rate of the recording.
+ * \param start First sample of the block.
+ * \param end One past the last sample of the block.
+ * \param truth The spikes to add, as returned by spikeTimes().
+ *
+ * The block is returned with shape (nsamples, nchannels), as expected by
+ * DataFile::setData().
+ */
+arma::Mat<int16_t> generateBlock(const Parameters& params, int nchannels,
+		float sampleRate, uint64_t start, uint64_t end, const GroundTruth& truth);
+
+/*! Fill a data file with a synthetic recording, returning its ground truth.
+ * \param file The file to write, which must be writable.
+ * \param params Parameters of the recording.
+ *
+ * Blocks are generated in parallel and written to the file in order by the
+ * calling thread, with a bounded number of blocks in memory at once, so
+ * that recordings much larger than memory can be created.
+ */
+GroundTruth generate(datafile::DataFile& file, const Parameters& params = Parameters());
+
+/*! Return the samples of the spikes on each channel, e.g., for writing
+ * ground-truth spike snippets to a SnipFile.
+ */
+std::vector<arma::uvec> channelSpikes(const GroundTruth& truth, int nchannels);
+
+}; // end synthetic namespace
+
+#endif
@@ -0,0 +1,103 @@
+/*! \file trace.h
+ *
+ * Optional tracing of operations on data and snippet files.
+ *
+ * When libdatafile and its clients are compiled with LIBDATAFILE_TRACING
+ * defined (e.g., `qmake CONFIG+=tracing`), operations such as opening files,
+ * reading and writing data, extending datasets, flushing and reading or
+ * writing attributes record scoped events, with the operating system's id of
+ * the calling thread (as reported by gettid() on Linux), into a buffer owned
+ * by that thread. The events can then be written out in the Chrome trace
+ * event format, and viewed in chrome://tracing, Perfetto, or alongside other
+ * traces converted from `perf script`.
+ *
+ * Event timestamps are taken from std::chrono::steady_clock, and written
+ * in microseconds since its epoch, so that callers can align their own
+ * events with the library's by recording steady_clock times as well.
+ *
+ * When LIBDATAFILE_TRACING is not defined, the tracing macros expand to
+ * nothing, and dumping a trace writes an empty list of events.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace datafile {
+
+/*! Functions for collecting and writing traces of file operations. */
+namespace trace {
+
+/*! Return true if the library was compiled with tracing support. */
+bool enabled();
+
+/*! Write all events recorded so far, from every thread, as a JSON
+ * document in the Chrome trace event format.
+ */
+void dump(std::ostream& out);
+
+/*! Write all events recorded so far to the named file. Returns
+ * false if the file could not be written.
+ */
+bool dump(const std::string& filename);
+
+/*! Discard all events recorded so far. */
+void clear();
+
+#ifdef LIBDATAFILE_TRACING
+
+/*! Return the current time in nanoseconds, from std::chrono::steady_clock. */
+uint64_t now();
+
+/*! Record a complete event in the calling thread's buffer.
+ * \param name Name of the event. Must be a string literal or otherwise outlive the trace.
+ * \param category Category of the event, with the same lifetime requirement.
+ * \param start Start time of the event, as returned by now().
+ * \param duration Duration of the event in nanoseconds.
+ */
+void record(const char* name, const char* category, uint64_t start, uint64_t duration);
+
+/*! Records an event spanning the lifetime of the object. */
+class Scope {
+	public:
+		Scope(const char* name, const char* category)
+			: m_name(name),
+			  m_category(category),
+			  m_start(now())
+		{
+		}
+		Scope(const Scope&) = delete;
+
+		~Scope()
+		{
+			record(m_name, m_category, m_start, now() - m_start);
+		}
+
+	private:
+		const char* m_name;
+		const char* m_category;
+		uint64_t m_start;
+};
+
+#endif
+
+}; // end trace namespace
+}; // end datafile namespace
+
+#ifdef LIBDATAFILE_TRACING
+#define DATAFILE_TRACE_CONCAT_(a, b) a ## b
+#define DATAFILE_TRACE_CONCAT(a, b) DATAFILE_TRACE_CONCAT_(a, b)
+
+/*! Record an event with the given name and category spanning the enclosing scope. */
+#define DATAFILE_TRACE_SCOPE(name, category) \
+	datafile::trace::Scope DATAFILE_TRACE_CONCAT(traceScope_, __LINE__)(name, category)
+#else
+#define DATAFILE_TRACE_SCOPE(name, category)
+#endif
+
+#endif
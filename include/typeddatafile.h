@@ -0,0 +1,170 @@
+/*! \file typeddatafile.h
+ *
+ * A DataFile whose sample type is fixed at compile time.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _TYPEDDATAFILE_H_
+#define _TYPEDDATAFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "datafile.h"
+
+namespace datafile {
+
+/*! Traits describing how each supported sample type is stored on disk.
+ * Add a specialization to support another sample type.
+ */
+template<class T> struct SampleTraits;
+
+template<> struct SampleTraits<int16_t> {
+	static H5::DataType fileType() { return H5::PredType::STD_I16LE; }
+	static const char* name() { return "int16"; }
+};
+
+template<> struct SampleTraits<uint8_t> {
+	static H5::DataType fileType() { return H5::PredType::STD_U8LE; }
+	static const char* name() { return "uint8"; }
+};
+
+/*! Scale n raw samples by the gain into voltages. This is a simple loop
+ * over contiguous memory of a fixed type, which the compiler vectorizes.
+ */
+template<class T>
+void convertSamples(const T* __restrict src, double* __restrict dst,
+		size_t n, double gain)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = gain * static_cast<double>(src[i]);
+}
+
+/*! The TypedDataFile class is a DataFile whose on-disk sample type is
+ * fixed at compile time by the template parameter.
+ *
+ * New files are created with samples stored as T, and existing files are
+ * verified to store samples as T when opened. Raw reads are then performed
+ * with identical memory and file types, so that the HDF5 library copies
+ * data without looking up a type conversion path, and conversion into
+ * voltages is done by a loop specialized for T rather than by the library.
+ */
+template<class T>
+class TypedDataFile : public DataFile {
+	public:
+		/*! The type of each sample */
+		using sample_type = T;
+
+		/*! Matrix of raw samples, with shape (nsamples, nchannels) */
+		using raw_samples = arma::Mat<T>;
+
+		/*! Construct a typed data file.
+		 * The file is created if it does not exist, otherwise it is opened read-only.
+		 * \param filename The name of the file to create or open.
+		 * \param array The type of array the written data will come from.
+		 * \param nchannels The number of channels to be written to the dataset.
+		 * \param layout The layout of samples on disk, if the file is created.
+		 *
+		 * Exceptions:
+		 * Throws a std::invalid_argument if an existing file does not store
+		 * its samples as the type T.
+		 */
+		TypedDataFile(const std::string& filename,
+				const std::string& array = DefaultArray,
+				const hsize_t nchannels = NumChannels,
+				Layout layout = ChannelMajor)
+			: DataFile(filename, array, nchannels, SampleTraits<T>::fileType(), layout)
+		{
+			if (!(m_datatype == SampleTraits<T>::fileType())) {
+				throw std::invalid_argument("The file " + filename +
+						" does not store samples as " + SampleTraits<T>::name());
+			}
+		}
+
+		/*! Read raw samples from a contiguous set of channels.
+		 * \param startChan The first channel to read.
+		 * \param endChan One past the last channel to read.
+		 * \param startSample The first sample to read.
+		 * \param endSample One past the last sample to read.
+		 * \param mat The matrix to fill, with shape (nsamples, nchannels).
+		 *
+		 * Exceptions:
+		 * This will throw a std::logic_error if either the requested channels
+		 * or samples are outside of the range for the file.
+		 */
+		void raw(int startChan, int endChan, sample_index startSample,
+				sample_index endSample, raw_samples& mat) const
+		{
+			verifyReadRequest(startChan, endChan, startSample, endSample);
+			mat.set_size(endSample - startSample, endChan - startChan);
+			readSamples(startChan, endChan, startSample, endSample,
+					mat.memptr(), m_datatype);
+		}
+
+		/*! Read raw samples from all channels. */
+		raw_samples raw(sample_index startSample, sample_index endSample) const
+		{
+			raw_samples mat;
+			raw(0, nchannels(), startSample, endSample, mat);
+			return mat;
+		}
+
+		/*! Read data from a contiguous set of channels in true voltage units.
+		 * \param startChan The first channel to read.
+		 * \param endChan One past the last channel to read.
+		 * \param startSample The first sample to read.
+		 * \param endSample One past the last sample to read.
+		 * \param out The matrix to fill, with shape (nsamples, nchannels).
+		 */
+		void volts(int startChan, int endChan, sample_index startSample,
+				sample_index endSample, arma::mat& out) const
+		{
+			raw_samples tmp;
+			raw(startChan, endChan, startSample, endSample, tmp);
+			out.set_size(tmp.n_rows, tmp.n_cols);
+			DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+			IoTimer timer(m_stats, IoConvert, out.n_elem * sizeof(double));
+			convertSamples(tmp.memptr(), out.memptr(), tmp.n_elem, gain());
+		}
+
+		/*! Read data from all channels in true voltage units, with
+		 * shape (nsamples, nchannels).
+		 */
+		samples volts(sample_index startSample, sample_index endSample) const
+		{
+			samples out;
+			volts(0, nchannels(), startSample, endSample, out);
+			return out;
+		}
+
+		/*! Read data from a single channel in true voltage units. */
+		arma::vec volts(int channel, sample_index startSample,
+				sample_index endSample) const
+		{
+			arma::vec out;
+			volts(channel, channel + 1, startSample, endSample, out);
+			return out;
+		}
+
+		/*! Write raw samples to the file. Because the matrix holds samples
+		 * of the file's own type, no conversion is performed.
+		 * See DataFile::setData() for details.
+		 */
+		void setRaw(sample_index startSample, sample_index endSample,
+				const raw_samples& mat, bool flush = false)
+		{
+			setData(startSample, endSample, mat, flush);
+		}
+};
+
+/*! Data file storing signed 16-bit samples, as recorded from MCS arrays */
+using Int16DataFile = TypedDataFile<int16_t>;
+
+/*! Data file storing unsigned 8-bit samples, as recorded from HiDens arrays */
+using UInt8DataFile = TypedDataFile<uint8_t>;
+
+}; // end datafile namespace
+
+#endif
@@ -4,12 +4,12 @@
 
 TEMPLATE = lib
 TARGET = datafile
-VERSION = 0.6.1
+VERSION = 0.7.0
 
 DESTDIR = lib
 OBJECTS_DIR = build
 QT -= gui
-CONFIG += c++11 debug_and_release shared
+CONFIG += c++11 debug_and_release shared thread
 QMAKE_CXXFLAGS += -std=c++11
 
 INCLUDEPATH += . include \
@@ -30,12 +30,40 @@ linux {
 }
 LIBS += -lhdf5_cpp -lhdf5 -larmadillo
 
+# Build with `qmake CONFIG+=tracing` to record traces of file operations.
+# Clients should define LIBDATAFILE_TRACING as well, so that the
+# operations implemented in the headers are also traced.
+tracing {
+	DEFINES += LIBDATAFILE_TRACING
+}
+
 # Input
 HEADERS += include/datafile.h \
 			include/hidensfile.h \
 			include/snipfile.h \
-			include/hidenssnipfile.h
+			include/hidenssnipfile.h \
+			include/iostats.h \
+			include/latencyhistogram.h \
+			include/trace.h \
+			include/synthetic.h \
+			include/typeddatafile.h \
+			include/bufferpool.h \
+			include/alignment.h \
+			include/clustering.h \
+			include/spiketrains.h \
+			include/detection.h
 SOURCES += src/datafile.cc \
 			src/hidensfile.cc \
 			src/snipfile.cc \
-			src/hidenssnipfile.cc
+			src/hidenssnipfile.cc \
+			src/iostats.cc \
+			src/latencyhistogram.cc \
+			src/trace.cc \
+			src/synthetic.cc \
+			src/bufferpool.cc \
+			src/alignment.cc \
+			src/clustering.cc \
+			src/spiketrains.cc \
+			src/detection.cc \
+			src/derived.cc \
+			src/quality.cc
@@ -0,0 +1,117 @@
+/* alignment.cc
+ *
+ * Implementation of sub-sample alignment of spike snippets.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "alignment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace alignment {
+
+namespace {
+
+double sinc(double x)
+{
+	if (x == 0.)
+		return 1.;
+	const double px = M_PI * x;
+	return std::sin(px) / px;
+}
+
+} // end anonymous namespace
+
+double kernel(Kernel k, double x)
+{
+	const double ax = std::abs(x);
+	switch (k) {
+		case WindowedSinc:
+			return (ax < SincHalfWidth) ? sinc(x) * sinc(x / SincHalfWidth) : 0.;
+		case Cubic:
+			if (ax < 1.)
+				return 1.5 * ax * ax * ax - 2.5 * ax * ax + 1.;
+			if (ax < 2.)
+				return -0.5 * ax * ax * ax + 2.5 * ax * ax - 4. * ax + 2.;
+			return 0.;
+	}
+	return 0.;
+}
+
+arma::mat interpolationMatrix(size_t snipSize, Kernel k, int factor)
+{
+	const arma::uword npoints = (snipSize - 1) * factor + 1;
+	arma::mat interp(npoints, snipSize);
+	for (arma::uword i = 0; i < npoints; i++) {
+		const double t = static_cast<double>(i) / factor;
+		double sum = 0.;
+		for (arma::uword j = 0; j < snipSize; j++) {
+			interp(i, j) = kernel(k, t - j);
+			sum += interp(i, j);
+		}
+		for (arma::uword j = 0; j < snipSize; j++)
+			interp(i, j) /= sum;
+	}
+	return interp;
+}
+
+arma::mat upsample(const arma::mat& interp, const arma::Mat<short>& snips)
+{
+	return interp * arma::conv_to<arma::mat>::from(snips);
+}
+
+arma::vec peakOffsets(const arma::mat& upsampled, const Options& options, int peak)
+{
+	const int factor = options.factor;
+	const arma::sword last = static_cast<arma::sword>(upsampled.n_rows) - 1;
+	const arma::sword first = std::max<arma::sword>(0, (peak - options.searchRadius) * factor);
+	const arma::sword end = std::min<arma::sword>(last, (peak + options.searchRadius) * factor);
+	const double sign = options.negative ? -1. : 1.;
+
+	arma::vec offsets(upsampled.n_cols);
+	for (arma::uword n = 0; n < upsampled.n_cols; n++) {
+		const double* y = upsampled.colptr(n);
+		arma::sword best = first;
+		for (arma::sword i = first + 1; i <= end; i++) {
+			if (sign * y[i] > sign * y[best])
+				best = i;
+		}
+
+		/* Refine the extremum with a parabola through its neighbors */
+		double delta = 0.;
+		if ( (best > 0) && (best < last) ) {
+			const double denom = y[best - 1] - 2. * y[best] + y[best + 1];
+			if (denom != 0.)
+				delta = 0.5 * (y[best - 1] - y[best + 1]) / denom;
+		}
+		offsets(n) = (best + delta) / factor - peak;
+	}
+	return offsets;
+}
+
+arma::Mat<short> alignSnippets(const arma::mat& upsampled, const arma::vec& offsets,
+		int factor, size_t snipSize)
+{
+	const arma::sword last = static_cast<arma::sword>(upsampled.n_rows) - 1;
+	arma::Mat<short> aligned(snipSize, upsampled.n_cols);
+	for (arma::uword n = 0; n < upsampled.n_cols; n++) {
+		const double* y = upsampled.colptr(n);
+		const arma::sword shift = static_cast<arma::sword>(std::lround(offsets(n) * factor));
+		for (arma::uword s = 0; s < snipSize; s++) {
+			arma::sword i = static_cast<arma::sword>(s) * factor + shift;
+			i = std::min(std::max<arma::sword>(i, 0), last);
+			/* Ringing of the kernel near a full-scale sample can overshoot
+			 * the range of the raw data, so clamp rather than wrap.
+			 */
+			const double value = std::min<double>(std::max<double>(std::round(y[i]),
+					std::numeric_limits<short>::min()), std::numeric_limits<short>::max());
+			aligned(s, n) = static_cast<short>(value);
+		}
+	}
+	return aligned;
+}
+
+} // end alignment namespace
@@ -0,0 +1,175 @@
+/* bufferpool.cc
+ *
+ * Implementation of the pool of reusable, aligned buffers.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "bufferpool.h"
+
+#include <cstdlib>
+#include <limits>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace datafile {
+
+BufferPool::BufferPool(size_t maxCachedBytes)
+	: m_maxCachedBytes(maxCachedBytes),
+	  m_cachedBytes(0),
+	  m_allocations(0),
+	  m_reuses(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+	clear();
+}
+
+int BufferPool::sizeClass(size_t bytes, size_t& capacity)
+{
+	int cls = 0;
+	capacity = MinBufferSize;
+	while (capacity < bytes) {
+		/* No power of two above the request fits in a size_t */
+		if (capacity > std::numeric_limits<size_t>::max() / 2)
+			throw std::bad_alloc();
+		capacity <<= 1;
+		cls++;
+	}
+	return cls;
+}
+
+void* BufferPool::allocate(size_t capacity)
+{
+	size_t alignment = (capacity >= HugePageSize) ? HugePageSize : BufferAlignment;
+	void* buffer = nullptr;
+	if (posix_memalign(&buffer, alignment, capacity) != 0)
+		throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+	if (capacity >= HugePageSize)
+		madvise(buffer, capacity, MADV_HUGEPAGE);
+#endif
+	return buffer;
+}
+
+void* BufferPool::acquire(size_t bytes, size_t& capacity)
+{
+	int cls = sizeClass(bytes, capacity);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& free = m_free[cls];
+		if (!free.empty()) {
+			void* buffer = free.back();
+			free.pop_back();
+			m_cachedBytes -= capacity;
+			m_reuses++;
+			return buffer;
+		}
+		m_allocations++;
+	}
+	return allocate(capacity);
+}
+
+void BufferPool::release(void* buffer, size_t capacity)
+{
+	if (!buffer)
+		return;
+	size_t cap = 0;
+	int cls = sizeClass(capacity, cap);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if ( (m_maxCachedBytes == 0) || (m_cachedBytes + cap <= m_maxCachedBytes) ) {
+			m_free[cls].push_back(buffer);
+			m_cachedBytes += cap;
+			return;
+		}
+	}
+	std::free(buffer);
+}
+
+void BufferPool::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& free : m_free) {
+		for (auto buffer : free)
+			std::free(buffer);
+		free.clear();
+	}
+	m_cachedBytes = 0;
+}
+
+uint64_t BufferPool::allocations() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_allocations;
+}
+
+uint64_t BufferPool::reuses() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_reuses;
+}
+
+size_t BufferPool::cachedBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_cachedBytes;
+}
+
+PooledBuffer::PooledBuffer()
+	: m_pool(nullptr),
+	  m_data(nullptr),
+	  m_capacity(0)
+{
+}
+
+PooledBuffer::PooledBuffer(BufferPool& pool, size_t bytes)
+	: m_pool(&pool),
+	  m_data(nullptr),
+	  m_capacity(0)
+{
+	m_data = pool.acquire(bytes, m_capacity);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other)
+	: m_pool(other.m_pool),
+	  m_data(other.m_data),
+	  m_capacity(other.m_capacity)
+{
+	other.m_pool = nullptr;
+	other.m_data = nullptr;
+	other.m_capacity = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other)
+{
+	if (this != &other) {
+		reset();
+		m_pool = other.m_pool;
+		m_data = other.m_data;
+		m_capacity = other.m_capacity;
+		other.m_pool = nullptr;
+		other.m_data = nullptr;
+		other.m_capacity = 0;
+	}
+	return *this;
+}
+
+PooledBuffer::~PooledBuffer()
+{
+	reset();
+}
+
+void PooledBuffer::reset()
+{
+	if (m_pool)
+		m_pool->release(m_data, m_capacity);
+	m_pool = nullptr;
+	m_data = nullptr;
+	m_capacity = 0;
+}
+
+} // end datafile namespace
@@ -0,0 +1,144 @@
+/* clustering.cc
+ *
+ * Implementation of mini-batch k-means clustering.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "clustering.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace clustering {
+
+MiniBatchKMeans::MiniBatchKMeans(const Options& options)
+	: m_options(options),
+	  m_rng(options.seed)
+{
+}
+
+void MiniBatchKMeans::initialize(const arma::mat& batch)
+{
+	const arma::uword k = m_options.nclusters;
+	if ( (k == 0) || (batch.n_cols < k) ) {
+		throw std::logic_error("Cannot choose " + std::to_string(k) +
+				" initial centers from " + std::to_string(batch.n_cols) + " points");
+	}
+
+	/* Each center after the first is chosen with probability proportional
+	 * to the squared distance from the nearest center already chosen.
+	 */
+	m_centers.set_size(batch.n_rows, k);
+	m_counts.zeros(k);
+	std::uniform_int_distribution<arma::uword> first(0, batch.n_cols - 1);
+	m_centers.col(0) = batch.col(first(m_rng));
+	std::vector<double> nearest(batch.n_cols, std::numeric_limits<double>::max());
+	for (arma::uword j = 1; j < k; j++) {
+		const double* c = m_centers.colptr(j - 1);
+		for (arma::uword i = 0; i < batch.n_cols; i++) {
+			const double* x = batch.colptr(i);
+			double d = 0.;
+			for (arma::uword r = 0; r < batch.n_rows; r++)
+				d += (x[r] - c[r]) * (x[r] - c[r]);
+			nearest[i] = std::min(nearest[i], d);
+		}
+		arma::uword next;
+		if (std::any_of(nearest.begin(), nearest.end(), [](double d) { return d > 0.; })) {
+			std::discrete_distribution<arma::uword> choose(nearest.begin(), nearest.end());
+			next = choose(m_rng);
+		} else {
+			next = first(m_rng);	// All points coincide with a center
+		}
+		m_centers.col(j) = batch.col(next);
+	}
+}
+
+void MiniBatchKMeans::update(const arma::mat& batch)
+{
+	if (!initialized())
+		initialize(batch);
+	auto labels = assign(batch);
+
+	/* Each center moves toward its points with a step size of one over
+	 * the number of points it has absorbed, so that it tracks their mean.
+	 */
+	for (arma::uword i = 0; i < batch.n_cols; i++) {
+		const arma::uword j = labels(i);
+		m_counts(j) += 1.;
+		const double eta = 1. / m_counts(j);
+		double* c = m_centers.colptr(j);
+		const double* x = batch.colptr(i);
+		for (arma::uword r = 0; r < batch.n_rows; r++)
+			c[r] += eta * (x[r] - c[r]);
+	}
+}
+
+arma::uvec MiniBatchKMeans::assign(const arma::mat& batch, arma::vec* distances) const
+{
+	if (!initialized())
+		throw std::logic_error("Cluster centers have not been initialized");
+	if (batch.n_rows != m_centers.n_rows) {
+		throw std::logic_error("Points have " + std::to_string(batch.n_rows) +
+				" dimensions, but centers have " + std::to_string(m_centers.n_rows));
+	}
+	const arma::uword k = m_centers.n_cols;
+	arma::vec centerNorms(k);
+	for (arma::uword j = 0; j < k; j++) {
+		const double* c = m_centers.colptr(j);
+		double n = 0.;
+		for (arma::uword r = 0; r < m_centers.n_rows; r++)
+			n += c[r] * c[r];
+		centerNorms(j) = n;
+	}
+
+	arma::uvec labels(batch.n_cols);
+	if (distances)
+		distances->set_size(batch.n_cols);
+	if (batch.n_cols == 0)
+		return labels;
+
+	/* Threads assign contiguous ranges of points */
+	unsigned int nthreads = m_options.nthreads ? m_options.nthreads :
+		std::max(std::thread::hardware_concurrency(), 1u);
+	nthreads = static_cast<unsigned int>(std::min<arma::uword>(nthreads, batch.n_cols));
+	const arma::uword perThread = (batch.n_cols + nthreads - 1) / nthreads;
+	auto worker = [&](arma::uword start, arma::uword end) {
+		arma::mat products = m_centers.t() * batch.cols(start, end - 1);
+		for (arma::uword i = start; i < end; i++) {
+			const double* x = batch.colptr(i);
+			const double* p = products.colptr(i - start);
+			double norm = 0.;
+			for (arma::uword r = 0; r < batch.n_rows; r++)
+				norm += x[r] * x[r];
+			arma::uword best = 0;
+			double bestDistance = std::numeric_limits<double>::max();
+			for (arma::uword j = 0; j < k; j++) {
+				const double d = centerNorms(j) - 2. * p[j];
+				if (d < bestDistance) {
+					bestDistance = d;
+					best = j;
+				}
+			}
+			labels(i) = best;
+			if (distances)
+				(*distances)(i) = std::max(bestDistance + norm, 0.);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < nthreads; t++) {
+		const arma::uword start = t * perThread;
+		if (start < batch.n_cols)
+			threads.emplace_back(worker, start, std::min(start + perThread, batch.n_cols));
+	}
+	worker(0, std::min(perThread, batch.n_cols));
+	for (auto& t : threads)
+		t.join();
+	return labels;
+}
+
+} // end clustering namespace
+
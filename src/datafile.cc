@@ -13,14 +13,24 @@ namespace datafile {
 
 DataFile::DataFile(const std::string& filename, 
 		const std::string& array,
-		const hsize_t nchannels)
+		const hsize_t nchannels,
+		const H5::DataType& dtype,
+		Layout layout)
 		: m_filename(filename),
 		  m_array(array),
 		  m_date("unknown"),
 		  m_room("unknown"),
 		  m_nsamples(0),
-		  m_aoutSize(0)
+		  m_aoutSize(0),
+		  m_layout(layout),
+		  m_writeCombining(true),
+		  m_stageElemSize(0),
+		  m_stageStart(0),
+		  m_stageCount(0),
+		  m_pool(PoolCachedBytes)
 {
+	DATAFILE_TRACE_SCOPE("DataFile::open", "datafile");
+
 	/* Turn off automatic printing of errors */
 	H5::Exception::dontPrint();
 
@@ -47,10 +57,18 @@ DataFile::DataFile(const std::string& filename,
 		}
 		m_dataspace = m_dataset.getSpace();
 		m_datatype = m_dataset.getDataType();
+		readLayout();
 
 		hsize_t dims[DatasetRank] = {0, 0};
 		m_dataspace.getSimpleExtentDims(dims);
-		m_nchannels = dims[0];
+		m_nchannels = dims[channelDim()];
+		m_props = m_dataset.getCreatePlist();
+		if (m_props.getLayout() == H5D_CHUNKED) {
+			m_props.getChunk(DatasetRank, m_chunkDims);
+		} else {
+			m_chunkDims[0] = dims[0];
+			m_chunkDims[1] = dims[1];
+		}
 
 		/* Read attributes into data members. These will throw a
 		 * std::invalid_argument if the attribute could not accessed
@@ -80,35 +98,48 @@ DataFile::DataFile(const std::string& filename,
 		double rdcc_w0 = 0.0;
 		m_fileProps.getCache(mdc_nelmts, rdcc_nelmts, rdcc_nbytes, rdcc_w0);
 		m_fileProps.setCache(mdc_nelmts, chunkCacheSizeElems, 
-				chunkCacheSizeElems * sizeof(int16_t), rdcc_w0);
+				chunkCacheSizeElems * dtype.getSize(), rdcc_w0);
 		m_file = H5::H5File(m_filename, H5F_ACC_TRUNC, 
 				H5::FileCreatPropList::DEFAULT, m_fileProps);
 
-		/* Create the dataset */
+		/* Create the dataset, with dimensions in the order of its layout */
 		m_nchannels = nchannels;
 		hsize_t dims[DatasetRank] = {nchannels, DatasetDefaultDims[1]};
-		m_dataspace = H5::DataSpace(DatasetRank, dims, DatasetMaxDims);
+		hsize_t maxDims[DatasetRank] = {DatasetMaxDims[0], DatasetMaxDims[1]};
+		m_chunkDims[0] = DatasetChunkDims[0];
+		m_chunkDims[1] = DatasetChunkDims[1];
+		toFileOrder(dims);
+		toFileOrder(maxDims);
+		toFileOrder(m_chunkDims);
+		m_dataspace = H5::DataSpace(DatasetRank, dims, maxDims);
 		m_props = H5::DSetCreatPropList();
-		m_props.setChunk(DatasetRank, DatasetChunkDims);
-		m_datatype = H5::DataType(H5::PredType::STD_I16LE);
+		m_props.setChunk(DatasetRank, m_chunkDims);
+		m_datatype = H5::DataType(dtype);
 		m_dataset = m_file.createDataSet("data", m_datatype, m_dataspace, m_props);
 
 		/* Set default parameters */
 		setSampleRate(SampleRate);
 		setRoom(DefaultRoomString);
 		setArray(m_array);
+		writeDataStringAttr("layout",
+				(m_layout == SampleMajor) ? "sample-major" : "channel-major");
 	}
 }
 
 DataFile::~DataFile() 
 {
+	DATAFILE_TRACE_SCOPE("DataFile::close", "datafile");
 	try {
 		if (!readOnly()) {
 			flush();
 		}
 		m_file.close();
-	} catch (H5::FileIException &e) {
+	} catch (H5::Exception &e) {
 		std::cerr << "Error closing HDF5 file: " << m_filename << std::endl;
+	} catch (std::exception &e) {
+		/* Writing staged samples may fail, but destructors must not throw */
+		std::cerr << "Error closing HDF5 file: " << m_filename
+				<< ": " << e.what() << std::endl;
 	}
 }
 
@@ -121,9 +152,9 @@ double DataFile::length() const
 	return ((double) nsamples() / sampleRate());
 }
 
-int DataFile::nsamples() const
+sample_index DataFile::nsamples() const
 {
-	return static_cast<int>(m_nsamples);
+	return static_cast<sample_index>(m_nsamples);
 }
 
 int DataFile::nchannels() const
@@ -131,6 +162,8 @@ int DataFile::nchannels() const
 	return static_cast<int>(m_nchannels);
 }
 
+Layout DataFile::layout() const { return m_layout; }
+
 float DataFile::sampleRate(void) const { return m_sampleRate; }
 
 float DataFile::gain(void) const { return m_gain; }
@@ -141,22 +174,28 @@ std::string DataFile::date(void) const { return m_date; }
 
 std::string DataFile::room(void) const { return m_room; }
 
-samples DataFile::data(int startSample, int endSample) const
+samples DataFile::data(sample_index startSample, sample_index endSample) const
 {
 	samples s;
 	data(0, nchannels(), startSample, endSample, s);
-	return s * gain();
+	DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+	IoTimer timer(m_stats, IoConvert, s.n_elem * sizeof(double));
+	s *= gain();
+	return s;
 }
 
-arma::vec DataFile::data(int channel, int startSample, int endSample) const
+arma::vec DataFile::data(int channel, sample_index startSample, sample_index endSample) const
 {
 	arma::vec s;
 	data(channel, channel + 1, startSample, endSample, s);
-	return s * gain();
+	DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+	IoTimer timer(m_stats, IoConvert, s.n_elem * sizeof(double));
+	s *= gain();
+	return s;
 }
 
 void DataFile::verifyReadRequest(int startChannel, int endChannel, 
-		int startSample, int endSample) const
+		sample_index startSample, sample_index endSample) const
 {
 	if ( (startSample < 0) || (startSample > nsamples()) ) {
 		throw std::logic_error("Requested start sample out of range: " + 
@@ -168,7 +207,7 @@ void DataFile::verifyReadRequest(int startChannel, int endChannel,
 				std::to_string(endSample) + " is not in range [0, " +
 				std::to_string(nsamples()) + "]");
 	}
-	int requestedSamples = endSample - startSample;
+	sample_index requestedSamples = endSample - startSample;
 	if (requestedSamples <= 0) {
 		throw std::logic_error("Requested sample range invalid: (" + 
 				std::to_string(startSample) + " - " + 
@@ -194,9 +233,9 @@ void DataFile::verifyReadRequest(int startChannel, int endChannel,
 }
 
 H5::DataSpace DataFile::setupRead(int startChannel, int endChannel, 
-		int startSample, int endSample) const
+		sample_index startSample, sample_index endSample) const
 {
-	int requestedSamples = endSample - startSample;
+	sample_index requestedSamples = endSample - startSample;
 	int requestedChannels = endChannel - startChannel;
 
 	/* Compute the source file data space */
@@ -208,7 +247,11 @@ H5::DataSpace DataFile::setupRead(int startChannel, int endChannel,
 			static_cast<hsize_t>(requestedChannels),
 			static_cast<hsize_t>(requestedSamples)
 		};
+	toFileOrder(fileOffset);
+	toFileOrder(fileCount);
 	m_dataspace.selectHyperslab(H5S_SELECT_SET, fileCount, fileOffset);
+	m_stats.addChunks(chunksInSelection(startChannel, endChannel,
+			startSample, endSample));
 	if (!m_dataspace.selectValid()) {
 		std::stringstream what;
 		what << "Dataset selection invalid:" << std::endl
@@ -228,6 +271,8 @@ H5::DataSpace DataFile::setupRead(int startChannel, int endChannel,
 			static_cast<hsize_t>(requestedChannels),
 			static_cast<hsize_t>(requestedSamples)
 		};
+	toFileOrder(dims);
+	toFileOrder(memCount);
 	H5::DataSpace memspace{DatasetRank, dims};
 	memspace.selectHyperslab(H5S_SELECT_SET, memCount, memOffset);
 	if (!memspace.selectValid()) {
@@ -244,6 +289,8 @@ void DataFile::writeDataAttr(const std::string& name, const H5::DataType &type,
 {
 	if (readOnly())
 		return;
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
 	try {
 		H5::DataType writeType(type);
 		if (!(m_dataset.attrExists(name))) {
@@ -262,6 +309,8 @@ void DataFile::writeDataStringAttr(const std::string& name, const std::string& v
 {
 	if ( (readOnly()) || (value.length() == 0) )
 		return;
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
 	try {
 		H5::StrType stringType(0, value.length());
 		if (!(m_dataset.attrExists(name))) {
@@ -323,21 +372,21 @@ void DataFile::setArray(std::string array)
 	m_array = array;
 }
 
-void DataFile::setAnalogOutputSize(int size)
+void DataFile::setAnalogOutputSize(sample_index size)
 {
 	writeDataAttr("analog-output-size", H5::PredType::STD_U64LE, &m_aoutSize);
 	m_aoutSize = static_cast<decltype(m_aoutSize)>(size);
 }
 
-void DataFile::setNumSamples(int nsamples)
+void DataFile::setNumSamples(sample_index nsamples)
 {
 	m_nsamples = static_cast<decltype(m_nsamples)>(nsamples);
 	writeDataAttr("nsamples", H5::PredType::STD_U64LE, &m_nsamples);
 }
 
-int DataFile::analogOutputSize() const
+sample_index DataFile::analogOutputSize() const
 {
-	return static_cast<int>(m_aoutSize);
+	return static_cast<sample_index>(m_aoutSize);
 }
 
 arma::vec DataFile::analogOutput() const
@@ -351,6 +400,8 @@ arma::vec DataFile::analogOutput() const
 
 void DataFile::readFileAttr(const std::string& name, void *buf) 
 {
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
 	try {
 		H5::Attribute attr = m_file.openAttribute(name);
 		attr.read(attr.getDataType(), buf);
@@ -362,6 +413,8 @@ void DataFile::readFileAttr(const std::string& name, void *buf)
 
 void DataFile::readDataAttr(const std::string& name, void *buf) 
 {
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
 	try {
 		H5::Attribute attr = m_dataset.openAttribute(name);
 		attr.read(attr.getDataType(), buf);
@@ -451,6 +504,18 @@ void DataFile::readAnalogOutputSize(void)
 	}
 }
 
+void DataFile::readLayout(void)
+{
+	/* Files written by older versions of the library are all channel-major */
+	m_layout = ChannelMajor;
+	if (m_dataset.attrExists("layout")) {
+		std::string layout;
+		readDataStringAttr("layout", layout);
+		if (layout.compare(0, 12, "sample-major") == 0)
+			m_layout = SampleMajor;
+	}
+}
+
 void DataFile::readDate(void) 
 {
 	readDataStringAttr("date", m_date);
@@ -468,9 +533,55 @@ void DataFile::readArray()
 
 void DataFile::flush(void) 
 {
+	LatencyTimer latency(m_latency.get(), LatencyFlush);
+	flushStaged();
+	DATAFILE_TRACE_SCOPE("DataFile::flush", "datafile");
+	IoTimer timer(m_stats, IoFlush);
 	m_file.flush(H5F_SCOPE_GLOBAL);
 }
 
+void DataFile::flushStaged() const
+{
+	if (m_stageCount == 0)
+		return;
+
+	/* The staged samples of channel-major files are spread across the
+	 * buffer, one chunk's worth per channel, and must be made contiguous
+	 * if only part of a chunk was staged. Sample-major files stage
+	 * contiguous samples.
+	 */
+	const size_t nchan = nchannels();
+	const size_t rowBytes = m_stageCount * m_stageElemSize;
+	const char* data = m_stage.data();
+	PooledBuffer compact;
+	if ( (m_layout == ChannelMajor) && (m_stageCount < stageCapacity()) ) {
+		const size_t capacityBytes = stageCapacity() * m_stageElemSize;
+		compact = PooledBuffer(m_pool, nchan * rowBytes);
+		char* dst = static_cast<char*>(compact.data());
+		for (size_t c = 0; c < nchan; c++) {
+			std::copy(m_stage.data() + c * capacityBytes,
+					m_stage.data() + c * capacityBytes + rowBytes,
+					dst + c * rowBytes);
+		}
+		data = dst;
+	}
+
+	auto memspace = setupWrite(m_stageStart, m_stageStart + m_stageCount);
+	DATAFILE_TRACE_SCOPE("DataFile::write", "datafile");
+	IoTimer timer(m_stats, IoWrite, nchan * rowBytes);
+	m_dataset.write(data, m_stageType, memspace, m_dataspace);
+	m_stageCount = 0;
+}
+
+void DataFile::setWriteCombining(bool enabled)
+{
+	if (!enabled)
+		flushStaged();
+	m_writeCombining = enabled;
+}
+
+bool DataFile::writeCombining() const { return m_writeCombining; }
+
 std::string array(const std::string& fname)
 {
 	std::string a;
@@ -489,14 +600,14 @@ std::string array(const std::string& fname)
 	return a;
 }
 
-void DataFile::verifyWriteRequest(int startSample, int endSample)
+void DataFile::verifyWriteRequest(sample_index startSample, sample_index endSample)
 {
 	if (readOnly()) {
 		throw std::logic_error("Cannot write to DataFile marked read-only.");
 	}
 
 	/* Validate requested samples */
-	int requestedSamples = endSample - startSample;
+	sample_index requestedSamples = endSample - startSample;
 	if (requestedSamples <= 0) {
 		throw std::logic_error("Requested sample range invalid: (" + 
 				std::to_string(startSample) + "-" + 
@@ -505,13 +616,15 @@ void DataFile::verifyWriteRequest(int startSample, int endSample)
 
 	/* Extend dataset if needed */
 	if (endSample > datasetSize()) {
+		LatencyTimer latency(m_latency.get(), LatencyExtend);
+		DATAFILE_TRACE_SCOPE("DataFile::extend", "datafile");
+		IoTimer timer(m_stats, IoExtend);
 		hsize_t dims[DatasetRank] = {0, 0};
 		m_dataspace = m_dataset.getSpace();
 		m_dataspace.getSimpleExtentDims(dims);
-		auto nblocks = static_cast<int>(std::ceil(
-				static_cast<float>(endSample - datasetSize()) /
-				static_cast<float>(BlockSize)));
-		dims[1] += nblocks * BlockSize;
+		auto nblocks = static_cast<hsize_t>(
+				(endSample - datasetSize() + BlockSize - 1) / BlockSize);
+		dims[sampleDim()] += nblocks * BlockSize;
 		m_dataset.extend(dims);
 		m_dataspace = m_dataset.getSpace();
 	}
@@ -519,16 +632,19 @@ void DataFile::verifyWriteRequest(int startSample, int endSample)
 	setNumSamples(m_nsamples);
 }
 
-H5::DataSpace DataFile::setupWrite(int startSample, int endSample)
+H5::DataSpace DataFile::setupWrite(sample_index startSample, sample_index endSample) const
 {
 	/* Compute the destination file data space */
-	int requestedSamples = endSample - startSample;
+	sample_index requestedSamples = endSample - startSample;
 		hsize_t memoffset[DatasetRank] = {0,
 			static_cast<hsize_t>(startSample)};
 	hsize_t memcount[DatasetRank] = {
 			static_cast<hsize_t>(nchannels()),
 			static_cast<hsize_t>(requestedSamples)};
+	toFileOrder(memoffset);
+	toFileOrder(memcount);
 	m_dataspace.selectHyperslab(H5S_SELECT_SET, memcount, memoffset);
+	m_stats.addChunks(chunksInSelection(0, nchannels(), startSample, endSample));
 	if (!m_dataspace.selectValid()) {
 		std::stringstream what;
 		what << "Dataset selection invalid:" << std::endl
@@ -542,11 +658,13 @@ H5::DataSpace DataFile::setupWrite(int startSample, int endSample)
 	hsize_t dims[DatasetRank] = {
 			static_cast<hsize_t>(nchannels()),
 			static_cast<hsize_t>(requestedSamples)};
+	toFileOrder(dims);
 	H5::DataSpace memspace = {DatasetRank, dims};
 	hsize_t offset[DatasetRank] = {0, 0};
 	hsize_t count[DatasetRank] = {
 			static_cast<hsize_t>(nchannels()),
 			static_cast<hsize_t>(requestedSamples)};
+	toFileOrder(count);
 	memspace.selectHyperslab(H5S_SELECT_SET, count, offset);
 	if (!memspace.selectValid()) {
 		std::stringstream what;
@@ -558,15 +676,23 @@ H5::DataSpace DataFile::setupWrite(int startSample, int endSample)
 	return memspace;
 }
 
-int DataFile::datasetSize() const {
+sample_index DataFile::datasetSize() const {
 	hsize_t dims[DatasetRank] = { 0, 0 };
 	m_dataspace.getSimpleExtentDims(dims);
-	return static_cast<int>(dims[1]);
+	return static_cast<sample_index>(dims[sampleDim()]);
+}
+
+void DataFile::toFileOrder(hsize_t dims[DatasetRank]) const
+{
+	if (m_layout == SampleMajor)
+		std::swap(dims[0], dims[1]);
 }
 
 void DataFile::setMeans(const arma::vec& means)
 {
 	const char name[] = "channel-means";
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute, means.n_elem * sizeof(double));
 	if (m_dataset.attrExists(name)) {
 		m_dataset.removeAttr(name);
 	}
@@ -580,6 +706,8 @@ void DataFile::setMeans(const arma::vec& means)
 arma::vec DataFile::means() const
 {
 	arma::vec ret;
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
 	H5::Attribute attr;
 	try {
 		attr = m_dataset.openAttribute("channel-means");
@@ -596,5 +724,52 @@ arma::vec DataFile::means() const
 	return ret;
 }
 
+uint64_t DataFile::chunksInSelection(int startChannel, int endChannel,
+		sample_index startSample, sample_index endSample) const
+{
+	auto chunks = [](hsize_t start, hsize_t end, hsize_t size) -> uint64_t {
+		return (size == 0) ? 0 : ((end - 1) / size) - (start / size) + 1;
+	};
+	return chunks(startChannel, endChannel, m_chunkDims[channelDim()]) *
+		chunks(startSample, endSample, m_chunkDims[sampleDim()]);
+}
+
+IoStats DataFile::stats() const
+{
+	auto s = m_stats.snapshot();
+	s.metadataCacheHitRate = metadataCacheHitRate(m_file.getId());
+	return s;
+}
+
+void DataFile::resetStats()
+{
+	m_stats.reset();
+	resetMetadataCacheStats(m_file.getId());
+}
+
+void DataFile::enableLatencyRecording(uint64_t deadline, DeadlineCallback callback)
+{
+	m_latency.reset(new LatencyRecorder(deadline, callback));
+}
+
+void DataFile::disableLatencyRecording()
+{
+	m_latency.reset(nullptr);
+}
+
+LatencySummary DataFile::latency(LatencyOp op) const
+{
+	if (!m_latency) {
+		return LatencySummary{ 0, 0, 0, 0, 0, 0. };
+	}
+	return m_latency->histogram(op).summary();
+}
+
+void DataFile::resetLatency()
+{
+	if (m_latency)
+		m_latency->reset();
+}
+
 } // end datafile namespace
 
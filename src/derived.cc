@@ -0,0 +1,582 @@
+/* derived.cc
+ *
+ * Implementation of datasets derived from the raw data of a DataFile,
+ * such as the local field potential, the power in the spike band, and
+ * the power spectral density.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "datafile.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace datafile {
+
+namespace {
+
+std::string derivedPath(const std::string& name)
+{
+	return "/" + DerivedGroup + "/" + name;
+}
+
+/* Write a scalar attribute of a dataset, creating it if needed */
+void writeAttr(H5::DataSet& dataset, const std::string& name,
+		const H5::DataType& fileType, const H5::DataType& memType, const void* value)
+{
+	if (!dataset.attrExists(name)) {
+		H5::DataSpace space(H5S_SCALAR);
+		dataset.createAttribute(name, fileType, space);
+	}
+	dataset.openAttribute(name).write(memType, value);
+}
+
+void writeFloatAttr(H5::DataSet& dataset, const std::string& name, float value)
+{
+	writeAttr(dataset, name, H5::PredType::IEEE_F32LE, H5::PredType::NATIVE_FLOAT, &value);
+}
+
+void writeIntAttr(H5::DataSet& dataset, const std::string& name, int64_t value)
+{
+	writeAttr(dataset, name, H5::PredType::STD_I64LE, H5::PredType::NATIVE_INT64, &value);
+}
+
+/* Return a scalar attribute of a dataset, or the given value if it has none */
+template<class T>
+T readAttr(const H5::DataSet& dataset, const std::string& name,
+		const H5::DataType& type, T missing)
+{
+	if (!dataset.attrExists(name))
+		return missing;
+	T value;
+	dataset.openAttribute(name).read(type, &value);
+	return value;
+}
+
+} // end anonymous namespace
+
+arma::vec firFilter(double low, double high, double sampleRate, size_t taps)
+{
+	if ( (low < 0.) || (high <= low) || (2. * high > sampleRate) ) {
+		throw std::logic_error("Filter band [" + std::to_string(low) + ", " +
+				std::to_string(high) + "] Hz is not valid at a sample rate of " +
+				std::to_string(sampleRate) + " Hz");
+	}
+	if (taps == 0)
+		throw std::logic_error("Filter must have at least one tap");
+
+	/* The ideal band-pass filter is the difference of two low-pass
+	 * filters, each a sinc function, tapered by a Blackman window.
+	 */
+	const double pi = std::acos(-1.);
+	const double center = (taps - 1) / 2.;
+	auto lowpass = [&](double cutoff, double t) -> double {
+		const double f = cutoff / sampleRate;
+		return (t == 0.) ? 2. * f : std::sin(2. * pi * f * t) / (pi * t);
+	};
+	arma::vec h(taps);
+	for (size_t i = 0; i < taps; i++) {
+		const double t = i - center;
+		const double window = (taps == 1) ? 1. :
+			0.42 - 0.5 * std::cos(2. * pi * i / (taps - 1)) +
+			0.08 * std::cos(4. * pi * i / (taps - 1));
+		h(i) = (lowpass(high, t) - ((low > 0.) ? lowpass(low, t) : 0.)) * window;
+	}
+
+	/* Scale to unit gain at the center of the pass band */
+	const double f = (low > 0.) ? (low + high) / (2. * sampleRate) : 0.;
+	double gain = 0.;
+	for (size_t i = 0; i < taps; i++)
+		gain += h(i) * std::cos(2. * pi * f * (i - center));
+	if (gain != 0.)
+		h /= gain;
+	return h;
+}
+
+bool DataFile::hasDerived(const std::string& name) const
+{
+	return (H5Lexists(m_file.getId(), DerivedGroup.c_str(), H5P_DEFAULT) > 0) &&
+		(H5Lexists(m_file.getId(), derivedPath(name).c_str(), H5P_DEFAULT) > 0);
+}
+
+H5::DataSet DataFile::openDerived(const std::string& name) const
+{
+	if (!hasDerived(name))
+		throw std::logic_error("The file has no derived dataset named '" + name + "'");
+	return m_file.openDataSet(derivedPath(name));
+}
+
+float DataFile::derivedSampleRate(const std::string& name) const
+{
+	auto dataset = openDerived(name);
+	float rate = 0.;
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
+	dataset.openAttribute("sample-rate").read(H5::PredType::NATIVE_FLOAT, &rate);
+	return rate;
+}
+
+sample_index DataFile::derivedSamples(const std::string& name) const
+{
+	hsize_t dims[DatasetRank] = { 0, 0 };
+	openDerived(name).getSpace().getSimpleExtentDims(dims);
+	return dims[1];
+}
+
+H5::DataSet DataFile::createDerived(const std::string& name, float sampleRate)
+{
+	/* Unlinking a dataset does not reclaim its space in the file, which
+	 * remains until the file is repacked, e.g., with h5repack.
+	 */
+	if (H5Lexists(m_file.getId(), DerivedGroup.c_str(), H5P_DEFAULT) <= 0)
+		m_file.createGroup(DerivedGroup);
+	if (hasDerived(name))
+		m_file.unlink(derivedPath(name));
+
+	const hsize_t nchan = nchannels();
+	hsize_t dims[DatasetRank] = { nchan, 0 };
+	hsize_t maxDims[DatasetRank] = { nchan, H5S_UNLIMITED };
+	hsize_t chunkDims[DatasetRank] = { nchan, DerivedChunkSize };
+	H5::DataSpace space(DatasetRank, dims, maxDims);
+	H5::DSetCreatPropList props;
+	props.setChunk(DatasetRank, chunkDims);
+	auto dataset = m_file.createDataSet(derivedPath(name),
+			H5::PredType::IEEE_F32LE, space, props);
+	writeFloatAttr(dataset, "sample-rate", sampleRate);
+	return dataset;
+}
+
+void DataFile::writeDerived(H5::DataSet& dataset, sample_index startSample,
+		const arma::fmat& data)
+{
+	if (data.is_empty())
+		return;
+	const hsize_t nchan = data.n_cols, count = data.n_rows;
+	hsize_t dims[DatasetRank] = { 0, 0 };
+	dataset.getSpace().getSimpleExtentDims(dims);
+	if (dims[1] < startSample + count) {
+		DATAFILE_TRACE_SCOPE("DataFile::extend", "datafile");
+		IoTimer timer(m_stats, IoExtend);
+		dims[1] = startSample + count;
+		dataset.extend(dims);
+	}
+	auto space = dataset.getSpace();
+	hsize_t offset[DatasetRank] = { 0, static_cast<hsize_t>(startSample) };
+	hsize_t counts[DatasetRank] = { nchan, count };
+	space.selectHyperslab(H5S_SELECT_SET, counts, offset);
+	H5::DataSpace memspace(DatasetRank, counts);
+	DATAFILE_TRACE_SCOPE("DataFile::write", "datafile");
+	IoTimer timer(m_stats, IoWrite, data.n_elem * sizeof(float));
+	dataset.write(data.memptr(), H5::PredType::NATIVE_FLOAT, memspace, space);
+}
+
+void DataFile::readDerived(const std::string& name, int startChan, int endChan,
+		sample_index startSample, sample_index endSample,
+		void* out, const H5::DataType& memType) const
+{
+	auto dataset = openDerived(name);
+	auto space = dataset.getSpace();
+	hsize_t dims[DatasetRank] = { 0, 0 };
+	space.getSimpleExtentDims(dims);
+	const sample_index nsamples = dims[1];
+	if ( (startChan < 0) || (endChan > nchannels()) || (endChan <= startChan) ) {
+		throw std::logic_error("Requested channels [" + std::to_string(startChan) +
+				", " + std::to_string(endChan) + ") are not in range [0, " +
+				std::to_string(nchannels()) + ")");
+	}
+	if ( (startSample < 0) || (endSample > nsamples) || (endSample <= startSample) ) {
+		throw std::logic_error("Requested samples [" + std::to_string(startSample) +
+				", " + std::to_string(endSample) + ") of '" + name +
+				"' are not in range [0, " + std::to_string(nsamples) + ")");
+	}
+	hsize_t offset[DatasetRank] = {
+			static_cast<hsize_t>(startChan),
+			static_cast<hsize_t>(startSample)
+		};
+	hsize_t counts[DatasetRank] = {
+			static_cast<hsize_t>(endChan - startChan),
+			static_cast<hsize_t>(endSample - startSample)
+		};
+	space.selectHyperslab(H5S_SELECT_SET, counts, offset);
+	H5::DataSpace memspace(DatasetRank, counts);
+	DATAFILE_TRACE_SCOPE("DataFile::read", "datafile");
+	IoTimer timer(m_stats, IoRead, counts[0] * counts[1] * memType.getSize());
+	dataset.read(out, memType, memspace, space);
+}
+
+void DataFile::readBatches(sample_index nblocks, unsigned int nthreads,
+		const std::function<std::pair<sample_index, sample_index>(sample_index)>& range,
+		const std::function<void(sample_index, std::vector<PooledMatrix<float> >&)>& process)
+{
+	for (sample_index firstBlock = 0; firstBlock < nblocks; firstBlock += nthreads) {
+		const sample_index nbatch = std::min<sample_index>(nthreads, nblocks - firstBlock);
+		std::vector<PooledMatrix<float> > raw(nbatch);
+		for (sample_index b = 0; b < nbatch; b++) {
+			const auto samples = range(firstBlock + b);
+			raw[b] = data<float>(0, nchannels(), samples.first, samples.second, m_pool);
+		}
+		process(firstBlock, raw);
+	}
+}
+
+void DataFile::computeLfp(const LfpOptions& options)
+{
+	DATAFILE_TRACE_SCOPE("DataFile::computeLfp", "datafile");
+	if ( (options.sampleRate <= 0.) || (options.sampleRate > sampleRate()) ) {
+		throw std::logic_error("LFP sample rate of " + std::to_string(options.sampleRate) +
+				" Hz is not in range (0, " + std::to_string(sampleRate()) + "]");
+	}
+	const sample_index factor = std::max<sample_index>(
+			std::lround(sampleRate() / options.sampleRate), 1);
+	const float rate = sampleRate() / factor;
+	const double cutoff = (options.cutoff > 0.) ? options.cutoff : 0.4 * rate;
+	const size_t taps = (options.taps ? options.taps : 20 * factor + 1) | 1;
+	const arma::vec h = firFilter(0., cutoff, sampleRate(), taps);
+	const sample_index half = taps / 2;
+	const unsigned int nthreads = threadCount(options.nthreads);
+
+	flushStaged();
+	auto dataset = createDerived(LfpDataset, rate);
+	writeIntAttr(dataset, "decimation", factor);
+	writeFloatAttr(dataset, "cutoff", cutoff);
+
+	/* Each block computes one chunk of the LFP, from the raw samples
+	 * it spans plus half the filter on either side. Blocks are read in
+	 * batches, one per thread, and each channel of each block is filtered
+	 * independently.
+	 */
+	const sample_index n = nsamples();
+	const sample_index nout = (n + factor - 1) / factor;
+	const sample_index nblocks = (nout + DerivedChunkSize - 1) / DerivedChunkSize;
+	const int nchan = nchannels();
+	auto outputs = [&](sample_index block) {
+		const sample_index first = block * DerivedChunkSize;
+		return std::make_pair(first, std::min<sample_index>(first + DerivedChunkSize, nout));
+	};
+	auto range = [&](sample_index block) {
+		const auto out = outputs(block);
+		return std::make_pair(std::max<sample_index>(out.first * factor - half, 0),
+				std::min((out.second - 1) * factor + half + 1, n));
+	};
+	auto filterBatch = [&](sample_index firstBlock, std::vector<PooledMatrix<float> >& raw) {
+		const sample_index nbatch = raw.size();
+		std::vector<arma::fmat> out(nbatch);
+		for (sample_index b = 0; b < nbatch; b++) {
+			const auto samples = outputs(firstBlock + b);
+			out[b].set_size(samples.second - samples.first, nchan);
+		}
+
+		{
+			DATAFILE_TRACE_SCOPE("DataFile::filter", "datafile");
+			parallelFor(nbatch * nchan, nthreads, [&](arma::uword task) {
+					const arma::uword b = task / nchan, c = task % nchan;
+					const sample_index first = outputs(firstBlock + b).first;
+					const sample_index rawStart = range(firstBlock + b).first;
+					const float* x = raw[b]->colptr(c);
+					const sample_index count = raw[b]->n_rows;
+					float* y = out[b].colptr(c);
+					for (arma::uword i = 0; i < out[b].n_rows; i++) {
+						/* Samples beyond the recording repeat its first or last */
+						const sample_index center = (first + i) * factor - rawStart;
+						double sum = 0.;
+						for (sample_index j = 0; j < static_cast<sample_index>(taps); j++) {
+							const sample_index k = std::min(std::max<sample_index>(
+									center + j - half, 0), count - 1);
+							sum += h(j) * x[k];
+						}
+						y[i] = static_cast<float>(sum);
+					}
+				});
+		}
+
+		for (sample_index b = 0; b < nbatch; b++)
+			writeDerived(dataset, outputs(firstBlock + b).first, out[b]);
+	};
+	readBatches(nblocks, nthreads, range, filterBatch);
+	m_file.flush(H5F_SCOPE_LOCAL);
+}
+
+sample_index DataFile::computeSpikePower(const SpikePowerOptions& options)
+{
+	DATAFILE_TRACE_SCOPE("DataFile::computeSpikePower", "datafile");
+	const sample_index binSize = std::max<size_t>(options.binSize, 1);
+	const size_t taps = (options.taps ? options.taps :
+			static_cast<size_t>(std::lround(8. * sampleRate() / options.low))) | 1;
+	const arma::vec h = firFilter(options.low, options.high, sampleRate(), taps);
+	const sample_index half = taps / 2;
+	const size_t nfft = options.fftSize;
+	if (taps + binSize - 1 > nfft) {
+		throw std::logic_error("A filter of " + std::to_string(taps) +
+				" taps and a bin of " + std::to_string(binSize) +
+				" samples do not fit in an FFT of " + std::to_string(nfft) + " samples");
+	}
+	const unsigned int nthreads = threadCount(options.nthreads);
+
+	/* Continue from the stored bins, unless they were computed differently */
+	flushStaged();
+	H5::DataSet dataset;
+	sample_index firstBin = 0;
+	if (hasDerived(SpikePowerDataset)) {
+		dataset = openDerived(SpikePowerDataset);
+		DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+		IoTimer timer(m_stats, IoAttribute);
+		const bool same =
+			(readAttr<int64_t>(dataset, "bin-size", H5::PredType::NATIVE_INT64, 0) == binSize) &&
+			(readAttr<int64_t>(dataset, "taps", H5::PredType::NATIVE_INT64, 0) ==
+				static_cast<int64_t>(taps)) &&
+			(readAttr<float>(dataset, "low", H5::PredType::NATIVE_FLOAT, 0.) == options.low) &&
+			(readAttr<float>(dataset, "high", H5::PredType::NATIVE_FLOAT, 0.) == options.high);
+		if (same)
+			firstBin = derivedSamples(SpikePowerDataset);
+	}
+	if (firstBin == 0) {
+		dataset = createDerived(SpikePowerDataset, sampleRate() / binSize);
+		writeIntAttr(dataset, "bin-size", binSize);
+		writeIntAttr(dataset, "taps", taps);
+		writeFloatAttr(dataset, "low", options.low);
+		writeFloatAttr(dataset, "high", options.high);
+	}
+	const sample_index n = nsamples();
+	const sample_index nbins = readOnly() ? n / binSize :
+		std::max<sample_index>(n - half, 0) / binSize;
+	if (nbins <= firstBin)
+		return 0;
+
+	/* The transform of the filter, shared by every block. Filtering is
+	 * a circular convolution of each block with the filter, of which the
+	 * first taps - 1 samples wrap around and are discarded.
+	 */
+	arma::vec padded(nfft, arma::fill::zeros);
+	std::copy(h.memptr(), h.memptr() + taps, padded.memptr());
+	const arma::cx_vec filter = arma::fft(padded);
+	const sample_index blockBins = (nfft - taps + 1) / binSize;
+	const sample_index nblocks = (nbins - firstBin + blockBins - 1) / blockBins;
+	const int nchan = nchannels();
+	auto outputs = [&](sample_index block) {
+		const sample_index first = firstBin + block * blockBins;
+		return std::make_pair(first, std::min(first + blockBins, nbins));
+	};
+	auto range = [&](sample_index block) {
+		const auto out = outputs(block);
+		return std::make_pair(std::max<sample_index>(out.first * binSize - half, 0),
+				std::min(out.second * binSize + half, n));
+	};
+	auto filterBatch = [&](sample_index firstBlock, std::vector<PooledMatrix<float> >& raw) {
+		const sample_index nbatch = raw.size();
+		std::vector<arma::fmat> out(nbatch);
+		for (sample_index b = 0; b < nbatch; b++) {
+			const auto bins = outputs(firstBlock + b);
+			out[b].set_size(bins.second - bins.first, nchan);
+		}
+
+		{
+			DATAFILE_TRACE_SCOPE("DataFile::filter", "datafile");
+			parallelFor(nbatch * nchan, nthreads, [&](arma::uword task) {
+					const arma::uword b = task / nchan, c = task % nchan;
+					const sample_index first = outputs(firstBlock + b).first;
+					const sample_index rawStart = range(firstBlock + b).first;
+					const float* x = raw[b]->colptr(c);
+					const sample_index count = raw[b]->n_rows;
+
+					/* Samples beyond the recording repeat its first or last */
+					const sample_index offset = first * binSize - half - rawStart;
+					const sample_index length = out[b].n_rows * binSize + taps - 1;
+					arma::vec segment(nfft, arma::fill::zeros);
+					for (sample_index i = 0; i < length; i++)
+						segment(i) = x[std::min(std::max<sample_index>(offset + i, 0), count - 1)];
+					arma::cx_vec spectrum = arma::fft(segment);
+					for (size_t i = 0; i < nfft; i++)
+						spectrum(i) *= filter(i);
+					arma::cx_vec filtered = arma::ifft(spectrum);
+
+					float* y = out[b].colptr(c);
+					for (arma::uword k = 0; k < out[b].n_rows; k++) {
+						double sum = 0.;
+						for (sample_index i = 0; i < binSize; i++) {
+							const double v = filtered(k * binSize + i + taps - 1).real();
+							sum += v * v;
+						}
+						y[k] = static_cast<float>(std::sqrt(sum / binSize));
+					}
+				});
+		}
+
+		for (sample_index b = 0; b < nbatch; b++)
+			writeDerived(dataset, outputs(firstBlock + b).first, out[b]);
+	};
+	readBatches(nblocks, nthreads, range, filterBatch);
+	m_file.flush(H5F_SCOPE_LOCAL);
+	return nbins - firstBin;
+}
+
+samples DataFile::spikePower(sample_index startBin, sample_index endBin) const
+{
+	samples s;
+	derived(SpikePowerDataset, 0, nchannels(), startBin, endBin, s);
+	DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+	IoTimer timer(m_stats, IoConvert, s.n_elem * sizeof(double));
+	s *= gain();
+	return s;
+}
+
+sample_index DataFile::computePsd(const PsdOptions& options)
+{
+	DATAFILE_TRACE_SCOPE("DataFile::computePsd", "datafile");
+	const sample_index size = options.segmentSize;
+	if ( (size < 2) || (options.overlap >= options.segmentSize) ) {
+		throw std::logic_error("Segments of " + std::to_string(options.segmentSize) +
+				" samples overlapping by " + std::to_string(options.overlap) +
+				" are not valid");
+	}
+	const sample_index step = size - options.overlap;
+	const sample_index nfreq = size / 2 + 1;
+	const unsigned int nthreads = threadCount(options.nthreads);
+
+	/* Continue the stored average, unless it used other segments */
+	flushStaged();
+	H5::DataSet dataset;
+	sample_index stored = 0;
+	if (hasDerived(PsdDataset)) {
+		dataset = openDerived(PsdDataset);
+		DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+		IoTimer timer(m_stats, IoAttribute);
+		if ( (readAttr<int64_t>(dataset, "segment-size", H5::PredType::NATIVE_INT64, 0) == size) &&
+				(readAttr<int64_t>(dataset, "overlap", H5::PredType::NATIVE_INT64, -1) ==
+				 static_cast<int64_t>(options.overlap)) ) {
+			stored = readAttr<int64_t>(dataset, "segments", H5::PredType::NATIVE_INT64, 0);
+		}
+	}
+	const sample_index n = nsamples();
+	const sample_index nsegments = (n < size) ? 0 : (n - size) / step + 1;
+	if (nsegments <= stored)
+		return 0;
+
+	/* A Hann window, and the scale which makes the one-sided spectrum
+	 * a density, such that its sum over frequencies is the variance.
+	 */
+	const double pi = std::acos(-1.);
+	arma::vec window(size);
+	double power = 0.;
+	for (sample_index i = 0; i < size; i++) {
+		window(i) = 0.5 - 0.5 * std::cos(2. * pi * i / (size - 1));
+		power += window(i) * window(i);
+	}
+	const double scale = 1. / (sampleRate() * power);
+
+	/* Each block is the segments whose samples fit in about BlockSize
+	 * samples, and accumulates the sum of their spectra.
+	 */
+	const int nchan = nchannels();
+	const sample_index blockSegments = std::max<sample_index>((BlockSize - size) / step + 1, 1);
+	const sample_index nblocks = (nsegments - stored + blockSegments - 1) / blockSegments;
+	arma::mat total(nfreq, nchan, arma::fill::zeros);
+	auto segments = [&](sample_index block) {
+		const sample_index first = stored + block * blockSegments;
+		return std::make_pair(first, std::min(blockSegments, nsegments - first));
+	};
+	auto range = [&](sample_index block) {
+		const auto s = segments(block);
+		return std::make_pair(s.first * step, (s.first + s.second - 1) * step + size);
+	};
+	auto sumBatch = [&](sample_index firstBlock, std::vector<PooledMatrix<float> >& raw) {
+		const sample_index nbatch = raw.size();
+		std::vector<arma::mat> sums(nbatch);
+		{
+			DATAFILE_TRACE_SCOPE("DataFile::spectrum", "datafile");
+			parallelFor(nbatch, nthreads, [&](arma::uword b) {
+					sums[b].zeros(nfreq, nchan);
+					arma::mat segment(size, nchan);
+					const sample_index count = segments(firstBlock + b).second;
+					for (sample_index s = 0; s < count; s++) {
+						for (int c = 0; c < nchan; c++) {
+							const float* x = raw[b]->colptr(c) + s * step;
+							double mean = 0.;
+							for (sample_index i = 0; i < size; i++)
+								mean += x[i];
+							mean /= size;
+							for (sample_index i = 0; i < size; i++)
+								segment(i, c) = (x[i] - mean) * window(i);
+						}
+						arma::cx_mat spectra = arma::fft(segment);
+						for (int c = 0; c < nchan; c++) {
+							const std::complex<double>* X = spectra.colptr(c);
+							double* sum = sums[b].colptr(c);
+							for (sample_index k = 0; k < nfreq; k++)
+								sum[k] += std::norm(X[k]);
+						}
+					}
+				});
+		}
+		for (sample_index b = 0; b < nbatch; b++)
+			total += sums[b];
+	};
+	readBatches(nblocks, nthreads, range, sumBatch);
+
+	/* Fold the negative frequencies onto the positive, and combine the
+	 * new segments with those already averaged.
+	 */
+	total *= scale;
+	for (sample_index k = 1; k < nfreq; k++) {
+		if (2 * k != size)
+			total.row(k) *= 2.;
+	}
+	if (stored > 0) {
+		arma::mat previous;
+		derived(PsdDataset, 0, nchan, 0, nfreq, previous);
+		total += previous * static_cast<double>(stored);
+	} else {
+		dataset = createDerived(PsdDataset, sampleRate());
+		writeIntAttr(dataset, "segment-size", size);
+		writeIntAttr(dataset, "overlap", options.overlap);
+	}
+	total *= 1. / nsegments;
+	writeDerived(dataset, 0, arma::conv_to<arma::fmat>::from(total));
+	writeIntAttr(dataset, "segments", nsegments);
+	m_file.flush(H5F_SCOPE_LOCAL);
+	return nsegments - stored;
+}
+
+sample_index DataFile::psdSegments() const
+{
+	return readAttr<int64_t>(openDerived(PsdDataset), "segments",
+			H5::PredType::NATIVE_INT64, 0);
+}
+
+arma::vec DataFile::psdFrequencies() const
+{
+	const sample_index size = readAttr<int64_t>(openDerived(PsdDataset),
+			"segment-size", H5::PredType::NATIVE_INT64, 0);
+	arma::vec frequencies(size / 2 + 1);
+	for (arma::uword k = 0; k < frequencies.n_elem; k++)
+		frequencies(k) = k * sampleRate() / size;
+	return frequencies;
+}
+
+samples DataFile::psd() const
+{
+	samples s;
+	derived(PsdDataset, 0, nchannels(), 0, derivedSamples(PsdDataset), s);
+	DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+	IoTimer timer(m_stats, IoConvert, s.n_elem * sizeof(double));
+	s *= gain() * gain();
+	return s;
+}
+
+samples DataFile::lfp(sample_index startSample, sample_index endSample) const
+{
+	samples s;
+	lfp(0, nchannels(), startSample, endSample, s);
+	DATAFILE_TRACE_SCOPE("DataFile::convert", "datafile");
+	IoTimer timer(m_stats, IoConvert, s.n_elem * sizeof(double));
+	s *= gain();
+	return s;
+}
+
+} // end datafile namespace
+
@@ -0,0 +1,285 @@
+/* detection.cc
+ *
+ * Implementation of matched-filter spike detection.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "detection.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+
+namespace detection {
+
+namespace {
+
+/* A template prepared for scoring: the spectrum of its
+ * normalized waveform, and the columns of its channels in each block.
+ */
+struct Prepared {
+	arma::cx_mat spectra;
+	arma::uvec columns;
+	arma::uword length, peak, deadTime;
+};
+
+/* Return the median of the absolute values, a robust estimate of the
+ * noise of a score which is mostly noise.
+ */
+double medianAbs(const double* values, arma::uword n)
+{
+	std::vector<double> tmp(n);
+	for (arma::uword i = 0; i < n; i++)
+		tmp[i] = std::abs(values[i]);
+	std::nth_element(tmp.begin(), tmp.begin() + n / 2, tmp.end());
+	return tmp[n / 2];
+}
+
+} // end anonymous namespace
+
+std::vector<Detection> detect(const datafile::DataFile& file,
+		const std::vector<Template>& templates, const Options& options)
+{
+	DATAFILE_TRACE_SCOPE("detection::detect", "detection");
+	const arma::uword nfft = options.fftSize;
+	const int nchannels = file.nchannels();
+
+	/* Collect the channels spanned by any template */
+	std::vector<arma::uword> channels;
+	arma::uword maxLength = 0;
+	for (auto& t : templates) {
+		if (t.waveform.is_empty() || (t.waveform.n_cols != t.channels.n_elem))
+			throw std::logic_error("Template must have one column for each of its channels");
+		if (t.waveform.n_rows > nfft) {
+			throw std::logic_error("Template of " + std::to_string(t.waveform.n_rows) +
+					" samples is longer than the FFT size");
+		}
+		for (auto c : t.channels) {
+			if (c >= static_cast<arma::uword>(nchannels)) {
+				throw std::logic_error("Template channel " + std::to_string(c) +
+						" is not in range [0, " + std::to_string(nchannels) + ")");
+			}
+			channels.push_back(c);
+		}
+		maxLength = std::max(maxLength, t.waveform.n_rows);
+	}
+	std::sort(channels.begin(), channels.end());
+	channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+	const datafile::sample_index nsamples = file.nsamples();
+	if (templates.empty() || (nsamples < static_cast<datafile::sample_index>(maxLength)))
+		return std::vector<Detection>();
+
+	/* Remove the mean of each channel of each template, and scale it to
+	 * unit norm, so that scores are projections onto the template.
+	 */
+	std::vector<Prepared> prepared(templates.size());
+	for (size_t k = 0; k < templates.size(); k++) {
+		const auto& t = templates[k];
+		auto& p = prepared[k];
+		arma::mat padded(nfft, t.channels.n_elem, arma::fill::zeros);
+		double norm = 0.;
+		for (arma::uword c = 0; c < t.channels.n_elem; c++) {
+			const double* w = t.waveform.colptr(c);
+			double mean = 0.;
+			for (arma::uword i = 0; i < t.waveform.n_rows; i++)
+				mean += w[i];
+			mean /= t.waveform.n_rows;
+			for (arma::uword i = 0; i < t.waveform.n_rows; i++) {
+				padded(i, c) = w[i] - mean;
+				norm += padded(i, c) * padded(i, c);
+			}
+		}
+		if (norm == 0.)
+			throw std::logic_error("Template " + std::to_string(k) + " is constant");
+		padded *= 1. / std::sqrt(norm);
+		p.spectra = arma::fft(padded);
+		p.columns.set_size(t.channels.n_elem);
+		for (arma::uword c = 0; c < t.channels.n_elem; c++) {
+			p.columns(c) = std::lower_bound(channels.begin(), channels.end(),
+					t.channels(c)) - channels.begin();
+		}
+		p.length = t.waveform.n_rows;
+		p.peak = t.peak;
+		p.deadTime = options.deadTime ? options.deadTime : p.length;
+	}
+
+	/* Scores are valid where the whole template fits in the recording.
+	 * Each block holds the scores of `step` samples, and overlaps the
+	 * next by the length of the longest template.
+	 */
+	const arma::uword nscores = nsamples - maxLength + 1;
+	const arma::uword step = nfft - maxLength + 1;
+	const arma::uword nblocks = (nscores + step - 1) / step;
+	const arma::uword minChan = channels.front(), maxChan = channels.back();
+	const unsigned int nthreads = datafile::threadCount(options.nthreads);
+	const arma::uword batchBlocks = nthreads;
+	const arma::uvec good = options.skipBadChannels ? file.channelMask() :
+		arma::uvec(nchannels, arma::fill::ones);
+
+	datafile::BufferPool pool;
+	std::vector<std::vector<Detection> > accepted(templates.size());
+	for (arma::uword firstBlock = 0; firstBlock < nblocks; firstBlock += batchBlocks) {
+		const arma::uword nbatch = std::min(batchBlocks, nblocks - firstBlock);
+
+		/* Read the blocks, keeping only the channels of the templates */
+		std::vector<arma::mat> blocks(nbatch);
+		for (arma::uword b = 0; b < nbatch; b++) {
+			const arma::uword start = (firstBlock + b) * step;
+			const arma::uword end = std::min<arma::uword>(start + nfft, nsamples);
+			auto raw = file.data<double>(minChan, maxChan + 1, start, end, pool);
+			blocks[b].zeros(nfft, channels.size());
+			for (size_t c = 0; c < channels.size(); c++) {
+				if (!good(channels[c]))
+					continue;
+				std::copy(raw->colptr(channels[c] - minChan),
+						raw->colptr(channels[c] - minChan) + (end - start),
+						blocks[b].colptr(c));
+			}
+		}
+
+		/* Transform every channel of each block once */
+		std::vector<arma::cx_mat> spectra(nbatch);
+		{
+			DATAFILE_TRACE_SCOPE("detection::fft", "detection");
+			datafile::parallelFor(nbatch, nthreads, [&](arma::uword b) {
+					spectra[b] = arma::fft(blocks[b]);
+				});
+		}
+
+		/* Score each template in each block, and find candidate spikes
+		 * at local maxima of the score above the threshold.
+		 */
+		std::vector<std::vector<Detection> > candidates(nbatch * templates.size());
+		{
+			DATAFILE_TRACE_SCOPE("detection::score", "detection");
+			datafile::parallelFor(nbatch * templates.size(), nthreads, [&](arma::uword task) {
+					const arma::uword b = task / templates.size(), k = task % templates.size();
+					const auto& p = prepared[k];
+					if (!good(templates[k].channels(0)))
+						return;
+					const arma::uword start = (firstBlock + b) * step;
+					const arma::uword count = std::min(step, nscores - start);
+					arma::cx_vec product(nfft, arma::fill::zeros);
+					for (arma::uword c = 0; c < p.columns.n_elem; c++) {
+						const std::complex<double>* x = spectra[b].colptr(p.columns(c));
+						const std::complex<double>* w = p.spectra.colptr(c);
+						for (arma::uword i = 0; i < nfft; i++)
+							product(i) += x[i] * std::conj(w[i]);
+					}
+					arma::cx_vec correlation = arma::ifft(product);
+					std::vector<double> score(count);
+					for (arma::uword i = 0; i < count; i++)
+						score[i] = correlation(i).real();
+					const double noise = medianAbs(score.data(), count) / 0.6745;
+					if (noise == 0.)
+						return;
+					const double threshold = options.threshold * noise;
+					for (arma::uword i = 0; i < count; i++) {
+						if ( (score[i] > threshold) &&
+								( (i == 0) || (score[i] >= score[i - 1]) ) &&
+								( (i + 1 == count) || (score[i] > score[i + 1]) ) ) {
+							candidates[task].push_back(Detection{
+									start + i + p.peak, k, score[i] / noise });
+						}
+					}
+				});
+		}
+
+		/* Keep the largest of any detections of one template closer
+		 * than its dead time, across blocks.
+		 */
+		for (arma::uword b = 0; b < nbatch; b++) {
+			for (size_t k = 0; k < templates.size(); k++) {
+				auto& out = accepted[k];
+				for (auto& d : candidates[b * templates.size() + k]) {
+					if (!out.empty() && (d.sample - out.back().sample < prepared[k].deadTime)) {
+						if (d.score > out.back().score)
+							out.back() = d;
+					} else {
+						out.push_back(d);
+					}
+				}
+			}
+		}
+	}
+
+	std::vector<Detection> detections;
+	for (auto& out : accepted)
+		detections.insert(detections.end(), out.begin(), out.end());
+	std::stable_sort(detections.begin(), detections.end(),
+			[](const Detection& a, const Detection& b) { return a.sample < b.sample; });
+	return detections;
+}
+
+std::vector<Detection> detect(const datafile::DataFile& file,
+		const std::vector<Template>& templates, snipfile::SnipFile& snipFile,
+		const Options& options)
+{
+	auto all = detect(file, templates, options);
+	const arma::uword nbefore = -snipFile.nsamplesBefore();	// stored negated
+	const arma::uword nafter = snipFile.nsamplesAfter();
+	const arma::uword nsamples = file.nsamples();
+
+	/* Group detections by the primary channel of their template */
+	std::vector<arma::uword> channels;
+	for (auto& t : templates)
+		channels.push_back(t.channels(0));
+	std::sort(channels.begin(), channels.end());
+	channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+	std::vector<std::vector<arma::uword> > samples(channels.size());
+	std::vector<std::vector<arma::sword> > labels(channels.size());
+	std::vector<Detection> written;
+	for (auto& d : all) {
+		if ( (d.sample < nbefore) || (d.sample + nafter >= nsamples) )
+			continue;
+		const size_t c = std::lower_bound(channels.begin(), channels.end(),
+				templates[d.templ].channels(0)) - channels.begin();
+		samples[c].push_back(d.sample);
+		labels[c].push_back(d.templ);
+		written.push_back(d);
+	}
+
+	/* The snippet file may leave out channels marked bad in the recording,
+	 * whose detections are then discarded.
+	 */
+	snipFile.setChannels(arma::uvec(channels));
+	const arma::uvec kept = snipFile.channels();
+	if (kept.n_elem != channels.size()) {
+		written.erase(std::remove_if(written.begin(), written.end(),
+				[&](const Detection& d) {
+					return !std::binary_search(kept.begin(), kept.end(),
+							templates[d.templ].channels(0));
+				}), written.end());
+	}
+
+	/* Read the snippet around each detection from the recording */
+	std::vector<arma::uvec> idx(kept.n_elem);
+	std::vector<arma::Mat<short> > snips(kept.n_elem);
+	for (arma::uword k = 0; k < kept.n_elem; k++) {
+		const size_t c = std::lower_bound(channels.begin(), channels.end(),
+				kept(k)) - channels.begin();
+		idx[k] = arma::uvec(samples[c]);
+		snips[k].set_size(nbefore + nafter + 1, idx[k].n_elem);
+		if (idx[k].is_empty())
+			continue;
+		arma::Cube<short> windows;
+		file.readWindows(idx[k], nbefore, nafter, arma::uvec{ kept(k) }, windows,
+				options.nthreads);
+		snips[k] = arma::Mat<short>(windows.memptr(), nbefore + nafter + 1, idx[k].n_elem);
+	}
+	snipFile.setThresholds(arma::vec(kept.n_elem, arma::fill::ones) * options.threshold);
+	snipFile.writeSpikeSnips(idx, snips);
+	for (arma::uword k = 0; k < kept.n_elem; k++) {
+		const size_t c = std::lower_bound(channels.begin(), channels.end(),
+				kept(k)) - channels.begin();
+		if (!labels[c].empty())
+			snipFile.setLabels(kept(k), arma::ivec(labels[c]));
+	}
+	return written;
+}
+
+} // end detection namespace
+
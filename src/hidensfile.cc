@@ -12,8 +12,8 @@
 namespace hidensfile {
 
 HidensFile::HidensFile(std::string filename,
-		std::string array, int nchannels)
-		: DataFile(filename, array, nchannels)
+		std::string array, int nchannels, datafile::Layout layout)
+		: DataFile(filename, array, nchannels, H5::PredType::STD_I16LE, layout)
 {
 	if (readOnly())
 		readConfiguration();
@@ -142,7 +142,7 @@ void HidensFile::writeConfiguration()
 	}
 }
 
-void HidensFile::setAnalogOutputSize(int /* size */)
+void HidensFile::setAnalogOutputSize(datafile::sample_index /* size */)
 {
 }
 
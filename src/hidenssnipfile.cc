@@ -8,16 +8,17 @@
 
 #include "hidenssnipfile.h"
 
-hidenssnipfile::HidensSnipFile::HidensSnipFile(const std::string& name)
-	: snipfile::SnipFile(name)
+hidenssnipfile::HidensSnipFile::HidensSnipFile(const std::string& name, bool writable)
+	: snipfile::SnipFile(name, writable)
 {
 	readConfiguration();
 }
 
 hidenssnipfile::HidensSnipFile::HidensSnipFile(const std::string& name,
 		const hidensfile::HidensFile& source,
-		const size_t nbefore, const size_t nafter)
-	: snipfile::SnipFile(name, source, nbefore, nafter)
+		const size_t nbefore, const size_t nafter,
+		const snipfile::StorageOptions& options)
+	: snipfile::SnipFile(name, source, nbefore, nafter, options)
 {
 	copyConfiguration(source);
 }
@@ -93,7 +94,181 @@ void hidenssnipfile::HidensSnipFile::readConfiguration()
 	readConfigDataset(yDataset, y_);
 	auto labelDataset = configGroup.openDataSet("label");
 	readConfigDataset(labelDataset, label_);
-	auto channelDataset = configGroup.openDataSet("extracted-channels");
+	auto channelDataset = configGroup.openDataSet("channels");
 	readConfigDataset(channelDataset, indices_);
 }
 
+
+arma::umat hidenssnipfile::HidensSnipFile::neighborhoods(size_t k) const
+{
+	const arma::uword nelectrodes = xpos_.n_elem;
+
+	/* Channels marked bad in the source are never neighbors */
+	std::vector<arma::uword> candidates;
+	for (arma::uword c = 0; c < nelectrodes; c++) {
+		if ( (c >= channelMask_.n_elem) || channelMask_(c) )
+			candidates.push_back(c);
+	}
+	if (k > candidates.size())
+		throw std::logic_error("Neighborhoods are larger than the number of electrodes");
+	arma::umat neighbors(k, channels_.n_elem);
+	std::vector<arma::uword> order;
+	for (arma::uword i = 0; i < channels_.n_elem; i++) {
+		const arma::uword channel = channels_(i);
+		if (channel >= nelectrodes)
+			throw std::logic_error("Extracted channel has no electrode position");
+		auto distance = [&](arma::uword c) {
+			double dx = static_cast<double>(xpos_(c)) - xpos_(channel);
+			double dy = static_cast<double>(ypos_(c)) - ypos_(channel);
+			return dx * dx + dy * dy;
+		};
+		order = candidates;
+		std::partial_sort(order.begin(), order.begin() + k, order.end(),
+				[&](arma::uword a, arma::uword b) {
+					if ( (a == channel) || (b == channel) )
+						return (a == channel) && (b != channel);
+					double da = distance(a), db = distance(b);
+					return (da < db) || ( (da == db) && (a < b) );
+				});
+		std::copy(order.begin(), order.begin() + k, neighbors.colptr(i));
+	}
+	return neighbors;
+}
+
+void hidenssnipfile::HidensSnipFile::writeNeighborhoodSnips(
+		const hidensfile::HidensFile& source, const std::vector<arma::uvec>& idx,
+		size_t k)
+{
+	DATAFILE_TRACE_SCOPE("HidensSnipFile::writeNeighborhoods", "snipfile");
+	if (k == 0)
+		throw std::logic_error("Neighborhoods must contain at least one channel");
+	if (nchannels_ == 0)
+		throw std::logic_error("No channels were extracted");
+	if (idx.size() != nchannels_)
+		throw std::logic_error("Spikes must be given for each extracted channel");
+	const datafile::sample_index nbefore = -nsamplesBefore();	// stored negated
+	const datafile::sample_index nafter = nsamplesAfter();
+	const hsize_t snipSize = nbefore + nafter + 1;
+	const datafile::sample_index nsamples = source.nsamples();
+	for (auto& spikes : idx) {
+		for (arma::uword i = 0; i < spikes.n_elem; i++) {
+			if ( (i > 0) && (spikes(i) < spikes(i - 1)) )
+				throw std::logic_error("Spikes must be sorted");
+			if ( (static_cast<datafile::sample_index>(spikes(i)) < nbefore) ||
+					(static_cast<datafile::sample_index>(spikes(i)) + nafter >= nsamples) )
+				throw std::logic_error("Snippet extends outside the source data");
+		}
+	}
+	auto neighbors = neighborhoods(k);
+	const arma::uword minChan = *std::min_element(neighbors.begin(), neighbors.end());
+	const arma::uword maxChan = *std::max_element(neighbors.begin(), neighbors.end());
+
+	/* Create the datasets of each channel */
+	std::vector<H5::DataSet> snipSets(nchannels_);
+	for (decltype(nchannels_) c = 0; c < nchannels_; c++) {
+		auto& grp = channelGroups[c];
+		const hsize_t nspikes = idx[c].n_elem;
+		hsize_t snipDims[3] = {nspikes, k, snipSize};
+		snipSets[c] = grp.createDataSet("neighborhood-snippets", snippetType(),
+				H5::DataSpace(3, snipDims), datasetProperties(nspikes, snipSize, true, k));
+		hsize_t idxDims[1] = {nspikes};
+		auto idxSet = grp.createDataSet("neighborhood-idx", H5::PredType::STD_U64LE,
+				H5::DataSpace(1, idxDims), datasetProperties(nspikes, 1, false));
+		idxSet.write(idx[c].memptr(), H5::PredType::STD_U64LE);
+		hsize_t chanDims[1] = {k};
+		auto chanSet = grp.createDataSet("neighborhood-channels", H5::PredType::STD_U64LE,
+				H5::DataSpace(1, chanDims));
+		chanSet.write(neighbors.colptr(c), H5::PredType::STD_U64LE);
+	}
+
+	/* Visit the spikes of all channels in order of their first sample.
+	 * The spikes of each channel remain in order, so the rows of one
+	 * channel extracted from any block are consecutive.
+	 */
+	struct Spike {
+		datafile::sample_index start;
+		arma::uword channel, row;
+	};
+	std::vector<Spike> spikes;
+	for (arma::uword c = 0; c < idx.size(); c++) {
+		for (arma::uword i = 0; i < idx[c].n_elem; i++)
+			spikes.push_back(Spike{ static_cast<datafile::sample_index>(idx[c](i)) - nbefore, c, i });
+	}
+	std::stable_sort(spikes.begin(), spikes.end(),
+			[](const Spike& a, const Spike& b) { return a.start < b.start; });
+
+	std::vector<std::vector<short> > staged(nchannels_);
+	std::vector<hsize_t> firstRow(nchannels_);
+	for (size_t first = 0; first < spikes.size(); ) {
+		/* Read the block covering all snippets starting within it */
+		const datafile::sample_index blockStart = spikes[first].start;
+		size_t last = first;
+		while ( (last < spikes.size()) &&
+				(spikes[last].start < blockStart +
+				 static_cast<datafile::sample_index>(EXTRACT_BLOCK_SIZE)) )
+			last++;
+		auto block = source.data<short>(minChan, maxChan + 1, blockStart,
+				spikes[last - 1].start + snipSize, pool_);
+
+		for (size_t s = first; s < last; s++) {
+			auto& spike = spikes[s];
+			auto& buf = staged[spike.channel];
+			if (buf.empty())
+				firstRow[spike.channel] = spike.row;
+			for (size_t j = 0; j < k; j++) {
+				const short* src = block->colptr(neighbors(j, spike.channel) - minChan) +
+						(spike.start - blockStart);
+				buf.insert(buf.end(), src, src + snipSize);
+			}
+		}
+
+		for (decltype(nchannels_) c = 0; c < nchannels_; c++) {
+			auto& buf = staged[c];
+			if (buf.empty())
+				continue;
+			hsize_t offset[3] = {firstRow[c], 0, 0};
+			hsize_t count[3] = {buf.size() / (k * snipSize), k, snipSize};
+			auto space = snipSets[c].getSpace();
+			space.selectHyperslab(H5S_SELECT_SET, count, offset);
+			H5::DataSpace memSpace(3, count);
+			datafile::IoTimer timer(stats_, datafile::IoWrite, buf.size() * sizeof(short));
+			snipSets[c].write(buf.data(), H5::PredType::STD_I16LE, memSpace, space);
+			buf.clear();
+		}
+		first = last;
+	}
+}
+
+void hidenssnipfile::HidensSnipFile::neighborhoodSnips(arma::uword channel,
+		arma::uvec& idx, arma::Cube<short>& snips)
+{
+	auto handles = channelHandles(channel);
+	if (!handles || !handles->group.nameExists("neighborhood-snippets"))
+		return;
+	DATAFILE_TRACE_SCOPE("HidensSnipFile::readNeighborhoods", "snipfile");
+	auto snipSet = handles->group.openDataSet("neighborhood-snippets");
+	hsize_t dims[3] = {0, 0, 0};
+	snipSet.getSpace().getSimpleExtentDims(dims);
+	idx.set_size(dims[0]);
+	snips.set_size(dims[2], dims[1], dims[0]);
+	datafile::IoTimer timer(stats_, datafile::IoRead,
+			snips.n_elem * sizeof(short) + idx.n_elem * sizeof(arma::uword));
+	if (dims[0]) {
+		handles->group.openDataSet("neighborhood-idx").read(idx.memptr(),
+				H5::PredType::STD_U64LE);
+		snipSet.read(snips.memptr(), H5::PredType::STD_I16LE);
+	}
+}
+
+arma::uvec hidenssnipfile::HidensSnipFile::neighborhoodChannels(arma::uword channel)
+{
+	auto handles = channelHandles(channel);
+	if (!handles || !handles->group.nameExists("neighborhood-channels"))
+		return arma::uvec();
+	auto chanSet = handles->group.openDataSet("neighborhood-channels");
+	hsize_t dims[1] = {0};
+	chanSet.getSpace().getSimpleExtentDims(dims);
+	arma::uvec channels(dims[0]);
+	chanSet.read(channels.memptr(), H5::PredType::STD_U64LE);
+	return channels;
+}
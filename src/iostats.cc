@@ -0,0 +1,25 @@
+/* iostats.cc
+ *
+ * Implementation of helpers for querying the HDF5 library's cache statistics.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "iostats.h"
+
+namespace datafile {
+
+double metadataCacheHitRate(hid_t file)
+{
+	double rate = -1.;
+	if (H5Fget_mdc_hit_rate(file, &rate) < 0)
+		return -1.;
+	return rate;
+}
+
+void resetMetadataCacheStats(hid_t file)
+{
+	H5Freset_mdc_hit_rate_stats(file);
+}
+
+} // end datafile namespace
@@ -0,0 +1,64 @@
+/* latencyhistogram.cc
+ *
+ * Implementation of log-bucketed latency histograms.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace datafile {
+
+uint64_t LatencyHistogram::bucketUpperBound(int index)
+{
+	if (index < SubBucketCount)
+		return static_cast<uint64_t>(index);
+	int shift = index / SubBucketCount - 1;
+	uint64_t sub = static_cast<uint64_t>(index % SubBucketCount);
+	uint64_t lower = (static_cast<uint64_t>(SubBucketCount) + sub) << shift;
+	return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+	auto total = count();
+	if (total == 0)
+		return 0;
+	q = std::min(std::max(q, 0.0), 1.0);
+	auto target = std::max(static_cast<uint64_t>(1),
+			static_cast<uint64_t>(std::ceil(q * total)));
+	uint64_t seen = 0;
+	for (int i = 0; i < BucketCount; i++) {
+		seen += m_counts[i].load(std::memory_order_relaxed);
+		if (seen >= target)
+			return std::min(bucketUpperBound(i), max());
+	}
+	return max();
+}
+
+LatencySummary LatencyHistogram::summary() const
+{
+	LatencySummary s;
+	s.count = count();
+	s.p50 = percentile(0.5);
+	s.p99 = percentile(0.99);
+	s.p999 = percentile(0.999);
+	s.max = max();
+	s.mean = (s.count == 0) ? 0. :
+		static_cast<double>(m_sum.load(std::memory_order_relaxed)) / s.count;
+	return s;
+}
+
+void LatencyHistogram::reset()
+{
+	for (auto& c : m_counts)
+		c.store(0, std::memory_order_relaxed);
+	m_count.store(0, std::memory_order_relaxed);
+	m_sum.store(0, std::memory_order_relaxed);
+	m_max.store(0, std::memory_order_relaxed);
+}
+
+} // end datafile namespace
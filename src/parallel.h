@@ -0,0 +1,48 @@
+/* parallel.h
+ *
+ * Internal helpers for dividing work among threads.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <armadillo>
+
+namespace datafile {
+
+/* Return the number of threads to use, where 0 requests one per core */
+inline unsigned int threadCount(unsigned int nthreads)
+{
+	return nthreads ? nthreads : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/* Run the function on each index in [0, n), dividing them among threads.
+ * The calling thread is one of them.
+ */
+template<class Function>
+void parallelFor(arma::uword n, unsigned int nthreads, Function f)
+{
+	nthreads = static_cast<unsigned int>(std::min<arma::uword>(threadCount(nthreads), n));
+	std::atomic<arma::uword> next(0);
+	auto worker = [&]() {
+		for (arma::uword i = next++; i < n; i = next++)
+			f(i);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < nthreads; t++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& t : threads)
+		t.join();
+}
+
+} // end datafile namespace
+
+#endif
@@ -0,0 +1,272 @@
+/* quality.cc
+ *
+ * Implementation of the scan of a DataFile for bad channels.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "datafile.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace datafile {
+
+namespace {
+
+/* The statistics of one block of one channel. Runs of identical samples
+ * are kept at either end of the block, so that runs spanning blocks can
+ * be joined when blocks are combined.
+ */
+struct BlockStats {
+	double sum = 0., sumSquares = 0.;
+	arma::uword saturated = 0;
+	arma::uword longest = 0, lead = 0, tail = 0;
+	float first = 0., last = 0.;
+};
+
+/* Return the limits of the values of an integer type, or infinities
+ * for other types, which never saturate.
+ */
+std::pair<double, double> typeLimits(const H5::DataType& type)
+{
+	if (type.getClass() != H5T_INTEGER) {
+		return std::make_pair(-std::numeric_limits<double>::infinity(),
+				std::numeric_limits<double>::infinity());
+	}
+	H5::IntType intType(type.getId());
+	const double bits = 8. * intType.getSize();
+	if (intType.getSign() == H5T_SGN_NONE)
+		return std::make_pair(0., std::pow(2., bits) - 1.);
+	return std::make_pair(-std::pow(2., bits - 1.), std::pow(2., bits - 1.) - 1.);
+}
+
+} // end anonymous namespace
+
+ChannelQuality DataFile::scanChannels(const ChannelScanOptions& options)
+{
+	DATAFILE_TRACE_SCOPE("DataFile::scanChannels", "datafile");
+	const int nchan = nchannels();
+	const unsigned int nthreads = threadCount(options.nthreads);
+
+	/* Collect each pair of neighboring channels once */
+	std::vector<std::pair<arma::uword, arma::uword> > pairs;
+	if (options.neighbors.is_empty()) {
+		for (int c = 1; c < nchan; c++)
+			pairs.emplace_back(c - 1, c);
+	} else {
+		if (options.neighbors.n_cols != static_cast<arma::uword>(nchan))
+			throw std::logic_error("Neighbors must be given for each channel");
+		for (arma::uword c = 0; c < options.neighbors.n_cols; c++) {
+			for (arma::uword k = 0; k < options.neighbors.n_rows; k++) {
+				const arma::uword other = options.neighbors(k, c);
+				if (other >= static_cast<arma::uword>(nchan)) {
+					throw std::logic_error("Neighbor " + std::to_string(other) +
+							" is not in range [0, " + std::to_string(nchan) + ")");
+				}
+				if (other != c)
+					pairs.emplace_back(std::min(c, other), std::max(c, other));
+			}
+		}
+		std::sort(pairs.begin(), pairs.end());
+		pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+	}
+
+	const sample_index n = (options.seconds > 0.) ?
+		std::min<sample_index>(std::lround(options.seconds * sampleRate()), nsamples()) :
+		nsamples();
+	const auto limits = typeLimits(m_datatype);
+	flushStaged();
+
+	/* Sums are of samples less the first sample of each channel, which
+	 * keeps them from losing precision to large offsets.
+	 */
+	std::vector<float> shift(nchan, 0.);
+	std::vector<double> sum(nchan, 0.), sumSquares(nchan, 0.), products(pairs.size(), 0.);
+	std::vector<arma::uword> saturated(nchan, 0), longest(nchan, 0), run(nchan, 0);
+	std::vector<float> last(nchan, 0.);
+	const sample_index nblocks = (n + BlockSize - 1) / BlockSize;
+	auto range = [&](sample_index block) {
+		const sample_index start = block * BlockSize;
+		return std::make_pair(start, std::min<sample_index>(start + BlockSize, n));
+	};
+	auto scanBatch = [&](sample_index firstBlock, std::vector<PooledMatrix<float> >& raw) {
+		const sample_index nbatch = raw.size();
+		if (firstBlock == 0) {
+			for (int c = 0; c < nchan; c++)
+				shift[c] = (*raw[0])(0, c);
+		}
+
+		std::vector<std::vector<BlockStats> > stats(nbatch,
+				std::vector<BlockStats>(nchan));
+		std::vector<std::vector<double> > blockProducts(nbatch,
+				std::vector<double>(pairs.size(), 0.));
+		{
+			DATAFILE_TRACE_SCOPE("DataFile::scan", "datafile");
+			parallelFor(nbatch, nthreads, [&](arma::uword b) {
+					const arma::uword count = raw[b]->n_rows;
+					for (int c = 0; c < nchan; c++) {
+						const float* x = raw[b]->colptr(c);
+						BlockStats& s = stats[b][c];
+						s.first = x[0];
+						s.last = x[count - 1];
+						arma::uword current = 1;
+						for (arma::uword i = 0; i < count; i++) {
+							const double v = x[i] - shift[c];
+							s.sum += v;
+							s.sumSquares += v * v;
+							s.saturated += (x[i] <= limits.first) || (x[i] >= limits.second);
+							if ( (i > 0) && (x[i] == x[i - 1]) ) {
+								current++;
+							} else {
+								if (i > 0)
+									s.longest = std::max(s.longest, current);
+								if ( (i > 0) && (s.lead == 0) )
+									s.lead = current;
+								current = 1;
+							}
+						}
+						s.longest = std::max(s.longest, current);
+						s.tail = current;
+						if (s.lead == 0)
+							s.lead = count;
+					}
+					for (size_t p = 0; p < pairs.size(); p++) {
+						const float* x = raw[b]->colptr(pairs[p].first);
+						const float* y = raw[b]->colptr(pairs[p].second);
+						const float sx = shift[pairs[p].first], sy = shift[pairs[p].second];
+						double total = 0.;
+						for (arma::uword i = 0; i < count; i++)
+							total += static_cast<double>(x[i] - sx) * (y[i] - sy);
+						blockProducts[b][p] = total;
+					}
+				});
+		}
+
+		/* Combine blocks in order, joining runs which span them */
+		for (sample_index b = 0; b < nbatch; b++) {
+			const arma::uword count = raw[b]->n_rows;
+			for (int c = 0; c < nchan; c++) {
+				const BlockStats& s = stats[b][c];
+				sum[c] += s.sum;
+				sumSquares[c] += s.sumSquares;
+				saturated[c] += s.saturated;
+				if ( (run[c] > 0) && (s.first == last[c]) ) {
+					if (s.lead == count) {
+						run[c] += count;
+					} else {
+						longest[c] = std::max(longest[c], run[c] + s.lead);
+						run[c] = s.tail;
+					}
+				} else {
+					run[c] = s.tail;
+				}
+				longest[c] = std::max({ longest[c], s.longest, run[c] });
+				last[c] = s.last;
+			}
+			for (size_t p = 0; p < pairs.size(); p++)
+				products[p] += blockProducts[b][p];
+		}
+	};
+	readBatches(nblocks, nthreads, range, scanBatch);
+
+	ChannelQuality quality;
+	quality.rms.zeros(nchan);
+	quality.saturation.zeros(nchan);
+	quality.flatRun.zeros(nchan);
+	quality.correlation.zeros(nchan);
+	quality.good.ones(nchan);
+	if (n == 0) {
+		setChannelMask(quality.good);
+		return quality;
+	}
+	std::vector<double> variance(nchan);
+	for (int c = 0; c < nchan; c++) {
+		const double mean = sum[c] / n;
+		variance[c] = std::max(sumSquares[c] / n - mean * mean, 0.);
+		quality.rms(c) = std::sqrt(variance[c]);
+		quality.saturation(c) = static_cast<double>(saturated[c]) / n;
+		quality.flatRun(c) = longest[c];
+	}
+	for (size_t p = 0; p < pairs.size(); p++) {
+		const arma::uword i = pairs[p].first, j = pairs[p].second;
+		if ( (variance[i] == 0.) || (variance[j] == 0.) )
+			continue;
+		const double covariance = products[p] / n - (sum[i] / n) * (sum[j] / n);
+		const double r = covariance / std::sqrt(variance[i] * variance[j]);
+		quality.correlation(i) = std::max(quality.correlation(i), r);
+		quality.correlation(j) = std::max(quality.correlation(j), r);
+	}
+
+	std::vector<double> sorted(quality.rms.memptr(), quality.rms.memptr() + nchan);
+	std::nth_element(sorted.begin(), sorted.begin() + nchan / 2, sorted.end());
+	const double median = sorted[nchan / 2];
+	const double maxFlat = options.maxFlatSeconds * sampleRate();
+	for (int c = 0; c < nchan; c++) {
+		const bool bad = (quality.rms(c) < options.minRms * median) ||
+			(quality.rms(c) > options.maxRms * median) ||
+			(quality.saturation(c) > options.maxSaturation) ||
+			(quality.flatRun(c) > maxFlat) ||
+			(quality.correlation(c) > options.maxCorrelation);
+		quality.good(c) = !bad;
+	}
+	setChannelMask(quality.good);
+	return quality;
+}
+
+void DataFile::setChannelMask(const arma::uvec& good)
+{
+	if (good.n_elem != static_cast<arma::uword>(nchannels())) {
+		throw std::logic_error("Channel mask has " + std::to_string(good.n_elem) +
+				" elements, but the file has " + std::to_string(nchannels()) + " channels");
+	}
+	const char name[] = "channel-quality";
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute, good.n_elem);
+	if (m_dataset.attrExists(name)) {
+		m_dataset.removeAttr(name);
+	}
+	std::vector<uint8_t> mask(good.n_elem);
+	for (arma::uword c = 0; c < good.n_elem; c++)
+		mask[c] = (good(c) != 0);
+	hsize_t dims[1] = { static_cast<hsize_t>(good.n_elem) };
+	auto space = H5::DataSpace(1, dims);
+	auto attr = m_dataset.createAttribute(name, H5::PredType::STD_U8LE, space);
+	attr.write(H5::PredType::NATIVE_UINT8, mask.data());
+	attr.close();
+}
+
+arma::uvec DataFile::channelMask() const
+{
+	arma::uvec good(nchannels(), arma::fill::ones);
+	DATAFILE_TRACE_SCOPE("DataFile::attribute", "datafile");
+	IoTimer timer(m_stats, IoAttribute);
+	if (!m_dataset.attrExists("channel-quality"))
+		return good;
+	auto attr = m_dataset.openAttribute("channel-quality");
+	std::vector<uint8_t> mask(good.n_elem);
+	attr.read(H5::PredType::NATIVE_UINT8, mask.data());
+	attr.close();
+	for (arma::uword c = 0; c < good.n_elem; c++)
+		good(c) = mask[c];
+	return good;
+}
+
+arma::uvec DataFile::goodChannels() const
+{
+	auto mask = channelMask();
+	std::vector<arma::uword> channels;
+	for (arma::uword c = 0; c < mask.n_elem; c++) {
+		if (mask(c))
+			channels.push_back(c);
+	}
+	return arma::uvec(channels);
+}
+
+} // end datafile namespace
+
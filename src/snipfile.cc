@@ -7,16 +7,35 @@
  */
 
 #include <sys/stat.h>
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <stdexcept>
 #include <typeinfo>
+#include <vector>
 
 #include "snipfile.h"
 
+snipfile::StorageOptions snipfile::StorageOptions::compressed()
+{
+	StorageOptions options;
+	options.chunkSnippets = DEFAULT_CHUNK_SNIPPETS;
+	options.compression = DEFLATE;
+	options.deltaIndices = true;
+	return options;
+}
+
 snipfile::SnipFile::SnipFile(std::string fname, const datafile::DataFile& source, 
-		const size_t nbefore, const size_t nafter)
+		const size_t nbefore, const size_t nafter, const StorageOptions& options)
 	: samplesBefore_(-nbefore),
-	samplesAfter_(nafter)
+	samplesAfter_(nafter),
+	storage_(options),
+	writable_(true)
 {
+	DATAFILE_TRACE_SCOPE("SnipFile::create", "snipfile");
 	filename_ = fname;
 	struct stat buf;
 	if (stat(filename_.c_str(), &buf) == 0) {
@@ -30,9 +49,11 @@ snipfile::SnipFile::SnipFile(std::string fname, const datafile::DataFile& source
 	writeAttributes();
 }
 
-snipfile::SnipFile::SnipFile(std::string fname) 
+snipfile::SnipFile::SnipFile(std::string fname, bool writable)
+	: writable_(writable)
 {
 	/* open existing snippet file */
+	DATAFILE_TRACE_SCOPE("SnipFile::open", "snipfile");
 	filename_ = fname;
 	struct stat buf;
 	if (stat(filename_.c_str(), &buf) != 0) {
@@ -40,7 +61,7 @@ snipfile::SnipFile::SnipFile(std::string fname)
 		throw std::invalid_argument("Snippet file does not exist");
 	}
 
-	file = H5::H5File(filename_, H5F_ACC_RDONLY);
+	file = H5::H5File(filename_, writable ? H5F_ACC_RDWR : H5F_ACC_RDONLY);
 	readAttributes();
 	readChannels();
 	readThresholds();
@@ -48,6 +69,7 @@ snipfile::SnipFile::SnipFile(std::string fname)
 
 snipfile::SnipFile::~SnipFile()
 {
+	DATAFILE_TRACE_SCOPE("SnipFile::close", "snipfile");
 	file.close();
 }
 
@@ -87,6 +109,8 @@ void snipfile::SnipFile::getSourceInfo(const datafile::DataFile& source)
 	gain_ = source.gain();
 	offset_ = source.offset();
 	dstType = source.dtype();
+	if (storage_.skipBadChannels)
+		channelMask_ = source.channelMask();
 }
 
 std::string snipfile::SnipFile::array() { return array_; }
@@ -102,11 +126,20 @@ arma::vec snipfile::SnipFile::thresholds() { return thresholds_; }
 
 void snipfile::SnipFile::setChannels(const arma::uvec& channels)
 {
-	channels_ = channels;
-	nchannels_ = channels.n_elem;
+	if (channelMask_.is_empty()) {
+		channels_ = channels;
+	} else {
+		std::vector<arma::uword> good;
+		for (auto c : channels) {
+			if ( (c >= channelMask_.n_elem) || channelMask_(c) )
+				good.push_back(c);
+		}
+		channels_ = arma::uvec(good);
+	}
+	nchannels_ = channels_.n_elem;
 	if (channelGroups.size() == 0) {
 		std::string buf(32, '\0');
-		for (auto& c : channels) {
+		for (auto& c : channels_) {
 			buf.clear();
 			std::snprintf(&buf[0], buf.capacity(), "channel-%03llu", c);
 			channelGroups.push_back(file.createGroup(buf.c_str()));
@@ -144,23 +177,382 @@ void snipfile::SnipFile::writeSnips(const std::string& type,
 		hsize_t snipDims[snipfile::SNIP_DATASET_RANK] = {
 				snips.at(i).n_cols, snips.at(i).n_rows};
 		H5::DataSpace snipSpace(snipfile::SNIP_DATASET_RANK, snipDims);
-		H5::DataSet snipSet = grp.createDataSet(type + "-snippets", dstType,
-				snipSpace);
+		H5::DataSet snipSet = grp.createDataSet(type + "-snippets", snippetType(),
+				snipSpace, datasetProperties(snipDims[0], snipDims[1], true));
 		H5::DataSet idxSet = grp.createDataSet(type + "-idx", H5::PredType::STD_U64LE,
-				idxSpace);
-		spikeDatasets.push_back(snipSet);
-		spikeIdxDatasets.push_back(idxSet);
+				idxSpace, datasetProperties(idxDims[0], 1, false));
+
+		/* Sorted spike indices are much smaller as differences, which
+		 * are marked by an attribute so that readers can undo them. The
+		 * first index of each chunk is kept whole, so that a chunk can be
+		 * decoded without those before it.
+		 */
+		const bool delta = storage_.deltaIndices && (type == "spike");
+		const hsize_t interval = storage_.chunkSnippets ?
+				storage_.chunkSnippets : snipfile::DEFAULT_CHUNK_SNIPPETS;
+		if (delta) {
+			H5::StrType strType(0, 5);
+			auto attr = idxSet.createAttribute("encoding", strType, H5::DataSpace(H5S_SCALAR));
+			attr.write(strType, "delta");
+			idxSet.createAttribute("checkpoint-interval", H5::PredType::STD_U64LE,
+					H5::DataSpace(H5S_SCALAR)).write(H5::PredType::NATIVE_HSIZE, &interval);
+		}
+		if (type == "spike") {
+			spikeDatasets.push_back(snipSet);
+			spikeIdxDatasets.push_back(idxSet);
+		} else {
+			noiseDatasets.push_back(snipSet);
+			noiseIdxDatasets.push_back(idxSet);
+		}
+
+		/* Keep the new datasets for later reads from this object */
+		auto& handles = channelHandles_[channels_(i)];
+		handles.exists = true;
+		handles.group = grp;
+		auto& datasets = (type == "spike") ? handles.spike : handles.noise;
+		datasets.opened = true;
+		datasets.idx = idxSet;
+		datasets.snips = snipSet;
+		datasets.nsnips = snipDims[0];
+		datasets.snipSize = snipDims[1];
+		datasets.deltaIndices = delta;
+		datasets.checkpointInterval = delta ? interval : 0;
+
+		/* Compute differences of the indices, modulo 2^64 so that any
+		 * order of indices is restored exactly.
+		 */
+		const arma::uword* idxData = idx.at(i).memptr();
+		datafile::PooledBuffer deltas;
+		if (delta && idx.at(i).n_elem) {
+			deltas = datafile::PooledBuffer(pool_, idx.at(i).n_elem * sizeof(arma::uword));
+			auto dst = static_cast<arma::uword*>(deltas.data());
+			for (arma::uword j = 0; j < idx.at(i).n_elem; j++)
+				dst[j] = (j % interval == 0) ? idxData[j] : idxData[j] - idxData[j - 1];
+			idxData = dst;
+		}
 
 		/* Write the datasets */
+		DATAFILE_TRACE_SCOPE("SnipFile::write", "snipfile");
+		datafile::IoTimer timer(stats_, datafile::IoWrite,
+				snips.at(i).n_elem * sizeof(short) + idx.at(i).n_elem * sizeof(arma::uword));
 		//snipSet.write(snips.at(i).memptr(), dstType);
 		snipSet.write(snips.at(i).memptr(), H5::PredType::STD_I16LE);
-		idxSet.write(idx.at(i).memptr(), H5::PredType::STD_U64LE);
+		idxSet.write(idxData, H5::PredType::STD_U64LE);
+		if (type == "spike")
+			writeFeatures(grp, snips.at(i));
+	}
+}
+
+namespace {
+
+/* Compute the peak, trough and width of each snippet, stored in the
+ * columns of the matrix.
+ */
+void computeFeatures(const arma::Mat<short>& snips, arma::Col<short>& peak,
+		arma::Col<short>& trough, arma::Col<uint16_t>& width)
+{
+	peak.set_size(snips.n_cols);
+	trough.set_size(snips.n_cols);
+	width.set_size(snips.n_cols);
+	for (arma::uword i = 0; i < snips.n_cols; i++) {
+		const short* s = snips.colptr(i);
+		arma::uword lo = 0, hi = 0;
+		for (arma::uword j = 1; j < snips.n_rows; j++) {
+			if (s[j] < s[lo])
+				lo = j;
+			if (s[j] > s[hi])
+				hi = j;
+		}
+		arma::uword after = lo;
+		for (arma::uword j = lo + 1; j < snips.n_rows; j++) {
+			if (s[j] > s[after])
+				after = j;
+		}
+		peak(i) = snips.n_rows ? s[hi] : 0;
+		trough(i) = snips.n_rows ? s[lo] : 0;
+		width(i) = static_cast<uint16_t>(after - lo);
+	}
+}
+
+/* Return true if the row of a delta-encoded index holds the index itself
+ * rather than its difference from the row before.
+ */
+inline bool isCheckpoint(hsize_t row, hsize_t interval)
+{
+	return (row == 0) || (interval && (row % interval == 0));
+}
+
+/* Select the given sorted rows of a one- or two-dimensional dataspace,
+ * with one hyperslab for each run of consecutive rows.
+ */
+void selectRows(H5::DataSpace& space, const arma::uvec& rows)
+{
+	hsize_t dims[2] = {0, 1};
+	space.getSimpleExtentDims(dims);
+	space.selectNone();
+	for (arma::uword start = 0; start < rows.n_elem; ) {
+		arma::uword end = start + 1;
+		while ( (end < rows.n_elem) && (rows(end) == rows(end - 1) + 1) )
+			end++;
+		hsize_t offset[2] = {rows(start), 0};
+		hsize_t count[2] = {end - start, dims[1]};
+		space.selectHyperslab(H5S_SELECT_OR, count, offset);
+		start = end;
+	}
+}
+
+/* Write the whole of a one-dimensional, extendible dataset in the group,
+ * creating it or changing its size as needed. Labels and unit rows
+ * compress well, so they are always shuffled and deflated.
+ */
+void writeVector(H5::Group& grp, const std::string& name,
+		const H5::DataType& fileType, const H5::DataType& memType,
+		const void* data, hsize_t n, int deflateLevel)
+{
+	hsize_t dims[1] = {n};
+	H5::DataSet dset;
+	if (grp.nameExists(name)) {
+		dset = grp.openDataSet(name);
+		dset.extend(dims);
+	} else {
+		hsize_t maxDims[1] = {H5S_UNLIMITED};
+		hsize_t chunkDims[1] = {snipfile::DEFAULT_CHUNK_SNIPPETS};
+		H5::DSetCreatPropList props;
+		props.setChunk(1, chunkDims);
+		props.setShuffle();
+		props.setDeflate(deflateLevel);
+		dset = grp.createDataSet(name, fileType, H5::DataSpace(1, dims, maxDims), props);
+	}
+	if (n)
+		dset.write(data, memType);
+}
+
+/* Return the amplitude of a snippet from its peak and trough */
+inline int amplitude(short peak, short trough)
+{
+	return std::max(std::abs(static_cast<int>(peak)),
+			std::abs(static_cast<int>(trough)));
+}
+
+/* Return the rows of snippets sorted by increasing amplitude, and the
+ * amplitude of each in that order. Ties are kept in the order of the rows.
+ */
+arma::uvec amplitudeOrder(const arma::Col<short>& peak, const arma::Col<short>& trough,
+		arma::Col<uint16_t>& amplitudes)
+{
+	arma::uvec order(peak.n_elem);
+	for (arma::uword i = 0; i < order.n_elem; i++)
+		order(i) = i;
+	std::stable_sort(order.begin(), order.end(),
+			[&](arma::uword a, arma::uword b) {
+				return amplitude(peak(a), trough(a)) < amplitude(peak(b), trough(b));
+			});
+	amplitudes.set_size(order.n_elem);
+	for (arma::uword i = 0; i < order.n_elem; i++)
+		amplitudes(i) = amplitude(peak(order(i)), trough(order(i)));
+	return order;
+}
+
+}; // end anonymous namespace
+
+void snipfile::SnipFile::writeFeatures(H5::Group& grp, const arma::Mat<short>& snips)
+{
+	DATAFILE_TRACE_SCOPE("SnipFile::writeFeatures", "snipfile");
+	arma::Col<short> peak, trough;
+	arma::Col<uint16_t> width;
+	computeFeatures(snips, peak, trough, width);
+	arma::Col<uint16_t> amplitudes;
+	arma::uvec order = amplitudeOrder(peak, trough, amplitudes);
+
+	hsize_t dims[snipfile::IDX_DATASET_RANK] = {snips.n_cols};
+	H5::DataSpace space(snipfile::IDX_DATASET_RANK, dims);
+	auto props = datasetProperties(dims[0], 1, false);
+	datafile::IoTimer timer(stats_, datafile::IoWrite, snips.n_cols *
+			(2 * sizeof(short) + 2 * sizeof(uint16_t) + sizeof(arma::uword)));
+	grp.createDataSet("spike-peak", H5::PredType::STD_I16LE, space, props).write(
+			peak.memptr(), H5::PredType::NATIVE_SHORT);
+	grp.createDataSet("spike-trough", H5::PredType::STD_I16LE, space, props).write(
+			trough.memptr(), H5::PredType::NATIVE_SHORT);
+	grp.createDataSet("spike-width", H5::PredType::STD_U16LE, space, props).write(
+			width.memptr(), H5::PredType::NATIVE_UINT16);
+	grp.createDataSet("spike-amplitudes", H5::PredType::STD_U16LE, space, props).write(
+			amplitudes.memptr(), H5::PredType::NATIVE_UINT16);
+	grp.createDataSet("spike-amplitude-order", H5::PredType::STD_U64LE, space, props).write(
+			order.memptr(), H5::PredType::STD_U64LE);
+}
+
+void snipfile::SnipFile::spikeFeatures(arma::uword channel, arma::Col<short>& peak,
+		arma::Col<short>& trough, arma::Col<uint16_t>& width)
+{
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		return;
+	auto& grp = channelHandles(channel)->group;
+	if (!grp.nameExists("spike-peak")) {
+		arma::uvec idx;
+		arma::Mat<short> snippets;
+		snips("spike", channel, idx, snippets);
+		computeFeatures(snippets, peak, trough, width);
+		return;
 	}
+
+	DATAFILE_TRACE_SCOPE("SnipFile::readFeatures", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoRead, datasets->nsnips *
+			(2 * sizeof(short) + sizeof(uint16_t)));
+	peak.set_size(datasets->nsnips);
+	trough.set_size(datasets->nsnips);
+	width.set_size(datasets->nsnips);
+	grp.openDataSet("spike-peak").read(peak.memptr(), H5::PredType::NATIVE_SHORT);
+	grp.openDataSet("spike-trough").read(trough.memptr(), H5::PredType::NATIVE_SHORT);
+	grp.openDataSet("spike-width").read(width.memptr(), H5::PredType::NATIVE_UINT16);
+}
+
+void snipfile::SnipFile::spikeSnipsAbove(arma::uword channel, double minAmplitude,
+		arma::uvec& idx, arma::Mat<short>& snippets)
+{
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		return;
+	const hsize_t nsnips = datasets->nsnips;
+	auto& grp = channelHandles(channel)->group;
+	arma::uvec rows;
+	if (grp.nameExists("spike-amplitudes")) {
+		/* Amplitudes increase along the index, so the selected snippets
+		 * are a suffix of it. Its start is found by a binary search over
+		 * whole chunks of the amplitudes, each read and decompressed once,
+		 * and only the suffix of the order is read.
+		 */
+		DATAFILE_TRACE_SCOPE("SnipFile::searchAmplitudes", "snipfile");
+		auto amplitudes = grp.openDataSet("spike-amplitudes");
+		auto space = amplitudes.getSpace();
+		hsize_t block = snipfile::DEFAULT_CHUNK_SNIPPETS;
+		auto props = amplitudes.getCreatePlist();
+		if (props.getLayout() == H5D_CHUNKED)
+			props.getChunk(1, &block);
+		std::vector<uint16_t> values(block);
+		auto below = [minAmplitude](uint16_t value) { return value < minAmplitude; };
+
+		/* Find the first block whose last amplitude is selected, which
+		 * holds the first selected amplitude.
+		 */
+		hsize_t first = nsnips, low = 0, high = (nsnips + block - 1) / block;
+		while (low < high) {
+			const hsize_t middle = low + (high - low) / 2;
+			hsize_t offset[1] = {middle * block};
+			hsize_t count[1] = {std::min(block, nsnips - offset[0])};
+			space.selectHyperslab(H5S_SELECT_SET, count, offset);
+			H5::DataSpace memSpace(1, count);
+			{
+				datafile::IoTimer timer(stats_, datafile::IoRead, count[0] * sizeof(uint16_t));
+				amplitudes.read(values.data(), H5::PredType::NATIVE_UINT16, memSpace, space);
+			}
+			if (below(values[count[0] - 1])) {
+				low = middle + 1;
+			} else {
+				high = middle;
+				first = offset[0] + (std::partition_point(values.begin(),
+						values.begin() + count[0], below) - values.begin());
+			}
+		}
+		rows.set_size(nsnips - first);
+		if (rows.n_elem) {
+			auto orderSet = grp.openDataSet("spike-amplitude-order");
+			auto orderSpace = orderSet.getSpace();
+			hsize_t offset[1] = {first};
+			hsize_t count[1] = {rows.n_elem};
+			orderSpace.selectHyperslab(H5S_SELECT_SET, count, offset);
+			H5::DataSpace memSpace(1, count);
+			datafile::IoTimer timer(stats_, datafile::IoRead, rows.n_elem * sizeof(arma::uword));
+			orderSet.read(rows.memptr(), H5::PredType::STD_U64LE, memSpace, orderSpace);
+		}
+	} else {
+		/* Files without the index are searched by their features */
+		arma::Col<short> peak, trough;
+		if (grp.nameExists("spike-peak")) {
+			peak.set_size(nsnips);
+			trough.set_size(nsnips);
+			datafile::IoTimer timer(stats_, datafile::IoRead, nsnips * 2 * sizeof(short));
+			grp.openDataSet("spike-peak").read(peak.memptr(), H5::PredType::NATIVE_SHORT);
+			grp.openDataSet("spike-trough").read(trough.memptr(), H5::PredType::NATIVE_SHORT);
+		} else {
+			arma::Col<uint16_t> width;
+			spikeFeatures(channel, peak, trough, width);
+		}
+		std::vector<arma::uword> selected;
+		for (arma::uword i = 0; i < peak.n_elem; i++) {
+			if (amplitude(peak(i), trough(i)) >= minAmplitude)
+				selected.push_back(i);
+		}
+		rows = arma::uvec(selected);
+	}
+	std::sort(rows.begin(), rows.end());
+
+	idx.set_size(rows.n_elem);
+	snippets.set_size(datasets->snipSize, rows.n_elem);
+	readSnipRows(*datasets, rows, idx.memptr(), snippets.memptr());
+}
+
+H5::DSetCreatPropList snipfile::SnipFile::datasetProperties(hsize_t nsnips,
+		hsize_t snipSize, bool snippets, hsize_t nchannels) const
+{
+	H5::DSetCreatPropList props;
+	hsize_t chunkSnippets = storage_.chunkSnippets;
+	if ( (storage_.compression != NO_COMPRESSION) && (chunkSnippets == 0) )
+		chunkSnippets = DEFAULT_CHUNK_SNIPPETS;
+
+	/* Chunks may not be larger than these fixed-size datasets, so empty
+	 * datasets are always contiguous.
+	 */
+	if ( (chunkSnippets == 0) || (nsnips == 0) || (snipSize == 0) )
+		return props;
+	if (snippets && nchannels) {
+		hsize_t chunkDims[3] = {std::min(chunkSnippets, nsnips), nchannels, snipSize};
+		props.setChunk(3, chunkDims);
+	} else if (snippets) {
+		hsize_t chunkDims[snipfile::SNIP_DATASET_RANK] = {
+				std::min(chunkSnippets, nsnips), snipSize};
+		props.setChunk(snipfile::SNIP_DATASET_RANK, chunkDims);
+	} else {
+		hsize_t chunkDims[snipfile::IDX_DATASET_RANK] = {
+				std::min(chunkSnippets, nsnips)};
+		props.setChunk(snipfile::IDX_DATASET_RANK, chunkDims);
+	}
+
+	switch (storage_.compression) {
+		case DEFLATE:
+			if (storage_.shuffle)
+				props.setShuffle();
+			props.setDeflate(storage_.deflateLevel);
+			break;
+		case NBIT:
+			if (snippets)
+				props.setNbit();
+			break;
+		case SCALE_OFFSET:
+			/* Not wrapped by the C++ API */
+			H5Pset_scaleoffset(props.getId(), H5Z_SO_INT, H5Z_SO_INT_MINBITS_DEFAULT);
+			break;
+		case NO_COMPRESSION:
+			break;
+	}
+	return props;
+}
+
+H5::DataType snipfile::SnipFile::snippetType() const
+{
+	if ( (storage_.compression != NBIT) || (storage_.nbits == 0) )
+		return dstType;
+	H5::IntType type;
+	type.copy(dstType);
+	type.setPrecision(storage_.nbits);
+	return type;
 }
 
 void snipfile::SnipFile::writeFileStringAttr(const std::string& name,
 		const std::string& value)
 {
+	DATAFILE_TRACE_SCOPE("SnipFile::attribute", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoAttribute);
 	H5::StrType type(0, value.length());
 	H5::DataSpace space(H5S_SCALAR);
 	file.createAttribute(name, type, space);
@@ -171,6 +563,8 @@ void snipfile::SnipFile::writeFileStringAttr(const std::string& name,
 void snipfile::SnipFile::writeFileAttr(const std::string& name,
 		const H5::DataType& dtype, const void* buf)
 {
+	DATAFILE_TRACE_SCOPE("SnipFile::attribute", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoAttribute);
 	H5::DataType type(dtype);
 	H5::DataSpace space(H5S_SCALAR);
 	file.createAttribute(name, type, space);
@@ -192,6 +586,8 @@ void snipfile::SnipFile::readFileStringAttr(const std::string& name,
 void snipfile::SnipFile::readFileAttr(const std::string& name,
 		void *buf)
 {
+	DATAFILE_TRACE_SCOPE("SnipFile::attribute", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoAttribute);
 	auto attr = file.openAttribute(name);
 	attr.read(attr.getDataType(), buf);
 }
@@ -206,6 +602,8 @@ void snipfile::SnipFile::writeChannels(const arma::uvec& channels)
 	writeFileAttr("nchannels", type, &channels.n_elem);
 	hsize_t dims[1] = {channels.n_elem};
 	H5::DataSpace space(1, dims);
+	datafile::IoTimer timer(stats_, datafile::IoWrite,
+			channels.n_elem * sizeof(arma::uword));
 	H5::DataSet set = file.createDataSet("extracted-channels", type, space);
 	set.write(channels.memptr(), type);
 }
@@ -225,6 +623,8 @@ void snipfile::SnipFile::readChannels()
 	auto memspace = H5::DataSpace(1, dims);
 	memspace.selectHyperslab(H5S_SELECT_SET, spaceCount, spaceOffset);
 	channels_.set_size(dims[0]);
+	datafile::IoTimer timer(stats_, datafile::IoRead,
+			channels_.n_elem * sizeof(arma::uword));
 	chanSet.read(channels_.memptr(), H5::PredType::STD_U64LE, memspace, chanSpace);
 }
 
@@ -233,6 +633,8 @@ void snipfile::SnipFile::writeThresholds(const arma::vec& thresholds)
 	H5::DataType type(H5::PredType::IEEE_F64LE);
 	hsize_t dims[1] = {thresholds.n_elem};
 	H5::DataSpace space(1, dims);
+	datafile::IoTimer timer(stats_, datafile::IoWrite,
+			thresholds.n_elem * sizeof(double));
 	H5::DataSet set = file.createDataSet("thresholds", type, space);
 	set.write(thresholds.memptr(), type);
 }
@@ -250,6 +652,8 @@ void snipfile::SnipFile::readThresholds()
 	auto memspace = H5::DataSpace(1, dims);
 	memspace.selectHyperslab(H5S_SELECT_SET, spaceCount, spaceOffset);
 	thresholds_.set_size(dims[0]);
+	datafile::IoTimer timer(stats_, datafile::IoRead,
+			thresholds_.n_elem * sizeof(double));
 	threshSet.read(thresholds_.memptr(), H5::PredType::IEEE_F64LE, memspace, threshSpace);
 }
 
@@ -280,37 +684,82 @@ void snipfile::SnipFile::noiseSnips(arma::uword channel, arma::uvec& idx,
 void snipfile::SnipFile::spikeSnips(arma::uword channel, arma::uvec& idx, 
 		arma::mat& snippets)
 {
-	arma::Mat<short> tmp;
-	snips("spike", channel, idx, tmp);
-	snippets = arma::conv_to<arma::mat>::from(tmp) * gain();
+	voltageSnips("spike", channel, idx, snippets, 0.);
 }
 
 void snipfile::SnipFile::noiseSnips(arma::uword channel, arma::uvec& idx, 
 		arma::mat& snippets)
 {
-	arma::Mat<short> tmp;
-	snips("noise", channel, idx, tmp);
-	snippets = arma::conv_to<arma::mat>::from(tmp) * gain();
+	voltageSnips("noise", channel, idx, snippets, 0.);
 }
 
 void snipfile::SnipFile::spikeSnips(std::vector<arma::uvec>& idx,
 		std::vector<arma::mat>& snippets)
 {
-	std::vector<arma::Mat<short> > tmp;
-	spikeSnips(idx, tmp);
-	snippets.resize(tmp.size());
-	for (decltype(tmp.size()) i = 0; i < tmp.size(); i++)
-		snippets[i] = gain() * arma::conv_to<arma::mat>::from(tmp[i]) + offset();
+	snippets.resize(nchannels());
+	idx.resize(nchannels());
+	for (decltype(nchannels()) c = 0; c < nchannels(); c++)
+		voltageSnips("spike", channels_(c), idx.at(c), snippets.at(c), offset());
 }
 
 void snipfile::SnipFile::noiseSnips(std::vector<arma::uvec>& idx,
 		std::vector<arma::mat>& snippets)
 {
-	std::vector<arma::Mat<short> > tmp;
-	noiseSnips(idx, tmp);
-	snippets.resize(tmp.size());
-	for (decltype(tmp.size()) i = 0; i < tmp.size(); i++)
-		snippets[i] = gain() * arma::conv_to<arma::mat>::from(tmp[i]) + offset();
+	snippets.resize(nchannels());
+	idx.resize(nchannels());
+	for (decltype(nchannels()) c = 0; c < nchannels(); c++)
+		voltageSnips("noise", channels_(c), idx.at(c), snippets.at(c), offset());
+}
+
+void snipfile::SnipFile::spikeSnips(arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<short>& snippets, datafile::BufferPool& pool)
+{
+	snips("spike", channel, idx, snippets, pool);
+}
+
+void snipfile::SnipFile::spikeSnips(arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<double>& snippets, datafile::BufferPool& pool)
+{
+	snips("spike", channel, idx, snippets, pool);
+}
+
+void snipfile::SnipFile::noiseSnips(arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<short>& snippets, datafile::BufferPool& pool)
+{
+	snips("noise", channel, idx, snippets, pool);
+}
+
+void snipfile::SnipFile::noiseSnips(arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<double>& snippets, datafile::BufferPool& pool)
+{
+	snips("noise", channel, idx, snippets, pool);
+}
+
+void snipfile::SnipFile::voltageSnips(const std::string& type, arma::uword channel,
+		arma::uvec& idx, arma::mat& snippets, float offset)
+{
+	auto datasets = openSnips(type, channel);
+	if (!datasets)
+		return;
+
+	/* Raw snippets are read into a pooled buffer and converted in place */
+	const hsize_t nsnips = datasets->nsnips, snipSize = datasets->snipSize;
+	idx.set_size(nsnips);
+	datafile::PooledBuffer raw(pool_, nsnips * snipSize * sizeof(short));
+	const short* src = static_cast<const short*>(raw.data());
+	readSnips(*datasets, idx.memptr(), static_cast<short*>(raw.data()));
+	DATAFILE_TRACE_SCOPE("SnipFile::convert", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoConvert,
+			nsnips * snipSize * sizeof(double));
+	snippets.set_size(snipSize, nsnips);
+	const double g = gain();
+	double* dst = snippets.memptr();
+	for (arma::uword i = 0; i < snippets.n_elem; i++)
+		dst[i] = g * src[i] + offset;
 }
 
 void snipfile::SnipFile::snips(const std::string& type, 
@@ -326,44 +775,659 @@ void snipfile::SnipFile::snips(const std::string& type,
 void snipfile::SnipFile::snips(const std::string& type, arma::uword channel,
 		arma::uvec& idx, arma::Mat<short>& snippets) {
 
+	auto datasets = openSnips(type, channel);
+	if (!datasets)
+		return;
+	idx.set_size(datasets->nsnips);
+	snippets.set_size(datasets->snipSize, datasets->nsnips);
+	readSnips(*datasets, idx.memptr(), snippets.memptr());
+}
+
+void snipfile::SnipFile::snips(const std::string& type, arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<short>& snippets, datafile::BufferPool& pool)
+{
+	auto datasets = openSnips(type, channel);
+	if (!datasets)
+		return;
+	idx = datafile::PooledMatrix<arma::uword>(pool, datasets->nsnips, 1);
+	snippets = datafile::PooledMatrix<short>(pool, datasets->snipSize, datasets->nsnips);
+	readSnips(*datasets, idx->memptr(), snippets->memptr());
+}
+
+void snipfile::SnipFile::snips(const std::string& type, arma::uword channel,
+		datafile::PooledMatrix<arma::uword>& idx,
+		datafile::PooledMatrix<double>& snippets, datafile::BufferPool& pool)
+{
+	datafile::PooledMatrix<short> raw;
+	snips(type, channel, idx, raw, pool);
+	DATAFILE_TRACE_SCOPE("SnipFile::convert", "snipfile");
+	datafile::IoTimer timer(stats_, datafile::IoConvert,
+			raw->n_elem * sizeof(double));
+	snippets = datafile::PooledMatrix<double>(pool, raw->n_rows, raw->n_cols);
+	const double g = gain();
+	const short* src = raw->memptr();
+	double* dst = snippets->memptr();
+	for (arma::uword i = 0; i < raw->n_elem; i++)
+		dst[i] = g * src[i];
+}
+
+snipfile::SnipFile::ChannelHandles* snipfile::SnipFile::channelHandles(arma::uword channel)
+{
+	auto it = channelHandles_.find(channel);
+	if (it != channelHandles_.end())
+		return it->second.exists ? &it->second : nullptr;
+
+	/* Open the group on first use. Missing groups are remembered too,
+	 * so that they are only reported once.
+	 */
+	auto& handles = channelHandles_[channel];
 	std::string grpName(64, '\0');
-	std::snprintf(&grpName[0], grpName.capacity(), "channel-%03llu", channel);
-	H5::Group grp;
+	grpName.resize(std::snprintf(&grpName[0], grpName.capacity(),
+				"channel-%03llu", channel));
 	try {
-		grp = file.openGroup(grpName);
-	} catch (H5::GroupIException &e) {
+		handles.group = file.openGroup(grpName);
+	} catch (H5::Exception &e) {
 		std::cerr << "Channel group does not exist: " << grpName << std::endl;
-		return;
+		return nullptr;
 	}
-	
+	handles.exists = true;
+	return &handles;
+}
+
+const snipfile::SnipFile::SnipDatasets* snipfile::SnipFile::openSnips(
+		const std::string& type, arma::uword channel)
+{
+	auto handles = channelHandles(channel);
+	if (!handles)
+		return nullptr;
+	auto& datasets = (type == "spike") ? handles->spike : handles->noise;
+	if (!datasets.opened) {
+		datasets.idx = handles->group.openDataSet(type + "-idx");
+		hsize_t idxDims[1] = {0};
+		datasets.idx.getSpace().getSimpleExtentDims(idxDims);
+		datasets.nsnips = idxDims[0];
+
+		if (datasets.idx.attrExists("encoding")) {
+			auto attr = datasets.idx.openAttribute("encoding");
+			std::string encoding;
+			attr.read(attr.getStrType(), encoding);
+			datasets.deltaIndices = (encoding == "delta");
+		}
+		if (datasets.idx.attrExists("checkpoint-interval")) {
+			datasets.idx.openAttribute("checkpoint-interval").read(
+					H5::PredType::NATIVE_HSIZE, &datasets.checkpointInterval);
+		}
+
+		datasets.snips = handles->group.openDataSet(type + "-snippets");
+		hsize_t snipDims[2] = {0, 0};
+		datasets.snips.getSpace().getSimpleExtentDims(snipDims);
+		datasets.snipSize = snipDims[1];
+		datasets.opened = true;
+	}
+	return &datasets;
+}
+
+void snipfile::SnipFile::readSnips(const SnipDatasets& datasets,
+		arma::uword* idx, short* snippets)
+{
+	DATAFILE_TRACE_SCOPE("SnipFile::readChannel", "snipfile");
+	const auto& idxSet = datasets.idx;
+	const auto& snipSet = datasets.snips;
+	const hsize_t nsnips = datasets.nsnips, snipSize = datasets.snipSize;
+
 	/* Read indices */
-	auto tmpIdxSet = grp.openDataSet(type + "-idx");
-	auto idxSpace = tmpIdxSet.getSpace();
-	hsize_t idxDims[1] = {0};
-	idxSpace.getSimpleExtentDims(idxDims);
-	hsize_t nsnips = idxDims[0];
+	auto idxSpace = idxSet.getSpace();
+	hsize_t idxDims[1] = {nsnips};
 	hsize_t spaceOffset[1] = {0};
 	hsize_t spaceCount[1] = {nsnips};
 	idxSpace.selectHyperslab(H5S_SELECT_SET, spaceCount, spaceOffset);
 	
 	auto idxMemSpace = H5::DataSpace(1, idxDims);
 	idxMemSpace.selectHyperslab(H5S_SELECT_SET, spaceCount, spaceOffset);
-	idx.set_size(nsnips);
-	tmpIdxSet.read(idx.memptr(), H5::PredType::STD_U64LE, idxSpace, idxMemSpace);
+	{
+		datafile::IoTimer idxTimer(stats_, datafile::IoRead, nsnips * sizeof(arma::uword));
+		idxSet.read(idx, H5::PredType::STD_U64LE, idxSpace, idxMemSpace);
+	}
+	if (datasets.deltaIndices) {
+		for (hsize_t i = 1; i < nsnips; i++) {
+			if (!isCheckpoint(i, datasets.checkpointInterval))
+				idx[i] += idx[i - 1];
+		}
+	}
 	
 	/* Read snippets */
-	auto tmpSnipSet = grp.openDataSet(type + "-snippets");
-	auto snipSpace = tmpSnipSet.getSpace();
-	hsize_t snipDims[2] = {0, 0};
-	snipSpace.getSimpleExtentDims(snipDims);
-	hsize_t snipCount[2] = {nsnips, snipDims[1]};
+	if (!snippets)
+		return;
+	auto snipSpace = snipSet.getSpace();
+	hsize_t snipDims[2] = {nsnips, snipSize};
+	hsize_t snipCount[2] = {nsnips, snipSize};
 	hsize_t snipOffset[2] = {0, 0};
 	snipSpace.selectHyperslab(H5S_SELECT_SET, snipCount, snipOffset);
 
 	auto snipMemSpace = H5::DataSpace(2, snipDims);
 	snipMemSpace.selectHyperslab(H5S_SELECT_SET, snipCount, snipOffset);
-	snippets.set_size(snipDims[1], nsnips);
-	tmpSnipSet.read(snippets.memptr(), H5::PredType::STD_I16LE, snipSpace, snipMemSpace);
+	datafile::IoTimer snipTimer(stats_, datafile::IoRead, nsnips * snipSize * sizeof(short));
+	snipSet.read(snippets, H5::PredType::STD_I16LE, snipSpace, snipMemSpace);
+}
+
+snipfile::SnipFile::ChannelLabels* snipfile::SnipFile::channelLabels(
+		arma::uword channel, bool write)
+{
+	if (write && !writable_)
+		throw std::logic_error("Snippet file is read-only: " + filename_);
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		return nullptr;
+	auto& handles = *channelHandles(channel);
+	auto& labels = handles.labels;
+	if (labels.loaded)
+		return &labels;
+	labels.loaded = true;
+	auto& grp = handles.group;
+	if (!grp.nameExists("spike-labels"))
+		return &labels;
+
+	DATAFILE_TRACE_SCOPE("SnipFile::readLabels", "snipfile");
+	labels.labels.set_size(datasets->nsnips);
+	datafile::IoTimer timer(stats_, datafile::IoRead, 2 * datasets->nsnips * sizeof(int64_t));
+	if (datasets->nsnips)
+		grp.openDataSet("spike-labels").read(labels.labels.memptr(), H5::PredType::STD_I64LE);
+
+	/* Each unit's rows are stored as differences, named by its label */
+	auto units = grp.openGroup("units");
+	for (hsize_t k = 0; k < units.getNumObjs(); k++) {
+		auto name = units.getObjnameByIdx(k);
+		auto dset = units.openDataSet(name);
+		hsize_t n = 0;
+		dset.getSpace().getSimpleExtentDims(&n);
+		arma::uvec rows(n);
+		if (n)
+			dset.read(rows.memptr(), H5::PredType::STD_U64LE);
+		for (arma::uword i = 1; i < rows.n_elem; i++)
+			rows(i) += rows(i - 1);
+		labels.units[std::stoll(name)] = std::move(rows);
+	}
+	return &labels;
+}
+
+void snipfile::SnipFile::setLabels(arma::uword channel, const arma::ivec& newLabels)
+{
+	auto labels = channelLabels(channel, true);
+	if (!labels)
+		throw std::logic_error("Channel has no spike snippets");
+	if (newLabels.n_elem != openSnips("spike", channel)->nsnips)
+		throw std::logic_error("Number of labels does not match the number of snippets");
+
+	/* Count the rows of each unit, then fill them in increasing order */
+	labels->labels = newLabels;
+	labels->units.clear();
+	std::map<arma::sword, arma::uword> counts;
+	for (arma::uword i = 0; i < newLabels.n_elem; i++)
+		counts[newLabels(i)]++;
+	for (auto& c : counts) {
+		labels->units[c.first].set_size(c.second);
+		c.second = 0;
+	}
+	for (arma::uword i = 0; i < newLabels.n_elem; i++)
+		labels->units[newLabels(i)](counts[newLabels(i)]++) = i;
+
+	writeLabels(channel, nullptr);
+	writeUnits(channel, nullptr);
+}
+
+void snipfile::SnipFile::relabel(arma::uword channel, arma::sword from, arma::sword to)
+{
+	auto labels = channelLabels(channel, true);
+	if (!labels || labels->labels.is_empty())
+		throw std::logic_error("Channel has no labels");
+	auto it = labels->units.find(from);
+	if ( (it == labels->units.end()) || (from == to) )
+		return;
+
+	arma::uvec rows = std::move(it->second);
+	labels->units.erase(it);
+	for (auto row : rows)
+		labels->labels(row) = to;
+	auto& target = labels->units[to];
+	arma::uvec merged(target.n_elem + rows.n_elem);
+	std::merge(target.begin(), target.end(), rows.begin(), rows.end(), merged.begin());
+	target = std::move(merged);
+
+	writeLabels(channel, &rows);
+	std::vector<arma::sword> changedUnits = { from, to };
+	writeUnits(channel, &changedUnits);
+}
+
+void snipfile::SnipFile::relabel(arma::uword channel, const arma::uvec& rows,
+		arma::sword label)
+{
+	auto labels = channelLabels(channel, true);
+	if (!labels || labels->labels.is_empty())
+		throw std::logic_error("Channel has no labels");
+
+	/* Find the rows whose label changes, grouped by their old label.
+	 * Visiting them in order keeps each group sorted.
+	 */
+	std::vector<arma::uword> sorted(rows.begin(), rows.end());
+	std::sort(sorted.begin(), sorted.end());
+	sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+	if (!sorted.empty() && (sorted.back() >= labels->labels.n_elem))
+		throw std::logic_error("Row is outside the range of snippets");
+	std::map<arma::sword, std::vector<arma::uword> > moved;
+	std::vector<arma::uword> changed;
+	for (auto row : sorted) {
+		if (labels->labels(row) != label) {
+			moved[labels->labels(row)].push_back(row);
+			changed.push_back(row);
+		}
+	}
+	if (changed.empty())
+		return;
+
+	/* Remove the rows from their old units, and merge them into the new one */
+	for (auto& m : moved) {
+		auto& old = labels->units[m.first];
+		std::vector<arma::uword> remaining;
+		remaining.reserve(old.n_elem - m.second.size());
+		std::set_difference(old.begin(), old.end(), m.second.begin(), m.second.end(),
+				std::back_inserter(remaining));
+		if (remaining.empty())
+			labels->units.erase(m.first);
+		else
+			old = arma::uvec(remaining);
+	}
+	auto& target = labels->units[label];
+	arma::uvec merged(target.n_elem + changed.size());
+	std::merge(target.begin(), target.end(), changed.begin(), changed.end(), merged.begin());
+	target = std::move(merged);
+
+	arma::uvec changedRows(changed);
+	for (auto row : changedRows)
+		labels->labels(row) = label;
+	writeLabels(channel, &changedRows);
+	std::vector<arma::sword> changedUnits;
+	for (auto& m : moved)
+		changedUnits.push_back(m.first);
+	changedUnits.push_back(label);
+	writeUnits(channel, &changedUnits);
+}
+
+arma::ivec snipfile::SnipFile::labels(arma::uword channel)
+{
+	auto labels = channelLabels(channel);
+	return labels ? labels->labels : arma::ivec();
+}
+
+arma::ivec snipfile::SnipFile::units(arma::uword channel)
+{
+	auto labels = channelLabels(channel);
+	if (!labels)
+		return arma::ivec();
+	arma::ivec ids(labels->units.size());
+	arma::uword k = 0;
+	for (auto& u : labels->units)
+		ids(k++) = u.first;
+	return ids;
+}
+
+arma::uvec snipfile::SnipFile::unitRows(arma::uword channel, arma::sword unit)
+{
+	auto labels = channelLabels(channel);
+	if (!labels)
+		return arma::uvec();
+	auto it = labels->units.find(unit);
+	return (it == labels->units.end()) ? arma::uvec() : it->second;
+}
+
+void snipfile::SnipFile::unitSnips(arma::uword channel, arma::sword unit,
+		arma::uvec& idx, arma::Mat<short>& snippets)
+{
+	auto rows = unitRows(channel, unit);
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		return;
+	idx.set_size(rows.n_elem);
+	snippets.set_size(datasets->snipSize, rows.n_elem);
+	readSnipRows(*datasets, rows, idx.memptr(), snippets.memptr());
+}
+
+arma::uvec snipfile::SnipFile::spikeIdx(arma::uword channel)
+{
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		return arma::uvec();
+	arma::uvec idx(datasets->nsnips);
+	if (datasets->nsnips)
+		readSnips(*datasets, idx.memptr(), nullptr);
+	return idx;
+}
+
+arma::uvec snipfile::SnipFile::unitIdx(arma::uword channel, arma::sword unit)
+{
+	auto rows = unitRows(channel, unit);
+	auto datasets = openSnips("spike", channel);
+	if (!datasets || rows.is_empty())
+		return arma::uvec();
+	arma::uvec idx(rows.n_elem);
+	readSnipRows(*datasets, rows, idx.memptr(), nullptr);
+	return idx;
+}
+
+void snipfile::SnipFile::writeLabels(arma::uword channel, const arma::uvec* rows)
+{
+	DATAFILE_TRACE_SCOPE("SnipFile::writeLabels", "snipfile");
+	auto& handles = *channelHandles(channel);
+	auto& grp = handles.group;
+	const auto& labels = handles.labels.labels;
+	if (!rows || !grp.nameExists("spike-labels")) {
+		datafile::IoTimer timer(stats_, datafile::IoWrite, labels.n_elem * sizeof(int64_t));
+		writeVector(grp, "spike-labels", H5::PredType::STD_I64LE,
+				H5::PredType::STD_I64LE, labels.memptr(), labels.n_elem,
+				storage_.deflateLevel);
+		return;
+	}
+	if (rows->is_empty())
+		return;
+
+	/* Write only the changed rows, one hyperslab per run */
+	arma::ivec values(rows->n_elem);
+	for (arma::uword i = 0; i < rows->n_elem; i++)
+		values(i) = labels((*rows)(i));
+	auto dset = grp.openDataSet("spike-labels");
+	auto space = dset.getSpace();
+	selectRows(space, *rows);
+	hsize_t dims[1] = {rows->n_elem};
+	H5::DataSpace memSpace(1, dims);
+	datafile::IoTimer timer(stats_, datafile::IoWrite, rows->n_elem * sizeof(int64_t));
+	dset.write(values.memptr(), H5::PredType::STD_I64LE, memSpace, space);
+}
+
+void snipfile::SnipFile::writeUnits(arma::uword channel,
+		const std::vector<arma::sword>* changed)
+{
+	DATAFILE_TRACE_SCOPE("SnipFile::writeUnits", "snipfile");
+	auto& handles = *channelHandles(channel);
+	auto& grp = handles.group;
+	const auto& units = handles.labels.units;
+	std::vector<arma::sword> all;
+	if (!changed || !grp.nameExists("units")) {
+		if (grp.nameExists("units"))
+			grp.unlink("units");
+		grp.createGroup("units");
+		for (auto& u : units)
+			all.push_back(u.first);
+		changed = &all;
+	}
+
+	/* Replace the dataset of each changed unit, or remove it if the
+	 * unit no longer has any rows.
+	 */
+	auto unitGroup = grp.openGroup("units");
+	for (auto id : *changed) {
+		auto name = std::to_string(id);
+		auto it = units.find(id);
+		if (it == units.end()) {
+			if (unitGroup.nameExists(name))
+				unitGroup.unlink(name);
+			continue;
+		}
+		const auto& rows = it->second;
+		arma::uvec deltas(rows.n_elem);
+		arma::uword previous = 0;
+		for (arma::uword i = 0; i < rows.n_elem; i++) {
+			deltas(i) = rows(i) - previous;
+			previous = rows(i);
+		}
+		datafile::IoTimer timer(stats_, datafile::IoWrite, deltas.n_elem * sizeof(uint64_t));
+		writeVector(unitGroup, name, H5::PredType::STD_U64LE, H5::PredType::STD_U64LE,
+				deltas.memptr(), deltas.n_elem, storage_.deflateLevel);
+	}
+}
+
+void snipfile::SnipFile::alignSpikes(const alignment::Options& options)
+{
+	if (!writable_)
+		throw std::logic_error("Snippet file is read-only: " + filename_);
+	DATAFILE_TRACE_SCOPE("SnipFile::align", "snipfile");
+	const int peak = -nsamplesBefore();	// stored negated
+	arma::mat interp;
+	for (auto channel : channels_) {
+		auto datasets = openSnips("spike", channel);
+		if (!datasets)
+			continue;
+		const hsize_t nsnips = datasets->nsnips, snipSize = datasets->snipSize;
+		if (interp.n_cols != snipSize)
+			interp = alignment::interpolationMatrix(snipSize, options.kernel, options.factor);
+		arma::uvec idx(nsnips);
+		if (nsnips)
+			readSnips(*datasets, idx.memptr(), nullptr);
+
+		/* Create the datasets, or overwrite them if spikes were aligned before */
+		auto& grp = channelHandles(channel)->group;
+		hsize_t timeDims[1] = {nsnips};
+		auto timeSet = grp.nameExists("spike-times") ? grp.openDataSet("spike-times") :
+				grp.createDataSet("spike-times", H5::PredType::IEEE_F64LE,
+						H5::DataSpace(1, timeDims), datasetProperties(nsnips, 1, false));
+		H5::DataSet alignedSet;
+		if (options.storeSnippets) {
+			/* Aligned snippets are stored like the originals, which may be
+			 * from a file opened rather than created here.
+			 */
+			alignedSet = grp.nameExists("aligned-snippets") ? grp.openDataSet("aligned-snippets") :
+					grp.createDataSet("aligned-snippets", datasets->snips.getDataType(),
+							datasets->snips.getSpace(), datasets->snips.getCreatePlist());
+		}
+
+		const hsize_t batch = std::max<hsize_t>(options.batchSnippets, 1);
+		for (hsize_t first = 0; first < nsnips; first += batch) {
+			const hsize_t count = std::min(batch, nsnips - first);
+			arma::uvec rows(count);
+			for (hsize_t i = 0; i < count; i++)
+				rows(i) = first + i;
+			arma::Mat<short> snippets(snipSize, count);
+			readSnipRows(*datasets, rows, nullptr, snippets.memptr());
+
+			arma::mat upsampled;
+			arma::vec offsets;
+			{
+				DATAFILE_TRACE_SCOPE("SnipFile::upsample", "snipfile");
+				datafile::IoTimer timer(stats_, datafile::IoConvert,
+						interp.n_rows * count * sizeof(double));
+				upsampled = alignment::upsample(interp, snippets);
+				offsets = alignment::peakOffsets(upsampled, options, peak);
+			}
+			arma::vec times(count);
+			for (hsize_t i = 0; i < count; i++)
+				times(i) = idx(first + i) + offsets(i);
+
+			hsize_t offset[2] = {first, 0};
+			hsize_t timeCount[1] = {count};
+			auto timeSpace = timeSet.getSpace();
+			timeSpace.selectHyperslab(H5S_SELECT_SET, timeCount, offset);
+			{
+				datafile::IoTimer timer(stats_, datafile::IoWrite, count * sizeof(double));
+				timeSet.write(times.memptr(), H5::PredType::NATIVE_DOUBLE,
+						H5::DataSpace(1, timeCount), timeSpace);
+			}
+			if (options.storeSnippets) {
+				auto aligned = alignment::alignSnippets(upsampled, offsets,
+						options.factor, snipSize);
+				hsize_t snipCount[2] = {count, snipSize};
+				auto snipSpace = alignedSet.getSpace();
+				snipSpace.selectHyperslab(H5S_SELECT_SET, snipCount, offset);
+				datafile::IoTimer timer(stats_, datafile::IoWrite,
+						count * snipSize * sizeof(short));
+				alignedSet.write(aligned.memptr(), H5::PredType::STD_I16LE,
+						H5::DataSpace(2, snipCount), snipSpace);
+			}
+		}
+	}
+}
+
+arma::vec snipfile::SnipFile::spikeTimes(arma::uword channel)
+{
+	auto handles = channelHandles(channel);
+	if (!handles || !handles->group.nameExists("spike-times"))
+		return arma::vec();
+	auto timeSet = handles->group.openDataSet("spike-times");
+	hsize_t dims[1] = {0};
+	timeSet.getSpace().getSimpleExtentDims(dims);
+	arma::vec times(dims[0]);
+	datafile::IoTimer timer(stats_, datafile::IoRead, times.n_elem * sizeof(double));
+	if (dims[0])
+		timeSet.read(times.memptr(), H5::PredType::NATIVE_DOUBLE);
+	return times;
+}
+
+void snipfile::SnipFile::alignedSnips(arma::uword channel, arma::uvec& idx,
+		arma::Mat<short>& snippets)
+{
+	auto datasets = openSnips("spike", channel);
+	if (!datasets || !channelHandles(channel)->group.nameExists("aligned-snippets"))
+		return;
+
+	/* The aligned snippets have the same shape and indices as the
+	 * spike snippets, so they are read with the same handles.
+	 */
+	SnipDatasets aligned = *datasets;
+	aligned.snips = channelHandles(channel)->group.openDataSet("aligned-snippets");
+	idx.set_size(aligned.nsnips);
+	snippets.set_size(aligned.snipSize, aligned.nsnips);
+	readSnips(aligned, idx.memptr(), snippets.memptr());
+}
+
+arma::mat snipfile::SnipFile::clusterSpikes(arma::uword channel,
+		const clustering::Options& options)
+{
+	if (!writable_)
+		throw std::logic_error("Snippet file is read-only: " + filename_);
+	auto datasets = openSnips("spike", channel);
+	if (!datasets)
+		throw std::logic_error("Channel has no spike snippets");
+	DATAFILE_TRACE_SCOPE("SnipFile::cluster", "snipfile");
+	const hsize_t nsnips = datasets->nsnips, snipSize = datasets->snipSize;
+	const hsize_t batch = std::min<hsize_t>(std::max<size_t>(options.batchSize, 1), nsnips);
+
+	/* Read a batch of rows, and convert the snippets to points */
+	auto readBatch = [&](const arma::uvec& rows) {
+		arma::Mat<short> snippets(snipSize, rows.n_elem);
+		readSnipRows(*datasets, rows, nullptr, snippets.memptr());
+		datafile::IoTimer timer(stats_, datafile::IoConvert, snippets.n_elem * sizeof(double));
+		return arma::conv_to<arma::mat>::from(snippets);
+	};
+
+	/* Fit the centers to batches of random rows. Rows are sorted, so
+	 * that runs of consecutive rows are read together.
+	 */
+	clustering::MiniBatchKMeans kmeans(options);
+	std::mt19937_64 rng(options.seed);
+	std::uniform_int_distribution<arma::uword> row(0, nsnips ? nsnips - 1 : 0);
+	for (size_t i = 0; (i < options.iterations) && (batch > 0); i++) {
+		std::vector<arma::uword> sample(batch);
+		if (batch == nsnips) {
+			std::iota(sample.begin(), sample.end(), 0);
+		} else {
+			std::generate(sample.begin(), sample.end(), [&]() { return row(rng); });
+			std::sort(sample.begin(), sample.end());
+			sample.erase(std::unique(sample.begin(), sample.end()), sample.end());
+		}
+		kmeans.update(readBatch(arma::uvec(sample)));
+	}
+	if (!kmeans.initialized()) {
+		throw std::logic_error("Cannot cluster " + std::to_string(nsnips) +
+				" snippets into " + std::to_string(options.nclusters) + " clusters");
+	}
+
+	/* Assign every snippet to its nearest center */
+	arma::ivec labels(nsnips);
+	for (hsize_t first = 0; first < nsnips; first += batch) {
+		const hsize_t count = std::min(batch, nsnips - first);
+		arma::uvec rows(count);
+		for (hsize_t i = 0; i < count; i++)
+			rows(i) = first + i;
+		auto assigned = kmeans.assign(readBatch(rows));
+		for (hsize_t i = 0; i < count; i++)
+			labels(first + i) = assigned(i);
+	}
+	setLabels(channel, labels);
+	return kmeans.centers();
+}
+
+void snipfile::SnipFile::readSnipRows(const SnipDatasets& datasets,
+		const arma::uvec& rows, arma::uword* idx, short* snippets)
+{
+	DATAFILE_TRACE_SCOPE("SnipFile::readRows", "snipfile");
+	const hsize_t nrows = rows.n_elem, snipSize = datasets.snipSize;
+	if (nrows == 0)
+		return;
+
+	/* Select each run of consecutive rows in the file */
+	auto idxSpace = datasets.idx.getSpace();
+	auto snipSpace = datasets.snips.getSpace();
+	selectRows(idxSpace, rows);
+	if (snippets)
+		selectRows(snipSpace, rows);
+
+	/* Delta-encoded indices are decoded from the checkpoint before
+	 * each selected row, so the rows from there on are read as well.
+	 */
+	if (!idx) {
+		/* Only snippets are requested */
+	} else if (datasets.deltaIndices) {
+		std::vector<arma::uword> needed;
+		for (auto row : rows) {
+			arma::uword first = datasets.checkpointInterval ?
+				row - row % datasets.checkpointInterval : 0;
+			if (!needed.empty())
+				first = std::max<arma::uword>(first, needed.back() + 1);
+			for (arma::uword k = first; k <= row; k++)
+				needed.push_back(k);
+		}
+		arma::uvec neededRows(needed);
+		auto neededSpace = datasets.idx.getSpace();
+		selectRows(neededSpace, neededRows);
+		hsize_t neededDims[1] = {neededRows.n_elem};
+		H5::DataSpace neededMemSpace(1, neededDims);
+		datafile::PooledBuffer buffer(pool_, neededRows.n_elem * sizeof(arma::uword));
+		auto values = static_cast<arma::uword*>(buffer.data());
+		{
+			datafile::IoTimer idxTimer(stats_, datafile::IoRead,
+					neededRows.n_elem * sizeof(arma::uword));
+			datasets.idx.read(values, H5::PredType::STD_U64LE, neededMemSpace, neededSpace);
+		}
+		for (arma::uword k = 0, i = 0; k < neededRows.n_elem; k++) {
+			if ( (k > 0) && !isCheckpoint(neededRows(k), datasets.checkpointInterval) )
+				values[k] += values[k - 1];
+			if ( (i < nrows) && (neededRows(k) == rows(i)) )
+				idx[i++] = values[k];
+		}
+	} else {
+		hsize_t idxDims[1] = {nrows};
+		H5::DataSpace idxMemSpace(1, idxDims);
+		datafile::IoTimer idxTimer(stats_, datafile::IoRead, nrows * sizeof(arma::uword));
+		datasets.idx.read(idx, H5::PredType::STD_U64LE, idxMemSpace, idxSpace);
+	}
+	if (!snippets)
+		return;
+
+	hsize_t snipDims[2] = {nrows, snipSize};
+	H5::DataSpace snipMemSpace(2, snipDims);
+	datafile::IoTimer snipTimer(stats_, datafile::IoRead, nrows * snipSize * sizeof(short));
+	datasets.snips.read(snippets, H5::PredType::STD_I16LE, snipMemSpace, snipSpace);
+}
+
+datafile::IoStats snipfile::SnipFile::stats() const
+{
+	auto s = stats_.snapshot();
+	s.metadataCacheHitRate = datafile::metadataCacheHitRate(file.getId());
+	return s;
+}
+
+void snipfile::SnipFile::resetStats()
+{
+	stats_.reset();
+	datafile::resetMetadataCacheStats(file.getId());
 }
 
 int snipfile::SnipFile::nsamplesBefore() {
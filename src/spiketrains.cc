@@ -0,0 +1,164 @@
+/* spiketrains.cc
+ *
+ * Implementation of spike train statistics.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "spiketrains.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace spiketrains {
+
+namespace {
+
+void verifySorted(const arma::uvec& train)
+{
+	for (arma::uword i = 1; i < train.n_elem; i++) {
+		if (train(i) < train(i - 1))
+			throw std::logic_error("Spike train is not sorted");
+	}
+}
+
+/* Accumulate the lags b[j] - a[i] into the bins of a correlogram.
+ *
+ * The spikes of b within the window around each spike of a are found by a
+ * single pass over both trains: as a advances, the start of the window in
+ * b only moves forward. Lags are offset by half the width of the window,
+ * so that all arithmetic is on unsigned values.
+ */
+void accumulate(const arma::uvec& a, const arma::uvec& b, bool exclude,
+		const CorrelogramOptions& options, arma::uword* bins)
+{
+	const arma::uword binSize = std::max<arma::uword>(options.binSize, 1);
+	const arma::uword nbins = correlogramBins(options);
+	const arma::uword offset = (nbins / 2) * binSize + binSize / 2;
+	const arma::uword width = nbins * binSize;
+	arma::uword start = 0;
+	for (arma::uword i = 0; i < a.n_elem; i++) {
+		const arma::uword t = a(i);
+		while ( (start < b.n_elem) && (b(start) + offset < t) )
+			start++;
+		for (arma::uword j = start; (j < b.n_elem) && (b(j) + offset < t + width); j++) {
+			if (exclude && (j == i))
+				continue;
+			bins[(b(j) + offset - t) / binSize]++;
+		}
+	}
+}
+
+/* Add the spikes of a train in the window of each trigger to the bins.
+ * The bins of trigger k start at bins + k * stride, so that trials may
+ * either be kept apart or summed into the same bins.
+ */
+void binTrain(const arma::uvec& train, const arma::uvec& triggers,
+		const PsthOptions& options, arma::uword stride, arma::uword* bins)
+{
+	const arma::uword binSize = std::max<arma::uword>(options.binSize, 1);
+	const arma::uword* first = train.memptr();
+	const arma::uword* last = first + train.n_elem;
+	for (arma::uword k = 0; k < triggers.n_elem; k++) {
+		const arma::uword t = triggers(k);
+		const arma::uword start = (t > options.before) ? t - options.before : 0;
+		arma::uword* trial = bins + k * stride;
+		for (auto s = std::lower_bound(first, last, start);
+				(s != last) && (*s < t + options.after); s++) {
+			trial[(*s + options.before - t) / binSize]++;
+		}
+	}
+}
+
+} // end anonymous namespace
+
+arma::uword correlogramBins(const CorrelogramOptions& options)
+{
+	return 2 * (options.maxLag / std::max<arma::uword>(options.binSize, 1)) + 1;
+}
+
+arma::uvec crossCorrelogram(const arma::uvec& a, const arma::uvec& b,
+		const CorrelogramOptions& options)
+{
+	verifySorted(a);
+	verifySorted(b);
+	arma::uvec bins(correlogramBins(options), arma::fill::zeros);
+	accumulate(a, b, false, options, bins.memptr());
+	return bins;
+}
+
+arma::uvec autoCorrelogram(const arma::uvec& train, const CorrelogramOptions& options)
+{
+	verifySorted(train);
+	arma::uvec bins(correlogramBins(options), arma::fill::zeros);
+	accumulate(train, train, true, options, bins.memptr());
+	return bins;
+}
+
+arma::ucube correlograms(const std::vector<arma::uvec>& trains,
+		const CorrelogramOptions& options)
+{
+	for (auto& train : trains)
+		verifySorted(train);
+	const arma::uword ntrains = trains.size();
+	const arma::uword nbins = correlogramBins(options);
+	arma::ucube out(nbins, ntrains, ntrains, arma::fill::zeros);
+
+	/* Pairs are claimed in turn, and each fills only its own tube */
+	datafile::parallelFor(ntrains * ntrains, options.nthreads, [&](arma::uword p) {
+			const arma::uword i = p % ntrains, j = p / ntrains;
+			accumulate(trains[i], trains[j], i == j, options,
+					out.memptr() + p * nbins);
+		});
+	return out;
+}
+
+IsiViolations isiViolations(const arma::uvec& train, arma::uword refractory)
+{
+	verifySorted(train);
+	IsiViolations stats;
+	stats.nspikes = train.n_elem;
+	for (arma::uword i = 1; i < train.n_elem; i++) {
+		if (train(i) - train(i - 1) < refractory)
+			stats.violations++;
+	}
+	if (train.n_elem > 1)
+		stats.rate = static_cast<double>(stats.violations) / (train.n_elem - 1);
+	return stats;
+}
+
+arma::uword psthBins(const PsthOptions& options)
+{
+	const arma::uword binSize = std::max<arma::uword>(options.binSize, 1);
+	return (options.before + options.after + binSize - 1) / binSize;
+}
+
+arma::ucube binnedTrials(const std::vector<arma::uvec>& trains,
+		const arma::uvec& triggers, const PsthOptions& options)
+{
+	for (auto& train : trains)
+		verifySorted(train);
+	const arma::uword nbins = psthBins(options);
+	arma::ucube out(nbins, triggers.n_elem, trains.size(), arma::fill::zeros);
+	datafile::parallelFor(trains.size(), options.nthreads, [&](arma::uword i) {
+			binTrain(trains[i], triggers, options, nbins, out.slice_memptr(i));
+		});
+	return out;
+}
+
+arma::umat psth(const std::vector<arma::uvec>& trains,
+		const arma::uvec& triggers, const PsthOptions& options)
+{
+	for (auto& train : trains)
+		verifySorted(train);
+	const arma::uword nbins = psthBins(options);
+	arma::umat out(nbins, trains.size(), arma::fill::zeros);
+	datafile::parallelFor(trains.size(), options.nthreads, [&](arma::uword i) {
+			binTrain(trains[i], triggers, options, 0, out.colptr(i));
+		});
+	return out;
+}
+
+} // end spiketrains namespace
+
@@ -0,0 +1,250 @@
+/* synthetic.cc
+ *
+ * Implementation of synthetic MEA recordings with known ground truth.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace synthetic {
+
+Parameters Parameters::hidens()
+{
+	Parameters p;
+	p.noiseStd = 4.;
+	p.amplitude = 40.;
+	p.baseline = 128.;
+	p.minValue = std::numeric_limits<uint8_t>::min();
+	p.maxValue = std::numeric_limits<uint8_t>::max();
+	return p;
+}
+
+int unitChannel(const Parameters& params, int unit, int nchannels)
+{
+	return static_cast<int>((static_cast<int64_t>(unit) * nchannels) /
+			std::max(params.nunits, 1)) % nchannels;
+}
+
+arma::vec spikeWaveform(float sampleRate)
+{
+	/* A sharp negative trough followed by a slower, smaller
+	 * positive repolarization, with times in milliseconds.
+	 */
+	arma::vec w(WaveformSamplesBefore + WaveformSamplesAfter + 1);
+	for (int i = 0; i < static_cast<int>(w.n_elem); i++) {
+		double t = 1000. * (i - WaveformSamplesBefore) / sampleRate;
+		w(i) = -std::exp(-0.5 * std::pow(t / 0.15, 2)) +
+			0.3 * std::exp(-0.5 * std::pow((t - 0.6) / 0.3, 2));
+	}
+	w /= -w(WaveformSamplesBefore);
+	return w;
+}
+
+GroundTruth spikeTimes(const Parameters& params, int nchannels,
+		float sampleRate, uint64_t nsamples)
+{
+	GroundTruth truth;
+	if (nsamples <= static_cast<uint64_t>(WaveformSamplesBefore + WaveformSamplesAfter))
+		return truth;
+
+	std::mt19937_64 rng(params.seed);
+	std::normal_distribution<double> normal(0., 1.);
+
+	/* Inter-spike intervals are the refractory period plus an exponential
+	 * interval, chosen so that the mean rate is the requested firing rate.
+	 */
+	double meanInterval = 1. / params.firingRate - params.refractoryPeriod;
+	std::exponential_distribution<double> interval(1. / std::max(meanInterval, 1e-6));
+	const uint64_t first = WaveformSamplesBefore;
+	const uint64_t last = nsamples - WaveformSamplesAfter;
+
+	for (int unit = 0; unit < params.nunits; unit++) {
+		int channel = unitChannel(params, unit, nchannels);
+		double t = interval(rng);
+		while (true) {
+			auto sample = first + static_cast<uint64_t>(t * sampleRate);
+			if (sample >= last)
+				break;
+			double amplitude = params.amplitude *
+				std::max(1. + params.amplitudeJitter * normal(rng), 0.1);
+			truth.push_back(Spike{ sample, channel, unit, amplitude });
+			t += params.refractoryPeriod + interval(rng);
+		}
+	}
+	std::sort(truth.begin(), truth.end(),
+			[](const Spike& a, const Spike& b) { return a.sample < b.sample; });
+	return truth;
+}
+
+arma::Mat<int16_t> generateBlock(const Parameters& params, int nchannels,
+		float sampleRate, uint64_t start, uint64_t end, const GroundTruth& truth)
+{
+	const uint64_t nsamples = end - start;
+	arma::mat block(nsamples, nchannels);
+
+	/* Stationary first-order autoregressive noise on each channel. The
+	 * stream depends only on the seed and the block's first sample.
+	 */
+	std::seed_seq seq{ params.seed, static_cast<unsigned int>(start & 0xffffffff),
+		static_cast<unsigned int>(start >> 32) };
+	std::mt19937_64 rng(seq);
+	std::normal_distribution<double> normal(0., 1.);
+	const double rho = params.noiseCorrelation;
+	const double innovation = params.noiseStd * std::sqrt(1. - rho * rho);
+	for (int c = 0; c < nchannels; c++) {
+		double* col = block.colptr(c);
+		double x = params.noiseStd * normal(rng);
+		for (uint64_t i = 0; i < nsamples; i++) {
+			x = rho * x + innovation * normal(rng);
+			col[i] = x;
+		}
+	}
+
+	/* Add every spike whose waveform overlaps the block */
+	auto waveform = spikeWaveform(sampleRate);
+	auto first = std::lower_bound(truth.begin(), truth.end(),
+			(start > static_cast<uint64_t>(WaveformSamplesAfter)) ?
+				start - WaveformSamplesAfter : 0,
+			[](const Spike& s, uint64_t sample) { return s.sample < sample; });
+	for (auto it = first; (it != truth.end()) &&
+			(it->sample < end + WaveformSamplesBefore); ++it) {
+		for (int offset = -1; offset <= 1; offset++) {
+			int channel = it->channel + offset;
+			if ( (channel < 0) || (channel >= nchannels) )
+				continue;
+			double scale = it->amplitude * ((offset == 0) ? 1. : params.neighborScale);
+			double* col = block.colptr(channel);
+			for (arma::uword k = 0; k < waveform.n_elem; k++) {
+				auto sample = it->sample + k - WaveformSamplesBefore;
+				if ( (sample >= start) && (sample < end) )
+					col[sample - start] += scale * waveform(k);
+			}
+		}
+	}
+
+	arma::Mat<int16_t> out(nsamples, nchannels);
+	const double* src = block.memptr();
+	int16_t* dst = out.memptr();
+	for (arma::uword i = 0; i < block.n_elem; i++) {
+		dst[i] = static_cast<int16_t>(std::round(std::min(std::max(
+					src[i] + params.baseline, params.minValue), params.maxValue)));
+	}
+	return out;
+}
+
+GroundTruth generate(datafile::DataFile& file, const Parameters& params)
+{
+	const int nchannels = file.nchannels();
+	const float sampleRate = file.sampleRate();
+	const uint64_t nsamples = static_cast<uint64_t>(params.seconds * sampleRate);
+	const uint64_t blockSize = std::max(params.blockSize, static_cast<uint64_t>(1));
+	const uint64_t nblocks = (nsamples + blockSize - 1) / blockSize;
+	auto truth = spikeTimes(params, nchannels, sampleRate, nsamples);
+
+	unsigned int nthreads = params.nthreads ? params.nthreads :
+		std::max(std::thread::hardware_concurrency(), 1u);
+	const uint64_t maxInFlight = 2 * nthreads;
+
+	/* Workers claim blocks in order and generate them concurrently, while
+	 * the calling thread writes finished blocks to the file in order. The
+	 * HDF5 library is only ever called from the calling thread. Workers
+	 * stop claiming blocks when too many are waiting to be written.
+	 */
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::map<uint64_t, arma::Mat<int16_t> > ready;
+	uint64_t nextBlock = 0, written = 0;
+	std::exception_ptr error;
+
+	auto worker = [&]() {
+		while (true) {
+			uint64_t block;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&]() {
+						return error || (nextBlock >= nblocks) ||
+							(nextBlock < written + maxInFlight);
+					});
+				if (error || (nextBlock >= nblocks))
+					return;
+				block = nextBlock++;
+			}
+			try {
+				uint64_t start = block * blockSize;
+				uint64_t end = std::min(start + blockSize, nsamples);
+				auto data = generateBlock(params, nchannels, sampleRate, start, end, truth);
+				std::lock_guard<std::mutex> lock(mutex);
+				ready[block] = std::move(data);
+			} catch ( ... ) {
+				std::lock_guard<std::mutex> lock(mutex);
+				error = std::current_exception();
+			}
+			cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < nthreads; i++)
+		threads.emplace_back(worker);
+
+	for (uint64_t block = 0; block < nblocks; block++) {
+		arma::Mat<int16_t> data;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]() { return error || (ready.count(block) > 0); });
+			if (error)
+				break;
+			data = std::move(ready[block]);
+			ready.erase(block);
+		}
+		std::exception_ptr failed;
+		try {
+			uint64_t start = block * blockSize;
+			file.setData(start, start + data.n_rows, data);
+		} catch ( ... ) {
+			failed = std::current_exception();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (failed)
+				error = failed;
+			written = block + 1;
+		}
+		cv.notify_all();
+		if (failed)
+			break;
+	}
+
+	for (auto& t : threads)
+		t.join();
+	if (error)
+		std::rethrow_exception(error);
+	return truth;
+}
+
+std::vector<arma::uvec> channelSpikes(const GroundTruth& truth, int nchannels)
+{
+	std::vector<arma::uword> counts(nchannels, 0);
+	for (auto& s : truth)
+		counts[s.channel]++;
+	std::vector<arma::uvec> spikes(nchannels);
+	for (int c = 0; c < nchannels; c++) {
+		spikes[c].set_size(counts[c]);
+		counts[c] = 0;
+	}
+	for (auto& s : truth)
+		spikes[s.channel](counts[s.channel]++) = s.sample;
+	return spikes;
+}
+
+} // end synthetic namespace
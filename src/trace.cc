@@ -0,0 +1,174 @@
+/* trace.cc
+ *
+ * Implementation of per-thread event buffers and Chrome trace output.
+ *
+ * (C) 2016 Benjamin Naecker bnaecker@stanford.edu
+ */
+
+#include "trace.h"
+
+#include <cstdio>
+#include <fstream>
+
+#ifdef LIBDATAFILE_TRACING
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#endif
+
+namespace datafile {
+namespace trace {
+
+#ifdef LIBDATAFILE_TRACING
+
+namespace {
+
+/* A single complete event */
+struct Event {
+	const char* name;
+	const char* category;
+	uint64_t start;
+	uint64_t duration;
+};
+
+/* Events recorded by a single thread. The mutex is only contended
+ * while a trace is being dumped or cleared.
+ */
+struct ThreadBuffer {
+	uint64_t tid;
+	std::mutex mutex;
+	std::vector<Event> events;
+};
+
+/* All thread buffers ever created. Buffers are shared with the registry
+ * so that events from threads which have exited are still dumped.
+ */
+struct Registry {
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+	uint64_t nextTid = 1;
+};
+
+/* The operating system's id for the calling thread, which is what
+ * perf and other tracers record, or 0 where it is not available.
+ */
+uint64_t osThreadId()
+{
+#if defined(__linux__)
+	return static_cast<uint64_t>(syscall(SYS_gettid));
+#elif defined(__APPLE__)
+	uint64_t tid = 0;
+	pthread_threadid_np(nullptr, &tid);
+	return tid;
+#else
+	return 0;
+#endif
+}
+
+Registry& registry()
+{
+	static Registry r;
+	return r;
+}
+
+ThreadBuffer& threadBuffer()
+{
+	thread_local std::shared_ptr<ThreadBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<ThreadBuffer>();
+		auto& r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		buffer->tid = osThreadId();
+		if (buffer->tid == 0)
+			buffer->tid = r.nextTid++;
+		r.buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+} // end anonymous namespace
+
+uint64_t now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void record(const char* name, const char* category, uint64_t start, uint64_t duration)
+{
+	auto& buffer = threadBuffer();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	buffer.events.push_back(Event{ name, category, start, duration });
+}
+
+bool enabled() { return true; }
+
+void dump(std::ostream& out)
+{
+	auto pid = static_cast<long>(getpid());
+	auto& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	bool first = true;
+	char line[512];
+	for (auto& buffer : r.buffers) {
+		std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+		for (auto& e : buffer->events) {
+			/* Chrome trace timestamps are in microseconds */
+			std::snprintf(line, sizeof(line),
+					"%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+					"\"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %llu}",
+					first ? "" : ",", e.name, e.category, e.start * 1e-3,
+					e.duration * 1e-3, pid,
+					static_cast<unsigned long long>(buffer->tid));
+			out << line;
+			first = false;
+		}
+	}
+	out << "\n]}" << std::endl;
+}
+
+void clear()
+{
+	auto& r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for (auto& buffer : r.buffers) {
+		std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+		buffer->events.clear();
+	}
+}
+
+#else
+
+bool enabled() { return false; }
+
+void dump(std::ostream& out)
+{
+	out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": []}" << std::endl;
+}
+
+void clear()
+{
+}
+
+#endif
+
+bool dump(const std::string& filename)
+{
+	std::ofstream out(filename);
+	if (!out)
+		return false;
+	dump(out);
+	return static_cast<bool>(out);
+}
+
+} // end trace namespace
+} // end datafile namespace
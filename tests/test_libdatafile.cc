@@ -7,6 +7,8 @@
 
 #include "test_libdatafile.h"
 
+#include <limits>
+#include <random>
 #include <vector>
 
 void DatafileTest::initTestCase()
@@ -370,4 +372,1086 @@ void DatafileTest::testReadWriteMeans()
 			"Channel mean values not correctly read or written.");
 }
 
+void DatafileTest::testIoStats()
+{
+	m_dataFile->resetStats();
+	auto stats = m_dataFile->stats();
+	QVERIFY2((stats.count[IoRead] == 0) && (stats.bytesRead() == 0),
+			"I/O counters not reset correctly.");
+
+	int subsetSize = 100;
+	arma::Mat<qint16> read;
+	m_dataFile->data(0, subsetSize, read);
+	stats = m_dataFile->stats();
+	QVERIFY2(stats.count[IoRead] == 1,
+			"Number of reads not recorded correctly.");
+	QVERIFY2(stats.bytesRead() == read.n_elem * sizeof(qint16),
+			"Number of bytes read not recorded correctly.");
+	QVERIFY2(stats.chunksAccessed >= 1,
+			"Number of chunks accessed by a read not recorded.");
+}
+
+void DatafileTest::testLatencyHistogram()
+{
+	/* Values below the first power of two are recorded exactly */
+	LatencyHistogram hist;
+	for (quint64 i = 1; i <= 10; i++)
+		hist.record(i);
+	QVERIFY2(hist.count() == 10, "Number of recorded latencies is incorrect.");
+	QVERIFY2(hist.percentile(0.5) == 5, "Median latency computed incorrectly.");
+	QVERIFY2(hist.max() == 10, "Maximum latency computed incorrectly.");
+
+	/* Larger values are accurate to within the width of a bucket */
+	hist.reset();
+	for (quint64 i = 1; i <= 1000; i++)
+		hist.record(i * 1000);
+	auto summary = hist.summary();
+	QVERIFY2(std::abs(static_cast<double>(summary.p99) - 990000.) < 0.07 * 990000.,
+			"99th percentile latency computed incorrectly.");
+	QVERIFY2(summary.max == 1000000, "Maximum latency computed incorrectly.");
+
+	/* Every call should exceed a deadline of 1ns */
+	QString filename = "test-latency.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+	{
+		DataFile df(filename.toStdString());
+		int nexceeded = 0;
+		df.enableLatencyRecording(1, [&](LatencyOp op, quint64 /* ns */) {
+				if (op == LatencySetData)
+					nexceeded++;
+			});
+		int subsetSize = 100;
+		for (int i = 0; i < 3; i++) {
+			df.setData(i * subsetSize, (i + 1) * subsetSize,
+					m_data.rows(i * subsetSize, (i + 1) * subsetSize - 1).eval());
+		}
+		QVERIFY2(df.latency(LatencySetData).count == 3,
+				"Latency of writes not recorded.");
+		QVERIFY2(nexceeded == 3, "Deadline callback not invoked for slow writes.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testTrace()
+{
+	datafile::trace::clear();
+	arma::Mat<qint16> read;
+	m_dataFile->data(0, 100, read);
+
+	std::stringstream out;
+	datafile::trace::dump(out);
+	auto trace = out.str();
+	QVERIFY2(trace.find("\"traceEvents\"") != std::string::npos,
+			"Trace not written in the Chrome trace event format.");
+	if (datafile::trace::enabled()) {
+		QVERIFY2(trace.find("DataFile::read") != std::string::npos,
+				"Read of data file not recorded in the trace.");
+	}
+}
+
+void DatafileTest::testSyntheticRecording()
+{
+	QString filename = "test-synthetic.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+
+	synthetic::Parameters params;
+	params.seconds = 2.;
+	params.nunits = 8;
+	params.amplitude = 300.;
+	params.blockSize = datafile::BlockSize / 2;
+	params.nthreads = 4;
+	synthetic::GroundTruth truth;
+	{
+		DataFile df(filename.toStdString());
+		df.setGain(1.);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		truth = synthetic::generate(df, params);
+		QVERIFY2(df.nsamples() == static_cast<int>(params.seconds * df.sampleRate()),
+				"Synthetic recording has the wrong number of samples.");
+	}
+	QVERIFY2(!truth.empty(), "Synthetic recording contains no spikes.");
+	for (size_t i = 1; i < truth.size(); i++) {
+		QVERIFY2(truth[i - 1].sample <= truth[i].sample,
+				"Ground truth spikes are not sorted by sample.");
+	}
+
+	/* Blocks written in parallel should match blocks generated directly */
+	DataFile df(filename.toStdString());
+	arma::Mat<qint16> read;
+	df.data(0, params.blockSize, read);
+	auto block = synthetic::generateBlock(params, df.nchannels(), df.sampleRate(),
+			0, params.blockSize, truth);
+	QVERIFY2(arma::all(arma::vectorise(read == block)),
+			"Synthetic recording is not reproducible.");
+
+	/* Each spike should be clearly visible on its primary channel */
+	for (auto& spike : truth) {
+		df.data(spike.channel, spike.channel + 1, spike.sample, spike.sample + 1, read);
+		QVERIFY2(read(0) < -spike.amplitude / 3.,
+				"Ground truth spike not present in synthetic recording.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testTypedDataFile()
+{
+	QString filename = "test-typed-datafile.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+
+	auto data = arma::conv_to<usamples>::from(m_hidensData);
+	int subsetSize = 1000;
+	{
+		UInt8DataFile df(filename.toStdString(), hidensfile::DefaultArray,
+				hidensfile::NumChannels);
+		df.setGain(0.5);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		df.setRaw(0, subsetSize, data.rows(0, subsetSize - 1).eval());
+	}
+
+	UInt8DataFile df(filename.toStdString());
+	QVERIFY2(df.dtype() == H5::PredType::STD_U8LE,
+			"Typed data file not created with the correct sample type.");
+	auto raw = df.raw(0, subsetSize);
+	QVERIFY2(arma::all(arma::vectorise(raw == data.rows(0, subsetSize - 1).eval())),
+			"Raw samples not written or read correctly from typed data file.");
+	QVERIFY2(arma::all(arma::vectorise(df.volts(0, subsetSize) == df.data(0, subsetSize))),
+			"Voltages from typed data file do not match those from DataFile.");
+	QVERIFY2(arma::all(df.volts(3, 0, subsetSize) == df.data(3, 0, subsetSize)),
+			"Single-channel voltages from typed data file do not match those from DataFile.");
+
+	Int16DataFile* tmp = nullptr;
+	QVERIFY_EXCEPTION_THROWN(tmp = new Int16DataFile(filename.toStdString()),
+			std::invalid_argument);
+	delete tmp;
+	QFile::remove(filename);
+}
+
+void DatafileTest::testLargeSampleIndices()
+{
+	QString filename = "test-large-datafile.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+
+	const sample_index start = (static_cast<sample_index>(1) << 31) + 100;
+	int subsetSize = 1000;
+	ssamples subset = m_data.rows(0, subsetSize - 1);
+	{
+		DataFile df(filename.toStdString());
+		df.setGain(1.);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		df.setData(start, start + subsetSize, subset);
+		QVERIFY2(df.nsamples() == start + subsetSize,
+				"Number of samples beyond 2^31 not stored correctly.");
+	}
+
+	DataFile df(filename.toStdString());
+	QVERIFY2(df.nsamples() == start + subsetSize,
+			"Number of samples beyond 2^31 not read correctly.");
+	ssamples read;
+	df.data(start, start + subsetSize, read);
+	QVERIFY2(arma::all(arma::vectorise(read == subset)),
+			"Data beyond 2^31 samples not written or read correctly.");
+	QVERIFY_EXCEPTION_THROWN(df.data(start, start + subsetSize + 1, read),
+			std::logic_error);
+	QFile::remove(filename);
+}
+
+void DatafileTest::testSampleMajorLayout()
+{
+	QString filename = "test-sample-major-datafile.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+
+	int subsetSize = 1000;
+	ssamples subset = m_data.rows(0, subsetSize - 1);
+	{
+		DataFile df(filename.toStdString(), DefaultArray, NumChannels,
+				H5::PredType::STD_I16LE, SampleMajor);
+		df.setGain(1.);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		df.setData(0, subsetSize, subset);
+	}
+
+	DataFile df(filename.toStdString());
+	QVERIFY2(df.layout() == SampleMajor,
+			"Layout of sample-major file not read correctly.");
+	QVERIFY2(df.nchannels() == NumChannels,
+			"Number of channels of sample-major file not read correctly.");
+	QVERIFY2(df.nsamples() == subsetSize,
+			"Number of samples of sample-major file not read correctly.");
+
+	ssamples read;
+	df.data(0, subsetSize, read);
+	QVERIFY2(arma::all(arma::vectorise(read == subset)),
+			"Data not written or read correctly from sample-major file.");
+	df.data(3, 10, 100, 500, read);
+	QVERIFY2(arma::all(arma::vectorise(read == subset.submat(100, 3, 499, 9))),
+			"Subset of channels not read correctly from sample-major file.");
+	QVERIFY2(arma::all(df.data(5, 0, subsetSize) ==
+			df.gain() * arma::conv_to<arma::vec>::from(subset.col(5))),
+			"Single channel not read correctly from sample-major file.");
+	QFile::remove(filename);
+}
+
+void DatafileTest::testWriteCombining()
+{
+	QString filename = "test-write-combining.h5";
+	if (QFile::exists(filename))
+		QFile::remove(filename);
+
+	int nsamples = 2 * BlockSize + BlockSize / 2, step = 300;
+	ssamples data(nsamples, NumChannels);
+	for (arma::uword i = 0; i < data.n_elem; i++)
+		data(i) = static_cast<int16_t>(i % 1000);
+	{
+		DataFile df(filename.toStdString());
+		QVERIFY2(df.writeCombining(), "Write-combining not enabled by default.");
+		df.setGain(1.);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		df.resetStats();
+		for (int start = 0; start < nsamples; start += step) {
+			int end = std::min(start + step, nsamples);
+			df.setData(start, end, data.rows(start, end - 1).eval());
+		}
+		QVERIFY2(df.stats().count[IoWrite] == 2,
+				"Small writes not combined into whole-chunk writes.");
+
+		ssamples read;
+		df.data(0, nsamples, read);
+		QVERIFY2(df.stats().count[IoWrite] == 3,
+				"Staged data not written before reading it.");
+		QVERIFY2(arma::all(arma::vectorise(read == data)),
+				"Data not read correctly after combining writes.");
+
+		df.setWriteCombining(false);
+		df.setData(0, step, data.rows(0, step - 1).eval());
+		QVERIFY2(df.stats().count[IoWrite] == 4,
+				"Writes staged with write-combining disabled.");
+	}
+
+	DataFile df(filename.toStdString());
+	ssamples read;
+	df.data(0, nsamples, read);
+	QVERIFY2(arma::all(arma::vectorise(read == data)),
+			"Data not written correctly with write-combining.");
+	QFile::remove(filename);
+}
+
+void DatafileTest::testBufferPool()
+{
+	BufferPool pool;
+	{
+		PooledBuffer buffer(pool, 3 * HugePageSize);
+		QVERIFY2(reinterpret_cast<uintptr_t>(buffer.data()) % HugePageSize == 0,
+				"Large pooled buffer not aligned to a huge page.");
+	}
+	for (int i = 0; i < 10; i++)
+		PooledBuffer buffer(pool, 3 * HugePageSize - i);
+	QVERIFY2((pool.allocations() == 1) && (pool.reuses() == 10),
+			"Buffers of the same size class not reused by the pool.");
+	QVERIFY_EXCEPTION_THROWN(PooledBuffer(pool, static_cast<size_t>(-1)), std::bad_alloc);
+
+	int subsetSize = 1000;
+	arma::Mat<qint16> read;
+	m_dataFile->data(0, subsetSize, read);
+	for (int i = 0; i < 3; i++) {
+		auto pooled = m_dataFile->data<qint16>(0, subsetSize, pool);
+		QVERIFY2(arma::all(arma::vectorise(*pooled == read)),
+				"Pooled read of data does not match other reads.");
+	}
+	QVERIFY2(pool.allocations() == 2,
+			"Repeated pooled reads of data allocated memory.");
+
+	arma::uvec idx;
+	arma::mat snips;
+	auto channel = m_snipFile->channels()(0);
+	m_snipFile->spikeSnips(channel, idx, snips);
+	PooledMatrix<arma::uword> pooledIdx;
+	PooledMatrix<double> pooledSnips;
+	m_snipFile->spikeSnips(channel, pooledIdx, pooledSnips, pool);
+	QVERIFY2(arma::all(pooledIdx->col(0) == idx),
+			"Pooled read of snippet indices does not match other reads.");
+	QVERIFY2(arma::all(arma::vectorise(*pooledSnips == snips)),
+			"Pooled read of snippets does not match other reads.");
+}
+
+void DatafileTest::testReadWindows()
+{
+	int before = 10, after = 20;
+	arma::uvec samples = { 5000, static_cast<arma::uword>(before),
+			static_cast<arma::uword>(BlockSize - 5), 5000, 123,
+			static_cast<arma::uword>(m_dataFile->nsamples() - after - 1) };
+	arma::uvec channels = { 7, 2, 40 };
+	arma::Cube<qint16> windows;
+	m_dataFile->readWindows(samples, before, after, channels, windows, 2);
+	QVERIFY2( (windows.n_rows == static_cast<arma::uword>(before + after + 1)) &&
+			(windows.n_cols == channels.n_elem) && (windows.n_slices == samples.n_elem),
+			"Windows read with the wrong shape.");
+	QVERIFY2(m_dataFile->cachedBufferBytes() <= PoolCachedBytes,
+			"Buffers used to gather windows were kept after the read.");
+
+	arma::Mat<qint16> read;
+	for (arma::uword i = 0; i < samples.n_elem; i++) {
+		for (arma::uword c = 0; c < channels.n_elem; c++) {
+			m_dataFile->data(channels(c), channels(c) + 1,
+					samples(i) - before, samples(i) + after + 1, read);
+			QVERIFY2(arma::all(read.col(0) == windows.slice(i).col(c)),
+					"Window does not match data read around a single event.");
+		}
+	}
+
+	arma::uvec outside = { static_cast<arma::uword>(before - 1) };
+	QVERIFY_EXCEPTION_THROWN(m_dataFile->readWindows(outside, before, after,
+				channels, windows), std::logic_error);
+}
+
+void DatafileTest::testCachedChannelReads()
+{
+	std::vector<arma::uvec> spikeIdx, noiseIdx;
+	std::vector<arma::Mat<short> > spikeSnips, noiseSnips;
+	m_snipFile->spikeSnips(spikeIdx, spikeSnips);
+	m_snipFile->noiseSnips(noiseIdx, noiseSnips);
+
+	auto channels = m_snipFile->channels();
+	arma::uvec idx;
+	arma::Mat<short> snips;
+	for (int repeat = 0; repeat < 2; repeat++) {
+		for (arma::uword i = 0; i < channels.n_elem; i++) {
+			m_snipFile->spikeSnips(channels(i), idx, snips);
+			QVERIFY2(arma::all(idx == spikeIdx[i]) &&
+					arma::all(arma::vectorise(snips == spikeSnips[i])),
+					"Repeated read of spike snippets from one channel does not match.");
+			m_snipFile->noiseSnips(channels(i), idx, snips);
+			QVERIFY2(arma::all(idx == noiseIdx[i]) &&
+					arma::all(arma::vectorise(snips == noiseSnips[i])),
+					"Repeated read of noise snippets from one channel does not match.");
+		}
+	}
+}
+
+void DatafileTest::testSnippetCompression()
+{
+	QString filename = "test-compressed.snip";
+	int nchannels = 4, nsnips = 500;
+	arma::uvec channels(nchannels);
+	std::vector<arma::uvec> idx(nchannels);
+	std::vector<arma::Mat<short> > snips(nchannels);
+	for (int c = 0; c < nchannels; c++) {
+		channels(c) = c;
+		idx[c] = arma::sort(arma::randi<arma::uvec>(nsnips, arma::distr_param(0, 1000000)));
+		snips[c] = arma::randi<arma::Mat<short> >(snipfile::NUM_SAMPLES_BEFORE +
+				snipfile::NUM_SAMPLES_AFTER + 1, nsnips, arma::distr_param(-1000, 1000));
+	}
+	idx[0].swap_rows(0, 1);
+
+	std::vector<snipfile::Compression> compressions = {
+		snipfile::NO_COMPRESSION, snipfile::DEFLATE,
+		snipfile::NBIT, snipfile::SCALE_OFFSET
+	};
+	for (auto compression : compressions) {
+		if (QFile::exists(filename)) {
+			QFile::remove(filename);
+		}
+		snipfile::StorageOptions options;
+		options.chunkSnippets = 128;
+		options.compression = compression;
+		options.nbits = 12;
+		options.deltaIndices = true;
+		{
+			SnipFile file(filename.toStdString(), *m_dataFile,
+					snipfile::NUM_SAMPLES_BEFORE, snipfile::NUM_SAMPLES_AFTER, options);
+			file.setChannels(channels);
+			file.setThresholds(arma::vec(nchannels, arma::fill::ones));
+			file.writeSpikeSnips(idx, snips);
+			file.writeNoiseSnips(idx, snips);
+		}
+
+		SnipFile file(filename.toStdString());
+		std::vector<arma::uvec> readIdx;
+		std::vector<arma::Mat<short> > readSnips;
+		file.spikeSnips(readIdx, readSnips);
+		QVERIFY2(snippetsEqual(idx, snips, readIdx, readSnips),
+				"Compressed spike snippets were not read back exactly.");
+		file.noiseSnips(readIdx, readSnips);
+		QVERIFY2(snippetsEqual(idx, snips, readIdx, readSnips),
+				"Compressed noise snippets were not read back exactly.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testAmplitudeIndex()
+{
+	QString filename = "test-amplitude.snip";
+	if (QFile::exists(filename)) {
+		QFile::remove(filename);
+	}
+	int nsnips = 1000;
+	int snipsize = snipfile::NUM_SAMPLES_BEFORE + snipfile::NUM_SAMPLES_AFTER + 1;
+	std::vector<arma::uvec> idx = { arma::regspace<arma::uvec>(0, nsnips - 1) * 100 };
+	std::vector<arma::Mat<short> > snips = {
+		arma::randi<arma::Mat<short> >(snipsize, nsnips, arma::distr_param(-100, 100))
+	};
+	snips[0].row(snipfile::NUM_SAMPLES_BEFORE) =
+		arma::randi<arma::Row<short> >(nsnips, arma::distr_param(-500, -100));
+	{
+		SnipFile file(filename.toStdString(), *m_dataFile);
+		file.setChannels(arma::uvec{ 0 });
+		file.setThresholds(arma::vec{ 1. });
+		file.writeSpikeSnips(idx, snips);
+	}
+
+	SnipFile file(filename.toStdString());
+	arma::Col<short> peak, trough;
+	arma::Col<uint16_t> width;
+	file.spikeFeatures(0, peak, trough, width);
+	QVERIFY2(arma::all(peak == arma::max(snips[0]).t()) &&
+			arma::all(trough == arma::min(snips[0]).t()),
+			"Peak or trough of spike snippets computed incorrectly.");
+
+	short minAmplitude = 300;
+	arma::uvec selected = arma::find(arma::max(arma::abs(
+					arma::conv_to<arma::imat>::from(snips[0]))).t() >= minAmplitude);
+	arma::uvec readIdx;
+	arma::Mat<short> readSnips;
+	file.spikeSnipsAbove(0, minAmplitude, readIdx, readSnips);
+	QVERIFY2( (readIdx.n_elem == selected.n_elem) &&
+			arma::all(readIdx == idx[0].elem(selected)) &&
+			arma::all(arma::vectorise(readSnips == snips[0].cols(selected))),
+			"Snippets selected by amplitude do not match.");
+	QFile::remove(filename);
+}
+
+void DatafileTest::testClusterLabels()
+{
+	QString filename = "test-labels.snip";
+	if (QFile::exists(filename)) {
+		QFile::remove(filename);
+	}
+	int nsnips = 1000;
+	int snipsize = snipfile::NUM_SAMPLES_BEFORE + snipfile::NUM_SAMPLES_AFTER + 1;
+	std::vector<arma::uvec> idx = { arma::regspace<arma::uvec>(0, nsnips - 1) * 100 };
+	std::vector<arma::Mat<short> > snips = {
+		arma::randi<arma::Mat<short> >(snipsize, nsnips, arma::distr_param(-100, 100))
+	};
+	{
+		SnipFile file(filename.toStdString(), *m_dataFile);
+		file.setChannels(arma::uvec{ 0 });
+		file.setThresholds(arma::vec{ 1. });
+		file.writeSpikeSnips(idx, snips);
+	}
+
+	arma::ivec labels = arma::randi<arma::ivec>(nsnips, arma::distr_param(0, 4));
+	{
+		SnipFile file(filename.toStdString());
+		QVERIFY_EXCEPTION_THROWN(file.setLabels(0, labels), std::logic_error);
+	}
+	{
+		SnipFile file(filename.toStdString(), true);
+		file.setLabels(0, labels);
+
+		/* Merge unit 1 into unit 2, and split some rows into a new unit */
+		file.relabel(0, 1, 2);
+		labels.elem(arma::find(labels == 1)).fill(2);
+		arma::uvec rows = arma::regspace<arma::uvec>(0, 10, nsnips - 1);
+		file.relabel(0, rows, 7);
+		labels.elem(rows).fill(7);
+	}
+
+	SnipFile file(filename.toStdString());
+	QVERIFY2(arma::all(file.labels(0) == labels),
+			"Cluster labels were written or read incorrectly.");
+	QVERIFY2(arma::all(file.units(0) == arma::ivec({ 0, 2, 3, 4, 7 })),
+			"Units were not updated after merging and splitting.");
+	for (auto unit : file.units(0)) {
+		arma::uvec expected = arma::find(labels == unit);
+		arma::uvec readIdx;
+		arma::Mat<short> readSnips;
+		file.unitSnips(0, unit, readIdx, readSnips);
+		QVERIFY2(arma::all(file.unitRows(0, unit) == expected) &&
+				arma::all(readIdx == idx[0].elem(expected)) &&
+				arma::all(arma::vectorise(readSnips == snips[0].cols(expected))),
+				"Snippets of a unit do not match its labels.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testNeighborhoodSnippets()
+{
+	QString filename = "test-neighborhoods.snip";
+	if (QFile::exists(filename)) {
+		QFile::remove(filename);
+	}
+	size_t k = 4;
+	arma::uword nbefore = hidenssnipfile::NUM_SAMPLES_BEFORE;
+	arma::uword nafter = hidenssnipfile::NUM_SAMPLES_AFTER;
+	arma::uvec channels = { 0, 5, 9 };
+	std::vector<arma::uvec> idx(channels.n_elem);
+	for (arma::uword c = 0; c < channels.n_elem; c++) {
+		idx[c] = arma::regspace<arma::uvec>(nbefore + c, 997,
+				m_hidensData.n_rows - nafter - 1);
+	}
+	{
+		HidensSnipFile file(filename.toStdString(), *m_hidensFile);
+		file.setChannels(channels);
+		file.setThresholds(arma::vec(channels.n_elem, arma::fill::ones));
+		QVERIFY_EXCEPTION_THROWN(file.writeNeighborhoodSnips(*m_hidensFile, idx, 0),
+				std::logic_error);
+		file.writeNeighborhoodSnips(*m_hidensFile, idx, k);
+	}
+
+	HidensSnipFile file(filename.toStdString());
+	for (arma::uword c = 0; c < channels.n_elem; c++) {
+		arma::uvec readIdx;
+		arma::Cube<short> snips;
+		file.neighborhoodSnips(channels(c), readIdx, snips);
+		auto neighbors = file.neighborhoodChannels(channels(c));
+		QVERIFY2( (neighbors.n_elem == k) && (neighbors(0) == channels(c)) &&
+				(snips.n_slices == idx[c].n_elem) && arma::all(readIdx == idx[c]),
+				"Neighborhood snippets have the wrong channels or spikes.");
+		for (arma::uword i = 0; i < snips.n_slices; i++) {
+			for (arma::uword j = 0; j < k; j++) {
+				QVERIFY2(arma::all(snips.slice(i).col(j) == m_hidensData.col(neighbors(j)).rows(
+								idx[c](i) - nbefore, idx[c](i) + nafter)),
+						"Neighborhood snippet does not match the raw data.");
+			}
+		}
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testSnippetAlignment()
+{
+	QString filename = "test-alignment.snip";
+	if (QFile::exists(filename)) {
+		QFile::remove(filename);
+	}
+	int nsnips = 500;
+	int nbefore = snipfile::NUM_SAMPLES_BEFORE;
+	int snipsize = nbefore + snipfile::NUM_SAMPLES_AFTER + 1;
+
+	/* Gaussian troughs, each shifted from the nominal peak by up to half a sample */
+	arma::vec shifts = arma::randu<arma::vec>(nsnips) - 0.5;
+	std::vector<arma::uvec> idx = { arma::regspace<arma::uvec>(0, nsnips - 1) * 100 };
+	std::vector<arma::Mat<short> > snips = { arma::Mat<short>(snipsize, nsnips) };
+	for (int i = 0; i < nsnips; i++) {
+		arma::vec t = arma::regspace<arma::vec>(0, snipsize - 1) - nbefore - shifts(i);
+		snips[0].col(i) = arma::conv_to<arma::Col<short> >::from(
+				arma::round(-1000. * arma::exp(-arma::square(t) / 4.5)));
+	}
+	{
+		SnipFile file(filename.toStdString(), *m_dataFile);
+		file.setChannels(arma::uvec{ 0 });
+		file.setThresholds(arma::vec{ 1. });
+		file.writeSpikeSnips(idx, snips);
+	}
+
+	for (auto kernel : { alignment::WindowedSinc, alignment::Cubic }) {
+		alignment::Options options;
+		options.kernel = kernel;
+		options.storeSnippets = true;
+		options.batchSnippets = 128;
+		{
+			SnipFile file(filename.toStdString(), true);
+			file.alignSpikes(options);
+		}
+
+		SnipFile file(filename.toStdString());
+		arma::vec times = file.spikeTimes(0);
+		QVERIFY2( (times.n_elem == static_cast<arma::uword>(nsnips)) &&
+				(arma::abs(times - arma::conv_to<arma::vec>::from(idx[0]) - shifts).max() < 0.1),
+				"Refined spike times do not recover the sub-sample shifts.");
+		arma::uvec readIdx;
+		arma::Mat<short> aligned;
+		file.alignedSnips(0, readIdx, aligned);
+		QVERIFY2(arma::all(readIdx == idx[0]) &&
+				arma::all(arma::index_min(aligned).t() == static_cast<arma::uword>(nbefore)),
+				"Aligned snippets do not peak at the nominal peak sample.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testSnippetClustering()
+{
+	QString filename = "test-clustering.snip";
+	if (QFile::exists(filename)) {
+		QFile::remove(filename);
+	}
+	int nsnips = 5000;
+	arma::uword nclusters = 3;
+	int snipsize = snipfile::NUM_SAMPLES_BEFORE + snipfile::NUM_SAMPLES_AFTER + 1;
+
+	/* Noisy copies of templates whose troughs fall at different samples */
+	arma::uvec truth = arma::randi<arma::uvec>(nsnips, arma::distr_param(0, nclusters - 1));
+	arma::mat templates(snipsize, nclusters, arma::fill::zeros);
+	for (arma::uword k = 0; k < nclusters; k++)
+		templates(snipfile::NUM_SAMPLES_BEFORE + 4 * k, k) = -500.;
+	std::vector<arma::uvec> idx = { arma::regspace<arma::uvec>(0, nsnips - 1) * 100 };
+	std::vector<arma::Mat<short> > snips = { arma::conv_to<arma::Mat<short> >::from(
+			templates.cols(truth) + 20. * arma::randn<arma::mat>(snipsize, nsnips)) };
+	{
+		SnipFile file(filename.toStdString(), *m_dataFile);
+		file.setChannels(arma::uvec{ 0 });
+		file.setThresholds(arma::vec{ 1. });
+		file.writeSpikeSnips(idx, snips);
+	}
+	{
+		clustering::Options options;
+		options.nclusters = nclusters;
+		options.batchSize = 512;
+		options.iterations = 20;
+		SnipFile file(filename.toStdString(), true);
+		arma::mat centers = file.clusterSpikes(0, options);
+		QVERIFY2( (centers.n_rows == static_cast<arma::uword>(snipsize)) &&
+				(centers.n_cols == nclusters), "Cluster centers have the wrong shape.");
+	}
+
+	SnipFile file(filename.toStdString());
+	arma::ivec labels = file.labels(0);
+	QVERIFY2(file.units(0).n_elem == nclusters, "Snippets were not split into every cluster.");
+	for (arma::uword k = 0; k < nclusters; k++) {
+		arma::ivec assigned = labels.elem(arma::find(truth == k));
+		QVERIFY2(arma::all(assigned == assigned(0)),
+				"Snippets from one template were split across clusters.");
+	}
+	QFile::remove(filename);
+}
+
+void DatafileTest::testCorrelograms()
+{
+	std::vector<arma::uvec> trains(3);
+	for (auto& train : trains) {
+		train = arma::cumsum(arma::randi<arma::uvec>(2000, arma::distr_param(1, 200)));
+	}
+	spiketrains::CorrelogramOptions options;
+	options.maxLag = 60;
+	options.binSize = 5;
+	arma::ucube counts = spiketrains::correlograms(trains, options);
+	arma::uword nbins = spiketrains::correlogramBins(options);
+	QVERIFY2( (counts.n_rows == nbins) && (counts.n_cols == trains.size()) &&
+			(counts.n_slices == trains.size()), "Correlograms have the wrong shape.");
+
+	/* Count the lags of all pairs directly */
+	arma::sword offset = (nbins / 2) * options.binSize + options.binSize / 2;
+	for (arma::uword i = 0; i < trains.size(); i++) {
+		for (arma::uword j = 0; j < trains.size(); j++) {
+			arma::uvec expected(nbins, arma::fill::zeros);
+			for (arma::uword a = 0; a < trains[i].n_elem; a++) {
+				for (arma::uword b = 0; b < trains[j].n_elem; b++) {
+					arma::sword lag = static_cast<arma::sword>(trains[j](b)) -
+						static_cast<arma::sword>(trains[i](a)) + offset;
+					if ( ((i == j) && (a == b)) || (lag < 0) ||
+							(lag >= static_cast<arma::sword>(nbins * options.binSize)) ) {
+						continue;
+					}
+					expected(lag / options.binSize)++;
+				}
+			}
+			QVERIFY2(arma::all(counts.slice(j).col(i) == expected),
+					"Correlogram does not match a direct count of lags.");
+		}
+	}
+	QVERIFY2(arma::all(spiketrains::autoCorrelogram(trains[0], options) ==
+				counts.slice(0).col(0)),
+			"Autocorrelogram does not match the correlogram of a train with itself.");
+
+	auto isi = spiketrains::isiViolations(trains[1], 20);
+	QVERIFY2( (isi.nspikes == trains[1].n_elem) &&
+			(isi.violations == arma::uword(arma::accu(arma::diff(trains[1]) < 20))),
+			"Refractory violations were counted incorrectly.");
+	QVERIFY_EXCEPTION_THROWN(spiketrains::autoCorrelogram(arma::uvec{ 5, 2 }),
+			std::logic_error);
+}
+
+void DatafileTest::testPsth()
+{
+	std::vector<arma::uvec> trains(4);
+	for (auto& train : trains) {
+		train = arma::cumsum(arma::randi<arma::uvec>(5000, arma::distr_param(1, 100)));
+	}
+	arma::uvec triggers = arma::randi<arma::uvec>(200, arma::distr_param(0, 250000));
+	triggers(0) = 10;	// window starts before the first sample
+	spiketrains::PsthOptions options;
+	options.before = 40;
+	options.after = 250;
+	options.binSize = 25;
+	arma::ucube trials = spiketrains::binnedTrials(trains, triggers, options);
+	arma::umat counts = spiketrains::psth(trains, triggers, options);
+	arma::uword nbins = spiketrains::psthBins(options);
+	QVERIFY2( (nbins == 12) && (trials.n_rows == nbins) &&
+			(trials.n_cols == triggers.n_elem) && (trials.n_slices == trains.size()),
+			"Binned trials have the wrong shape.");
+
+	for (arma::uword j = 0; j < trains.size(); j++) {
+		arma::uvec total(nbins, arma::fill::zeros);
+		for (arma::uword k = 0; k < triggers.n_elem; k++) {
+			arma::uvec expected(nbins, arma::fill::zeros);
+			for (auto s : trains[j]) {
+				arma::sword lag = static_cast<arma::sword>(s) -
+					static_cast<arma::sword>(triggers(k)) + options.before;
+				if ( (lag >= 0) &&
+						(lag < static_cast<arma::sword>(options.before + options.after)) ) {
+					expected(lag / options.binSize)++;
+				}
+			}
+			QVERIFY2(arma::all(trials.slice(j).col(k) == expected),
+					"Binned trial does not match a direct count of spikes.");
+			total += expected;
+		}
+		QVERIFY2(arma::all(counts.col(j) == total),
+				"PSTH is not the sum of the binned trials.");
+	}
+}
+
+void DatafileTest::testTemplateDetection()
+{
+	QString filename = "test-detection.h5";
+	QString snipname = "test-detection.snip";
+	for (auto& name : { filename, snipname }) {
+		if (QFile::exists(name))
+			QFile::remove(name);
+	}
+	synthetic::Parameters params;
+	params.seconds = 2.;
+	params.nunits = 4;
+	params.amplitude = 200.;
+	params.amplitudeJitter = 0.;
+	synthetic::GroundTruth truth;
+	{
+		DataFile df(filename.toStdString());
+		df.setGain(1.);
+		df.setOffset(0.);
+		df.setDate("2016-01-01T00:00:00");
+		truth = synthetic::generate(df, params);
+	}
+
+	/* One template per unit, on its primary channel */
+	DataFile df(filename.toStdString());
+	arma::vec waveform = synthetic::spikeWaveform(df.sampleRate());
+	std::vector<detection::Template> templates(params.nunits);
+	for (int unit = 0; unit < params.nunits; unit++) {
+		templates[unit].waveform = params.amplitude * waveform;
+		templates[unit].channels = arma::uvec{ static_cast<arma::uword>(
+				synthetic::unitChannel(params, unit, df.nchannels())) };
+		templates[unit].peak = synthetic::WaveformSamplesBefore;
+	}
+	detection::Options options;
+	options.fftSize = 8192;
+	std::vector<detection::Detection> detections;
+	{
+		SnipFile snips(snipname.toStdString(), df);
+		detections = detection::detect(df, templates, snips, options);
+	}
+
+	/* Nearly every spike should be detected by its unit's template */
+	size_t found = 0;
+	for (auto& spike : truth) {
+		found += std::any_of(detections.begin(), detections.end(),
+				[&spike](const detection::Detection& d) {
+					return (d.templ == static_cast<arma::uword>(spike.unit)) &&
+						(std::abs(static_cast<double>(d.sample) - spike.sample) <= 1.);
+				});
+	}
+	QVERIFY2(found >= 0.95 * truth.size(), "Template matching missed too many spikes.");
+
+	/* Detections are stored on the template's channel, labeled by template */
+	SnipFile snips(snipname.toStdString());
+	for (int unit = 0; unit < params.nunits; unit++) {
+		arma::uword channel = templates[unit].channels(0);
+		arma::uvec expected;
+		for (auto& d : detections) {
+			if (d.templ == static_cast<arma::uword>(unit))
+				expected.insert_rows(expected.n_elem, arma::uvec{ d.sample });
+		}
+		QVERIFY2(arma::all(snips.spikeIdx(channel) == expected) &&
+				arma::all(snips.labels(channel) == unit),
+				"Detections were not written to the snippet file.");
+	}
+	QFile::remove(filename);
+	QFile::remove(snipname);
+}
+
+/* Create a test file with the given name and number of channels, recorded
+ * at 20 kHz, replacing any existing file. The attributes needed to open the
+ * file again are set.
+ */
+std::unique_ptr<DataFile> makeTestFile(const QString& name, int nchannels, double gain)
+{
+	if (QFile::exists(name))
+		QFile::remove(name);
+	std::unique_ptr<DataFile> df(new DataFile(name.toStdString(), "mcs", nchannels));
+	df->setSampleRate(20000.);
+	df->setGain(gain);
+	df->setOffset(0.);
+	df->setDate("2016-01-01T00:00:00");
+	return df;
+}
+
+void DatafileTest::testLfp()
+{
+	QString filename = "test-lfp.h5";
+
+	/* A slow sine on each channel, plus a fast one shared by all */
+	const int nchannels = 4;
+	const sample_index nsamples = 50000;
+	const double pi = std::acos(-1.);
+	arma::Mat<short> data(nsamples, nchannels);
+	for (int c = 0; c < nchannels; c++) {
+		for (sample_index i = 0; i < nsamples; i++) {
+			data(i, c) = static_cast<short>(std::lround(
+						1000. * std::sin(2. * pi * 10. * i / 20000. + c) +
+						1000. * std::sin(2. * pi * 2000. * i / 20000.)));
+		}
+	}
+	makeTestFile(filename, nchannels, 0.5)->setData(0, nsamples, data);
+	{
+		DataFile df(filename.toStdString());
+		QVERIFY2(!df.hasLfp(), "File should not have an LFP before it is computed.");
+		LfpOptions options;
+		options.nthreads = 3;
+		df.computeLfp(options);
+	}
+
+	DataFile df(filename.toStdString());
+	QVERIFY2(df.hasLfp(), "LFP was not stored in the file.");
+	QVERIFY2(df.lfpSampleRate() == 1000.f, "LFP has the wrong sample rate.");
+	QVERIFY2(df.lfpSamples() == nsamples / 20, "LFP has the wrong number of samples.");
+
+	/* Away from the edges, only the slow sine should remain */
+	arma::fmat lfp;
+	df.lfp(0, nchannels, 0, df.lfpSamples(), lfp);
+	double error = 0.;
+	for (int c = 0; c < nchannels; c++) {
+		for (sample_index i = 20; i < df.lfpSamples() - 20; i++) {
+			error = std::max(error, std::abs(lfp(i, c) -
+						1000. * std::sin(2. * pi * 10. * i / 1000. + c)));
+		}
+	}
+	QVERIFY2(error < 2., "LFP does not match the low-pass filtered data.");
+
+	auto volts = df.lfp(100, 200);
+	QVERIFY2(std::abs(volts(0, 1) - df.gain() * lfp(100, 1)) < 1e-3,
+			"LFP in volts is not scaled by the gain.");
+	QVERIFY_EXCEPTION_THROWN(df.lfp(0, df.lfpSamples() + 1), std::logic_error);
+	QFile::remove(filename);
+}
+
+void DatafileTest::testSpikePower()
+{
+	QString filename = "test-spike-power.h5";
+	QString partialname = "test-spike-power-partial.h5";
+	for (auto& name : { filename, partialname }) {
+		if (QFile::exists(name))
+			QFile::remove(name);
+	}
+
+	/* A sine in the spike band, one below it, and one which grows */
+	const int nchannels = 3;
+	const sample_index nsamples = 60000;
+	const double pi = std::acos(-1.);
+	arma::Mat<short> data(nsamples, nchannels);
+	for (sample_index i = 0; i < nsamples; i++) {
+		data(i, 0) = static_cast<short>(std::lround(500. * std::sin(2. * pi * 1000. * i / 20000.)));
+		data(i, 1) = static_cast<short>(std::lround(2000. * std::sin(2. * pi * 10. * i / 20000.)));
+		data(i, 2) = static_cast<short>(std::lround(500. +
+					((i < nsamples / 2) ? 100. : 300.) * std::sin(2. * pi * 1500. * i / 20000.)));
+	}
+	makeTestFile(filename, nchannels, 0.5)->setData(0, nsamples, data);
+
+	SpikePowerOptions options;
+	options.fftSize = 4096;
+	options.nthreads = 3;
+	arma::fmat power;
+	{
+		DataFile df(filename.toStdString());
+		QVERIFY2(df.computeSpikePower(options) == nsamples / 200,
+				"Spike-band power has the wrong number of bins.");
+		QVERIFY2(df.computeSpikePower(options) == 0,
+				"Spike-band power should not be recomputed with the same options.");
+		df.derived(SpikePowerDataset, 0, nchannels, 0, df.spikePowerBins(), power);
+	}
+	const double rms = 1. / std::sqrt(2.);
+	QVERIFY2(std::abs(power(150, 0) - 500. * rms) < 5., "Spike-band power of a sine is wrong.");
+	QVERIFY2(power(150, 1) < 5., "Spike-band power includes slow signals.");
+	QVERIFY2( (std::abs(power(50, 2) - 100. * rms) < 5.) &&
+			(std::abs(power(250, 2) - 300. * rms) < 5.),
+			"Spike-band power does not follow changes in amplitude.");
+
+	/* Computing the power as the file is written gives the same bins */
+	{
+		auto df = makeTestFile(partialname, nchannels, 0.5);
+		sample_index computed = 0;
+		for (sample_index start = 0; start < nsamples; start += 7000) {
+			sample_index end = std::min<sample_index>(start + 7000, nsamples);
+			arma::Mat<short> part = data.rows(start, end - 1);
+			df->setData(start, end, part);
+			computed += df->computeSpikePower(options);
+		}
+		QVERIFY2( (computed == df->spikePowerBins()) && (computed > 0),
+				"Spike-band power was not computed as the file was written.");
+		arma::fmat partial;
+		df->derived(SpikePowerDataset, 0, nchannels, 0, computed, partial);
+		double error = 0.;
+		for (int c = 0; c < nchannels; c++) {
+			for (sample_index i = 0; i < computed; i++)
+				error = std::max<double>(error, std::abs(partial(i, c) - power(i, c)));
+		}
+		QVERIFY2(error < 1e-2, "Spike-band power computed as the file is written does not match.");
+	}
+	QFile::remove(filename);
+	QFile::remove(partialname);
+}
+
+void DatafileTest::testPsd()
+{
+	QString filename = "test-psd.h5";
+	QString partialname = "test-psd-partial.h5";
+	for (auto& name : { filename, partialname }) {
+		if (QFile::exists(name))
+			QFile::remove(name);
+	}
+
+	/* White noise on one channel, and a sine on the other */
+	const int nchannels = 2;
+	const sample_index nsamples = 100000;
+	const double pi = std::acos(-1.), sigma = 20., amplitude = 400.;
+	arma::Mat<short> data(nsamples, nchannels);
+	std::mt19937 rng(3);
+	std::normal_distribution<double> noise(0., sigma);
+	for (sample_index i = 0; i < nsamples; i++) {
+		data(i, 0) = static_cast<short>(std::lround(noise(rng) + 100.));
+		data(i, 1) = static_cast<short>(std::lround(amplitude *
+					std::sin(2. * pi * 1000. * i / 20000.)));
+	}
+	makeTestFile(filename, nchannels, 0.5)->setData(0, nsamples, data);
+
+	PsdOptions options;
+	options.segmentSize = 1024;
+	options.overlap = 512;
+	options.nthreads = 3;
+	samples psd;
+	{
+		DataFile df(filename.toStdString());
+		const sample_index nsegments = (nsamples - 1024) / 512 + 1;
+		QVERIFY2(df.computePsd(options) == nsegments, "Wrong number of segments were averaged.");
+		QVERIFY2( (df.psdSegments() == nsegments) && (df.computePsd(options) == 0),
+				"Segments already averaged should not be transformed again.");
+		psd = df.psd();
+		arma::vec frequencies = df.psdFrequencies();
+		QVERIFY2( (psd.n_rows == 513) && (frequencies(512) == df.sampleRate() / 2),
+				"Power spectral density has the wrong frequencies.");
+
+		/* The density of white noise is its variance over the Nyquist
+		 * frequency, and the total power of a sine is half its squared amplitude.
+		 */
+		const double resolution = frequencies(1) - frequencies(0);
+		double white = 0., sine = 0.;
+		for (arma::uword k = 10; k < 500; k++)
+			white += psd(k, 0) / 490;
+		for (arma::uword k = 0; k < psd.n_rows; k++)
+			sine += psd(k, 1) * resolution;
+		const double gain2 = df.gain() * df.gain();
+		QVERIFY2(std::abs(white / (gain2 * sigma * sigma / 10000.) - 1.) < 0.05,
+				"Power spectral density of white noise is wrong.");
+		QVERIFY2(std::abs(sine / (gain2 * amplitude * amplitude / 2.) - 1.) < 0.01,
+				"Power spectral density of a sine is wrong.");
+	}
+
+	/* Updating the estimate as the file is written gives the same result */
+	{
+		auto df = makeTestFile(partialname, nchannels, 0.5);
+		for (sample_index start = 0; start < nsamples; start += 9000) {
+			sample_index end = std::min<sample_index>(start + 9000, nsamples);
+			arma::Mat<short> part = data.rows(start, end - 1);
+			df->setData(start, end, part);
+			df->computePsd(options);
+		}
+		auto partial = df->psd();
+		double error = 0.;
+		for (arma::uword i = 0; i < psd.n_elem; i++)
+			error = std::max(error, std::abs(partial(i) - psd(i)) / psd(i));
+		QVERIFY2(error < 1e-4, "Incremental power spectral density does not match.");
+	}
+	QFile::remove(filename);
+	QFile::remove(partialname);
+}
+
+void DatafileTest::testChannelScan()
+{
+	QString filename = "test-channel-scan.h5";
+
+	/* Noise on every channel, except that channel 1 is dead, channel 3
+	 * saturates, channels 5 and 6 are shorted, and channel 7 is flat for
+	 * a stretch spanning several blocks.
+	 */
+	const int nchannels = 8;
+	const sample_index nsamples = 100000;
+	arma::Mat<short> data(nsamples, nchannels);
+	std::mt19937 rng(5);
+	std::normal_distribution<double> noise(0., 20.);
+	for (int c = 0; c < nchannels; c++) {
+		for (sample_index i = 0; i < nsamples; i++)
+			data(i, c) = static_cast<short>(std::lround(noise(rng) + 500.));
+	}
+	for (sample_index i = 0; i < nsamples; i++) {
+		data(i, 1) = 0;
+		if (i % 100 == 0)
+			data(i, 3) = std::numeric_limits<short>::max();
+		data(i, 6) = data(i, 5);
+	}
+	const sample_index flatStart = 15000, flatEnd = 45000;
+	for (sample_index i = flatStart; i < flatEnd; i++)
+		data(i, 7) = 123;
+	{
+		auto df = makeTestFile(filename, nchannels, 1.);
+		df->setData(0, nsamples, data);
+		QVERIFY2(df->goodChannels().n_elem == nchannels,
+				"Every channel should be good before a scan.");
+		ChannelScanOptions options;
+		options.nthreads = 3;
+		auto quality = df->scanChannels(options);
+		QVERIFY2(std::abs(quality.rms(0) - 20.) < 1., "RMS of a channel is wrong.");
+		QVERIFY2(quality.saturation(3) == 0.01, "Saturation of a channel is wrong.");
+		QVERIFY2( (quality.flatRun(1) == static_cast<arma::uword>(nsamples)) &&
+				(quality.flatRun(7) == static_cast<arma::uword>(flatEnd - flatStart)),
+				"Flat runs spanning blocks were not joined.");
+		QVERIFY2(quality.correlation(5) > 0.999, "Correlation of shorted channels is wrong.");
+	}
+
+	DataFile df(filename.toStdString());
+	arma::uvec good = df.goodChannels();
+	QVERIFY2( (good.n_elem == 3) && (good(0) == 0) && (good(1) == 2) && (good(2) == 4),
+			"Bad channels were not found and stored.");
+	arma::Mat<short> goodData;
+	df.data(good, 10, 20, goodData);
+	for (arma::uword c = 0; c < good.n_elem; c++) {
+		QVERIFY2(arma::all(goodData.col(c) == data(arma::span(10, 19), good(c))),
+				"Data read from the good channels is wrong.");
+	}
+
+	QString snipname = "test-channel-scan.snip";
+	if (QFile::exists(snipname)) {
+		QFile::remove(snipname);
+	}
+	{
+		snipfile::StorageOptions storage;
+		storage.skipBadChannels = true;
+		SnipFile snips(snipname.toStdString(), df, snipfile::NUM_SAMPLES_BEFORE,
+				snipfile::NUM_SAMPLES_AFTER, storage);
+		snips.setChannels(arma::regspace<arma::uvec>(0, nchannels - 1));
+		arma::uvec kept = snips.channels();
+		QVERIFY2( (kept.n_elem == good.n_elem) && arma::all(kept == good),
+				"A snippet file skipping bad channels kept a bad channel.");
+	}
+	QFile::remove(snipname);
+	QFile::remove(filename);
+}
+
 QTEST_APPLESS_MAIN(DatafileTest)
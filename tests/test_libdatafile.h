@@ -12,11 +12,16 @@
 #include "../include/hidensfile.h"
 #include "../include/snipfile.h"
 #include "../include/hidenssnipfile.h"
+#include "../include/synthetic.h"
+#include "../include/spiketrains.h"
+#include "../include/detection.h"
+#include "../include/typeddatafile.h"
 
 #include <QtCore>
 #include <QtTest/QtTest>
 
 #include <memory> // for std::unique_ptr
+#include <sstream>
 
 using namespace datafile;
 using namespace hidensfile;
@@ -84,6 +89,127 @@ class DatafileTest : public QObject {
 		 */
 		void testReadWriteMeans();
 
+		/*! Test that reads are recorded by the file's I/O counters, and
+		 * that the counters can be reset.
+		 */
+		void testIoStats();
+
+		/*! Test the percentiles computed by the latency histogram, and
+		 * that the deadline callback is invoked for slow operations.
+		 */
+		void testLatencyHistogram();
+
+		/*! Test that reads are traced when tracing is compiled in, and that
+		 * the trace is written in the Chrome trace event format.
+		 */
+		void testTrace();
+
+		/*! Test generating a synthetic recording in parallel, verifying that
+		 * it is reproducible and that the ground-truth spikes are present.
+		 */
+		void testSyntheticRecording();
+
+		/*! Test reading and writing files whose sample type is fixed
+		 * at compile time, and that opening a file with the wrong sample
+		 * type throws.
+		 */
+		void testTypedDataFile();
+
+		/*! Test writing and reading data beyond 2^31 samples. Only the
+		 * chunks actually written are allocated, so the file stays small.
+		 */
+		void testLargeSampleIndices();
+
+		/*! Test reading and writing a file with a sample-major layout,
+		 * which must return the same data as a channel-major file.
+		 */
+		void testSampleMajorLayout();
+
+		/*! Test that small sequential writes are combined into whole-chunk
+		 * writes, and that staged data is read back and written on flush.
+		 */
+		void testWriteCombining();
+
+		/*! Test that buffers are reused by the pool, and that pooled reads
+		 * of data and snippets return the same values as other reads.
+		 */
+		void testBufferPool();
+
+		/*! Test gathering windows of data around many events, which must
+		 * match windows read one event at a time.
+		 */
+		void testReadWindows();
+
+		/*! Test that repeated reads from single channels, which use cached
+		 * handles to each channel's datasets, return the same snippets.
+		 */
+		void testCachedChannelReads();
+
+		/*! Test that snippets written with each kind of compression, and
+		 * with delta-encoded indices, are read back exactly.
+		 */
+		void testSnippetCompression();
+
+		/*! Test that selecting spike snippets by amplitude returns exactly
+		 * the snippets whose peak or trough is large enough.
+		 */
+		void testAmplitudeIndex();
+
+		/*! Test storing cluster labels, merging and splitting units, and
+		 * reading the snippets of a single unit.
+		 */
+		void testClusterLabels();
+
+		/*! Test that neighborhood snippets extracted from a HiDens file
+		 * match the raw data on each channel of the neighborhood.
+		 */
+		void testNeighborhoodSnippets();
+
+		/*! Test that aligning snippets of a waveform shifted by a fraction
+		 * of a sample recovers the shift.
+		 */
+		void testSnippetAlignment();
+
+		/*! Test that clustering snippets drawn from well-separated
+		 * templates labels each template with a single cluster.
+		 */
+		void testSnippetClustering();
+
+		/*! Test that correlograms and refractory violations computed by
+		 * merging spike trains match a direct count over all pairs.
+		 */
+		void testCorrelograms();
+
+		/*! Test that binning spikes around triggers matches a direct
+		 * count of the spikes in each trial's window.
+		 */
+		void testPsth();
+
+		/*! Test that template matching finds the spikes of a synthetic
+		 * recording and writes them, labeled, to a snippet file.
+		 */
+		void testTemplateDetection();
+
+		/*! Test that the LFP is low-pass filtered, decimated, and stored
+		 * with its own sample rate.
+		 */
+		void testLfp();
+
+		/*! Test that spike-band power is computed in bins, and that
+		 * computing it while a file is written matches computing it once.
+		 */
+		void testSpikePower();
+
+		/*! Test that the Welch estimate of the power spectral density is
+		 * correctly scaled, and is the same when updated incrementally.
+		 */
+		void testPsd();
+
+		/*! Test that a scan finds dead, saturated, flat and shorted
+		 * channels, and that only the good channels are then read.
+		 */
+		void testChannelScan();
+
 	private:
 		QString m_datafileName;
 		QString m_hidensfileName;
@@ -16,7 +16,7 @@ LIBS += -L/usr/local/lib -L../lib/ \
 	-ldatafile -larmadillo -lhdf5_cpp -lhdf5
 
 QT += testlib
-CONFIG += testcase debug c++11
+CONFIG += testcase debug c++11 thread
 CONFIG -= app_bundle
 
 QMAKE_RPATHDIR += ../lib/